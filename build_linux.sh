@@ -1,3 +1,13 @@
 #!/bin/bash
 g++ dumprom.cpp -o dumprom
 g++ makerom.cpp -o makerom
+g++ -O2 rombench.cpp -o rombench
+g++ -O2 romd.cpp -o romd
+g++ -O2 romfp.cpp -o romfp
+g++ -O2 romsim.cpp -o romsim
+g++ -O2 romdiff.cpp -o romdiff
+g++ -O2 rompatch.cpp -o rompatch
+g++ -O2 romedit.cpp -o romedit
+g++ -O2 romplan.cpp -o romplan
+g++ -O2 -pthread romgrep.cpp -o romgrep
+g++ -O2 -pthread romdat.cpp -o romdat
@@ -4,13 +4,37 @@ dumprom - Andy Anderson 2020
 Quick and dirty tool to extract files from Epson PX-8 ROM capsules (and probably PX-4, EHT-10).
 
 Currently hard-coded for;
-* M format (loaded into TPA for execution).
+* M format (loaded into TPA for execution) and P format (executed in place) - the directory is the same.
 * Requires all files in current directory (i.e. the file-name splitting code will break if directories are specified).
 
 To compile on linux;
 
     g++ dumprom.cpp -o dumprom
 
+Usage;
+
+    dumprom [--stats=json] [--io=sync|uring] [--offset=<n>] [--dedup=hardlink|reflink] <romfile> [romfile...]
+
+A single image is extracted to the current directory. In a batch run (several romfiles) each
+image is extracted into a directory named after the rom file. --stats=json prints per-phase
+timings and I/O counters for the whole run to stdout. --io=uring keeps many reads and writes
+in flight through io_uring (linux), falling back to synchronous I/O where it is not available.
+
+--dedup writes each distinct file once per run. A file identical (by SHA-1) to one already
+extracted is hard linked to it, or with reflink cloned with FICLONE (linux, on file systems that
+share extents such as btrfs and XFS), so the many copies of e.g. BASIC.COM in a collection take
+the space of one. Hard linked files are one file: editing one copy changes them all. Where a
+link or clone cannot be made the file is written as usual.
+
+Romfiles may be binary, Intel HEX or S-records (as saved by EPROM programmers). --offset skips
+that many bytes of a binary dump, or gives the address of the start of the image in a hex dump
+(by default the lowest address in the file).
+
+The layout of the dump is detected (see detect_layout() in epsonrom.h): the capacity, whether the
+27256 halves are swapped, and trailing padding or mirrors from reading a small ROM as a larger one.
+
+Shared structures and the directory walk are in epsonrom.h.
+
 Reference documentation;
 * PX-8 OS Reference Manual - chapter 15
 * EHT-10 Development Tool User's Guide - Appendix 1
@@ -25,183 +49,843 @@ Reference documentation;
 #include <fstream>
 #include <iostream>
 #include <streambuf>
+#include <cstdio>
+#include <unordered_map>
 
-#ifdef _MSC_VER
-#define PACK_PRE __pragma (pack( push, 1))
-#define PACK_POST __pragma (pack( pop ))
-#define PACK_ATTRIBUTE
+#ifdef _WIN32
+#include <direct.h>
 #else
-#define PACK_PRE
-#define PACK_POST
-#define PACK_ATTRIBUTE __attribute__((packed))
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#undef BLOCK_SIZE // also defined by epsonrom.h
+#endif
 #endif
 
-const uint32_t RECORD_SIZE = 128;
+#include "epsonrom.h"
+#include "romstats.h"
+#include "romio.h"
+#include "romhex.h"
+#include "romhash.h"
+
+const size_t PATH_BUFFER_SIZE = 4096;
+
+// An output directory (up to PATH_BUFFER_SIZE including its terminator) and an 8.3 file name
+const size_t OUTPUT_PATH_SIZE = PATH_BUFFER_SIZE + sizeof(DirEntry::file_name) + 1 + sizeof(DirEntry::file_type);
+
+enum DedupMode
+{
+    DEDUP_NONE,
+    DEDUP_HARDLINK,
+    DEDUP_REFLINK
+};
+
+// Files extracted so far in this run, by content (--dedup).
+struct DedupTable
+{
+    DedupMode mode;
+    bool reflinks; // cleared if the file system cannot clone, after which copies are written
+    std::unordered_map<std::string, std::string> paths; // SHA-1 -> the first file written with it
+
+    DedupTable() : mode(DEDUP_NONE), reflinks(true)
+    {
+    }
+};
+
+// Make target a link to, or a clone of, source. Returns false if it could not, in which case
+// the caller writes the file itself.
+static bool link_file(const char* source, const char* target, DedupTable& dedup)
+{
+#ifdef _WIN32
+    (void)source;
+    (void)target;
+    (void)dedup;
+    return false;
+#else
+    if(dedup.mode == DEDUP_HARDLINK)
+    {
+        // Fails at the file system's link limit, and the caller's copy becomes the new source
+        return link(source, target) == 0;
+    }
+
+#ifdef FICLONE
+    if(!dedup.reflinks)
+    {
+        return false;
+    }
+
+    const int in = ::open(source, O_RDONLY);
+    if(in < 0)
+    {
+        return false;
+    }
+
+    const int out = ::open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool cloned = false;
+    if(out >= 0)
+    {
+        cloned = ioctl(out, FICLONE, in) == 0;
+        if(!cloned && (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOTTY))
+        {
+            std::cerr << "Reflinks not supported, writing copies." << std::endl;
+            dedup.reflinks = false;
+        }
+        ::close(out);
+    }
+    ::close(in);
+
+    return cloned;
+#else
+    dedup.reflinks = false;
+    return false;
+#endif
+#endif
+}
+
+// Writes each file reconstructed by walk_files() to the output directory.
+// The stream and its buffer are reused for every file, so opening a file does not allocate.
+// With dedup set a file is hashed as it is reconstructed and only written when it is closed,
+// if no identical file has been written in this run; otherwise it is linked to that one.
+struct FileSink
+{
+    std::ofstream outFile;
+    char outBuffer[64 * 1024];
+    char path[OUTPUT_PATH_SIZE];
+    const char* directory; // empty, or ends with a path separator
+    RomStats* stats;
+    DedupTable* dedup;
+    Sha1 sha;
+    std::vector<std::pair<const uint8_t*, uint32_t> > chunks; // in the image, held until close
+    uint64_t fileSize;
+    bool failed; // a file could not be written (and has been reported)
+
+    FileSink() : directory(""), stats(NULL), dedup(NULL), fileSize(0), failed(false)
+    {
+        // Must be set before the first open
+        outFile.rdbuf()->pubsetbuf(outBuffer, sizeof(outBuffer));
+    }
+
+    void open(const char* fileName)
+    {
+        PhaseTimer timer(stats, PHASE_WRITE);
+
+        snprintf(path, sizeof(path), "%s%s", directory, fileName);
+
+        if(stats)
+        {
+            ++stats->files;
+        }
+
+        if(dedup)
+        {
+            sha.reset();
+            chunks.clear();
+            fileSize = 0;
+            return;
+        }
+
+        open_output();
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        PhaseTimer timer(stats, PHASE_WRITE);
+
+        if(dedup)
+        {
+            sha.update(data, size);
+            chunks.push_back(std::make_pair(data, size));
+            fileSize += size;
+            return;
+        }
+
+        write_output(data, size);
+    }
+
+    void close()
+    {
+        PhaseTimer timer(stats, PHASE_WRITE);
+
+        if(dedup)
+        {
+            close_dedup();
+            return;
+        }
+
+        close_output();
+    }
+
+private:
+    bool open_output()
+    {
+        outFile.clear();
+        outFile.open(path, std::ios::out | std::ios::binary);
+        if(!outFile)
+        {
+            report_error("Could not open output file.", path);
+            failed = true;
+            return false;
+        }
+
+        if(stats)
+        {
+            ++stats->opens;
+        }
+
+        return true;
+    }
+
+    void write_output(const uint8_t* data, const uint32_t size)
+    {
+        if(!outFile.is_open())
+        {
+            return;
+        }
+
+        outFile.write((const char*)data, size);
+
+        if(stats)
+        {
+            ++stats->writes;
+            stats->bytesWritten += size;
+        }
+    }
+
+    bool close_output()
+    {
+        if(!outFile.is_open())
+        {
+            return false;
+        }
+
+        const bool written = outFile.good();
+        outFile.close();
+
+        if(stats)
+        {
+            ++stats->closes;
+        }
+
+        if(!written || !outFile)
+        {
+            report_error("Failed to write to output file.", path);
+            failed = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    void close_dedup()
+    {
+        uint8_t digest[SHA1_SIZE];
+        sha.final(digest);
+        const std::string key((const char*)digest, SHA1_SIZE);
+
+        // Never write through an existing file - it may be linked to one from another image
+        remove(path);
 
-PACK_PRE
-struct RomHeader
+        std::unordered_map<std::string, std::string>::iterator known = dedup->paths.find(key);
+        if(known != dedup->paths.end() && link_file(known->second.c_str(), path, *dedup))
+        {
+            if(stats)
+            {
+                ++stats->filesLinked;
+                stats->bytesLinked += fileSize;
+            }
+            return;
+        }
+
+        if(!open_output())
+        {
+            return;
+        }
+
+        for(size_t i=0; i<chunks.size(); ++i)
+        {
+            write_output(chunks[i].first, chunks[i].second);
+        }
+
+        if(close_output())
+        {
+            dedup->paths[key] = path;
+        }
+    }
+};
+
+// Everything needed to extract one image. One per thread, reused for every image in a batch,
+// so once the image buffer has grown to the largest image extraction makes no heap allocations.
+struct ExtractContext
 {
-    uint8_t id[2]; // 0xE5, (0x37=M format, 0x50=P format)
-    uint8_t capacity; // 0x08=64kbits, 0x10=128kbits, 0x20=256kbits, 0x40=512kbits, 0x80=1mbits
-    uint8_t checksum[2];
-    uint8_t system_name[3];
-    uint8_t rom_name[14];
-    uint8_t dir_entries; // number of entries + 1 (then rounded up to a multiple of 4)
-    uint8_t v;
-    uint8_t version[2];
-    uint8_t month[2];
-    uint8_t day[2];
-    uint8_t year[2];
-} PACK_ATTRIBUTE;
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> scratch; // hex decoding
+    std::ifstream inFile;
+    char inBuffer[4096];
+    FileSink sink;
+    char directory[PATH_BUFFER_SIZE];
+
+    ExtractContext()
+    {
+        // Images are read with a single read() straight into the image, so this buffer
+        // only stops the stream allocating one of its own on every open
+        inFile.rdbuf()->pubsetbuf(inBuffer, sizeof(inBuffer));
+        directory[0] = 0;
+    }
+};
 
-struct DirEntry
+static void dump_files(const uint8_t* romBase, const uint32_t romSize, FileSink& sink)
 {
-    uint8_t validity; // 0x00=valid 0xE5=invalid
-    uint8_t file_name[8];
-    uint8_t file_type[3];
-    uint8_t logical_extent;
-    uint16_t zero;
-    uint8_t record_count; // 0 to 128. number of 128 byte records controlled by the dir entry
-    uint8_t allocation_map[16]; // The IDs of each 1K block used by the file
-} PACK_ATTRIBUTE;
-PACK_POST
+    PhaseTimer timer(sink.stats, PHASE_WALK);
 
+    const uint32_t extents = walk_files(romBase, romSize, sink);
 
-static uint8_t* file_area_offset(const RomHeader* const hdr)
+    if(sink.stats)
+    {
+        sink.stats->extents += extents;
+    }
+}
+
+// Directory for one image of a batch run - the rom file name without its path or extension.
+static void batch_directory(const char* romFile, char* directory, const size_t directorySize)
 {
-    assert(hdr->dir_entries%4 == 0);
-    assert(hdr->dir_entries >= 0 && hdr->dir_entries <=0x20);
+    const char* name = romFile;
+    for(const char* p=romFile; *p; ++p)
+    {
+        if(*p == '/' || *p == '\\')
+        {
+            name = p + 1;
+        }
+    }
+
+    size_t length = strlen(name);
+    const char* dot = strrchr(name, '.');
+    if(dot && dot > name)
+    {
+        length = dot - name;
+    }
+
+    snprintf(directory, directorySize, "%.*s", (int)length, name);
+
+#ifdef _WIN32
+    _mkdir(directory);
+#else
+    mkdir(directory, 0777);
+#endif
 
-    return ((uint8_t*)hdr) + (hdr->dir_entries * sizeof(DirEntry));
+    snprintf(directory + strlen(directory), directorySize - strlen(directory), "/");
 }
 
-static DirEntry* dir_entry_offset(const RomHeader* const hdr, const uint8_t dir_entry)
+// Extract one image. Returns false, having reported why, if the image could not be read or any
+// of its files could not be written; a batch carries on with the next image.
+static bool dump_rom(const char* fileName, const bool batch, const uint32_t offset, DedupTable* dedup, RomStats* stats)
 {
-    assert(dir_entry >= 1);
-    assert(dir_entry <= hdr->dir_entries);
+    static thread_local ExtractContext context;
+
+    std::vector<uint8_t>& buffer = context.image;
+
+    {
+        PhaseTimer timer(stats, PHASE_READ);
+
+        std::ifstream& inFile = context.inFile;
+        inFile.clear();
+        inFile.open(fileName, std::ios::in | std::ios::binary);
+
+        if(!inFile)
+        {
+            report_error("failed to open input file.", fileName);
+            return false;
+        }
+
+        inFile.seekg(0, std::ios::end);
+        const std::streamoff size = inFile.tellg();
+        inFile.seekg(0, std::ios::beg);
+
+        // resize() keeps the capacity, so this only allocates when the image is the largest yet
+        buffer.resize((size_t)size);
+        inFile.read((char*)buffer.data(), size);
+
+        const bool readOk = !!inFile;
+        inFile.close();
+
+        if(!readOk)
+        {
+            report_error("failed to read input file.", fileName);
+            return false;
+        }
+
+        if(stats)
+        {
+            ++stats->opens;
+            ++stats->reads;
+            ++stats->closes;
+            stats->bytesRead += buffer.size();
+        }
+
+        const char* error = decode_rom_input(buffer, context.scratch, offset);
+        if(error)
+        {
+            report_error(error, fileName);
+            return false;
+        }
+    }
+
+    {
+        // convert physical to logical addresses, in whatever layout the dump has
+        PhaseTimer timer(stats, PHASE_SWAP);
+        to_logical(buffer);
+    }
+
+    const char* invalid = verify_rom(buffer.data(), (uint32_t)buffer.size());
+    if(invalid)
+    {
+        report_error(invalid, fileName);
+        return false;
+    }
+
+    if(batch)
+    {
+        batch_directory(fileName, context.directory, sizeof(context.directory));
+    }
+
+    context.sink.directory = context.directory;
+    context.sink.stats = stats;
+    context.sink.dedup = dedup;
+    context.sink.failed = false;
+
+    dump_files(buffer.data(), (uint32_t)buffer.size(), context.sink);
+
+    if(stats)
+    {
+        ++stats->images;
+    }
 
-    return (DirEntry*)(((uint8_t*)hdr) + dir_entry * sizeof(DirEntry));
+    return !context.sink.failed;
 }
 
-static uint8_t* block_address(uint8_t* fileBase, const uint8_t blockNo)
+#ifdef ROM_HAVE_IO_URING
+
+// Batch extraction through io_uring. Up to URING_SLOTS images are in progress at once; each slot
+// reads an image, walks it, then writes its files straight from the image buffer. Every read and
+// write goes through the ring, so many are in flight; opens and closes are made directly.
+
+const unsigned URING_SLOTS = 16;
+const unsigned URING_ENTRIES = 64;
+const uint32_t OP_INDEX_READ = 0xffffffff;
+
+struct UringWrite
 {
-    assert(blockNo >=1);
+    uint32_t file; // index into UringSlot::outFds
+    const uint8_t* data;
+    uint32_t length;
+    uint64_t offset;
+};
 
-    return fileBase + ((blockNo-1) * 1024);
+struct UringSlot
+{
+    const char* romFile;
+    int inFd;
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> scratch; // hex decoding
+    uint32_t bytesRead;
+    char directory[PATH_BUFFER_SIZE];
+    char path[OUTPUT_PATH_SIZE];
+
+    std::vector<int> outFds;
+    std::vector<uint32_t> outPending; // writes in flight per output file
+    std::vector<UringWrite> writes;
+    size_t nextWrite; // first write not yet queued
+    uint32_t pending; // writes not yet completed
+    bool busy;
+    bool failed; // an output file could not be opened or written (and has been reported)
+
+    UringSlot() : romFile(NULL), inFd(-1), bytesRead(0), nextWrite(0), pending(0), busy(false), failed(false)
+    {
+        directory[0] = 0;
+        outFds.reserve(MAX_DIR_ENTRIES);
+        outPending.reserve(MAX_DIR_ENTRIES);
+        writes.reserve(256);
+    }
+};
+
+// Collects the writes for one image instead of making them, so they can be queued on the ring.
+struct UringSink
+{
+    UringSlot* slot;
+    uint64_t offset;
+    RomStats* stats;
+
+    void open(const char* fileName)
+    {
+        PhaseTimer timer(stats, PHASE_WRITE);
+
+        snprintf(slot->path, sizeof(slot->path), "%s%s", slot->directory, fileName);
+
+        const int fd = ::open(slot->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+        slot->outFds.push_back(fd);
+        slot->outPending.push_back(0);
+        offset = 0;
+
+        if(fd < 0)
+        {
+            // Its writes are dropped and the rest of the image is still extracted
+            report_error("Could not open output file.", slot->path);
+            slot->failed = true;
+            return;
+        }
+
+        if(stats)
+        {
+            ++stats->files;
+            ++stats->opens;
+        }
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        if(slot->outFds.back() < 0)
+        {
+            return;
+        }
+
+        UringWrite w;
+        w.file = (uint32_t)slot->outFds.size() - 1;
+        w.data = data;
+        w.length = size;
+        w.offset = offset;
+        slot->writes.push_back(w);
+        ++slot->outPending[w.file];
+        ++slot->pending;
+        offset += size;
+    }
+
+    void close()
+    {
+    }
+};
+
+static void uring_close_outputs(UringSlot& slot, RomStats* stats)
+{
+    for(size_t i=0; i<slot.outFds.size(); ++i)
+    {
+        if(slot.outFds[i] >= 0)
+        {
+            ::close(slot.outFds[i]);
+            slot.outFds[i] = -1;
+
+            if(stats)
+            {
+                ++stats->closes;
+            }
+        }
+    }
 }
 
-static void fatal(const char* msg)
+// The slot's image is finished with - close its outputs and free the slot for the next image.
+static void uring_finish(UringSlot& slot, uint32_t& failed, RomStats* stats)
 {
-    std::cerr << msg << std::endl;
-    exit(-1);
+    uring_close_outputs(slot, stats);
+    slot.busy = false;
+
+    if(slot.failed)
+    {
+        ++failed;
+    }
 }
 
-static std::string trim(const std::string& s)
+// The image could not be read or is not valid - report it and free the slot.
+static void uring_reject(UringSlot& slot, const char* error, uint32_t& failed)
 {
-    std::string::size_type pos = s.find_first_of(' ');
+    report_error(error, slot.romFile);
 
-    if(pos == std::string::npos)
+    if(slot.inFd >= 0)
     {
-        return s;
+        ::close(slot.inFd);
+        slot.inFd = -1;
     }
 
-    return s.substr(0, pos);
+    slot.busy = false;
+    ++failed;
 }
 
-static void dump_files(const uint8_t* romBase, const uint32_t romSize)
+// The image has been read - convert it, walk the directory and collect the writes.
+static void uring_image_read(UringSlot& slot, const bool batch, const uint32_t offset, uint32_t& failed, RomStats* stats)
 {
-    const RomHeader* header = (RomHeader*)romBase;
+    ::close(slot.inFd);
+    slot.inFd = -1;
+
+    if(stats)
+    {
+        ++stats->closes;
+        stats->bytesRead += slot.image.size();
+    }
+
+    const char* error = decode_rom_input(slot.image, slot.scratch, offset);
+    if(error)
+    {
+        uring_reject(slot, error, failed);
+        return;
+    }
+
+    {
+        // convert physical to logical addresses, in whatever layout the dump has
+        PhaseTimer timer(stats, PHASE_SWAP);
+        to_logical(slot.image);
+    }
 
-    if((header->id[0] != 0xE5) && (header->id[1] != 0x37))
+    const char* invalid = verify_rom(slot.image.data(), (uint32_t)slot.image.size());
+    if(invalid)
     {
-        fatal("Not a valid rom file.");
+        uring_reject(slot, invalid, failed);
+        return;
     }
 
+    if(batch)
+    {
+        batch_directory(slot.romFile, slot.directory, sizeof(slot.directory));
+    }
 
-    uint8_t* fileBase = file_area_offset(header);
+    slot.outFds.clear();
+    slot.outPending.clear();
+    slot.writes.clear();
+    slot.nextWrite = 0;
+    slot.pending = 0;
+    slot.failed = false;
 
-    std::ofstream outFile;
+    {
+        PhaseTimer timer(stats, PHASE_WALK);
+
+        UringSink sink;
+        sink.slot = &slot;
+        sink.offset = 0;
+        sink.stats = stats;
 
-    // Enumerate files
-    uint8_t dirNo = 1;
-    std::string fileName;
-    std::string extension;
-    uint8_t extentNo = 0;
+        const uint32_t extents = walk_files(slot.image.data(), (uint32_t)slot.image.size(), sink);
 
-    while(dirNo <= header->dir_entries)
+        if(stats)
+        {
+            stats->extents += extents;
+            ++stats->images;
+        }
+    }
+
+    if(slot.pending == 0)
+    {
+        // Nothing to write (e.g. only empty files)
+        uring_finish(slot, failed, stats);
+    }
+}
+
+// Returns false if io_uring is not available, in which case nothing has been done. Images that
+// could not be extracted are reported and counted in failed; the others are still extracted.
+static bool dump_batch_uring(const std::vector<const char*>& romFiles, const bool batch, const uint32_t offset, uint32_t& failed,
+                             RomStats* stats)
+{
+    Uring ring;
+    if(!ring.init(URING_ENTRIES))
+    {
+        return false;
+    }
+
+    std::vector<UringSlot> slots(URING_SLOTS);
+    size_t nextRom = 0;
+    size_t busySlots = 0;
+
+    while(nextRom < romFiles.size() || busySlots > 0)
     {
-        DirEntry* dir = dir_entry_offset(header, dirNo);
+        // Start reading the next images in any free slots
+        for(unsigned iSlot=0; iSlot<URING_SLOTS && nextRom < romFiles.size() && ring.can_queue(); ++iSlot)
+        {
+            UringSlot& slot = slots[iSlot];
+            if(slot.busy)
+            {
+                continue;
+            }
+
+            PhaseTimer timer(stats, PHASE_READ);
+
+            slot.romFile = romFiles[nextRom++];
+            slot.inFd = ::open(slot.romFile, O_RDONLY);
+            if(slot.inFd < 0)
+            {
+                uring_reject(slot, "failed to open input file.", failed);
+                continue;
+            }
 
-        if(dir->validity == 0x00)
+            struct stat st;
+            if(fstat(slot.inFd, &st) != 0)
+            {
+                uring_reject(slot, "failed to read input file.", failed);
+                continue;
+            }
+
+            slot.image.resize((size_t)st.st_size);
+            slot.bytesRead = 0;
+            slot.busy = true;
+            ++busySlots;
+
+            if(stats)
+            {
+                ++stats->opens;
+                ++stats->reads;
+            }
+
+            ring.queue_read(slot.inFd, slot.image.data(), (uint32_t)slot.image.size(), 0, ((uint64_t)iSlot << 32) | OP_INDEX_READ);
+        }
+
+        // Queue as many collected writes as the ring has room for
+        for(unsigned iSlot=0; iSlot<URING_SLOTS && ring.can_queue(); ++iSlot)
         {
-            uint32_t bytesRemaining = dir->record_count * RECORD_SIZE;
+            UringSlot& slot = slots[iSlot];
 
-            if(dir->logical_extent == 0)
+            while(slot.busy && slot.inFd < 0 && slot.nextWrite < slot.writes.size() && ring.can_queue())
             {
-                // close current file
-                outFile.close();
+                const UringWrite& w = slot.writes[slot.nextWrite];
+                ring.queue_write(slot.outFds[w.file], w.data, w.length, w.offset, ((uint64_t)iSlot << 32) | slot.nextWrite);
+                ++slot.nextWrite;
 
-                extentNo = 0;
-                fileName = std::string(dir->file_name, dir->file_name+sizeof(DirEntry::file_name));
-                extension = std::string(dir->file_type, dir->file_type+sizeof(DirEntry::file_type));
+                if(stats)
+                {
+                    ++stats->writes;
+                }
+            }
+        }
+
+        if(ring.in_flight() == 0)
+        {
+            continue;
+        }
 
-                fileName = trim(fileName);
-                extension = trim(extension);
+        {
+            PhaseTimer timer(stats, PHASE_WRITE);
+            if(!ring.submit_and_wait())
+            {
+                fatal("io_uring_enter failed.");
+            }
+        }
 
-                // Some ROMs (i.e. the Epson Utils) have bit 0x80 set in the the file type characters.
-                // I think this indicates attributes such as ReadOnly etc. Mask them out to make a valid file name.
-                extension[0] &= 0x7f;
-                extension[1] &= 0x7f;
-                extension[2] &= 0x7f;
+        uint64_t userData;
+        int32_t result;
 
-                // open new file
-                outFile.open(fileName + "." + extension, std::ios::out | std::ios::binary);
-                if(!outFile) fatal("Could not open output file.");
+        while(ring.completion(userData, result))
+        {
+            UringSlot& slot = slots[userData >> 32];
+            const uint32_t opIndex = (uint32_t)userData;
 
-                // Write each block in the allocation map
-                for(uint8_t i=0; i<16; ++i)
+            if(opIndex == OP_INDEX_READ)
+            {
+                if(result < 0 || (result == 0 && slot.bytesRead < slot.image.size()))
+                {
+                    uring_reject(slot, "failed to read input file.", failed);
+                    --busySlots;
+                    continue;
+                }
+
+                slot.bytesRead += result;
+
+                if(slot.bytesRead < slot.image.size())
                 {
-                    if(dir->allocation_map[i])
-                    {
-                        const uint32_t chunkSize = (bytesRemaining >= 1024) ? 1024 : bytesRemaining;
-                        outFile.write((char*)block_address(fileBase, dir->allocation_map[i]), chunkSize);
-                        bytesRemaining -= chunkSize;
-                    }
+                    // Short read - read the rest
+                    ring.queue_read(slot.inFd, slot.image.data() + slot.bytesRead, (uint32_t)(slot.image.size() - slot.bytesRead), slot.bytesRead, userData);
+                    continue;
                 }
 
+                uring_image_read(slot, batch, offset, failed, stats);
+                if(!slot.busy)
+                {
+                    --busySlots;
+                }
+                continue;
+            }
+
+            UringWrite& w = slot.writes[opIndex];
+
+            if(result < 0)
+            {
+                // The file is incomplete; report it once and count the write as done
+                if(!slot.failed)
+                {
+                    report_error("Failed to write to output file.", slot.romFile);
+                    slot.failed = true;
+                }
             }
-            else
+            else if((uint32_t)result < w.length)
             {
-                // TODO - Warning if file name is different
+                // Short write - write the rest
+                w.data += result;
+                w.length -= result;
+                w.offset += result;
+                ring.queue_write(slot.outFds[w.file], w.data, w.length, w.offset, userData);
+                continue;
+            }
 
-                // TODO - Warning if logical_extent != extentNo+1
+            else if(stats)
+            {
+                stats->bytesWritten += w.length;
+            }
 
-                extentNo = dir->logical_extent;
+            if(--slot.outPending[w.file] == 0)
+            {
+                ::close(slot.outFds[w.file]);
+                slot.outFds[w.file] = -1;
 
-                // Write each block in the allocation map
-                for(uint8_t i=0; i<16; ++i)
+                if(stats)
                 {
-                    if(dir->allocation_map[i])
-                    {
-                        const uint32_t chunkSize = (bytesRemaining >= 1024) ? 1024 : bytesRemaining;
-                        outFile.write((char*)block_address(fileBase, dir->allocation_map[i]), chunkSize);
-                        bytesRemaining -= chunkSize;
-                    }
+                    ++stats->closes;
                 }
             }
-        }
 
-        ++dirNo;
+            if(--slot.pending == 0)
+            {
+                // Closes any output files that had no data
+                uring_finish(slot, failed, stats);
+                --busySlots;
+            }
+        }
     }
 
-    // Close file
-    outFile.close();
+    if(stats)
+    {
+        stats->uringEnters += ring.enter_calls();
+    }
 
+    return true;
 }
 
+#endif // ROM_HAVE_IO_URING
+
 static void usage()
 {
-    std::cout << "Usage: dumprom <romfile>\n" << std::endl;
+    std::cout << "Usage: dumprom [--stats=json] [--io=sync|uring] [--offset=<n>] [--dedup=hardlink|reflink] <romfile> [romfile...]\n\n"
+                 "With more than one romfile, each is extracted into a directory named after it.\n" << std::endl;
+}
+
+static bool parse_dedup_option(const char* arg, DedupMode& mode)
+{
+    if(strncmp(arg, "--dedup=", 8) != 0)
+    {
+        return false;
+    }
+
+    if(strcmp(arg + 8, "hardlink") == 0)
+    {
+        mode = DEDUP_HARDLINK;
+    }
+    else if(strcmp(arg + 8, "reflink") == 0)
+    {
+        mode = DEDUP_REFLINK;
+    }
+    else
+    {
+        std::cerr << "Unknown dedup mode : " << (arg + 8) << std::endl;
+        exit(-1);
+    }
+
+    return true;
 }
 
 int main(int argc, char* argv[])
@@ -209,33 +893,74 @@ int main(int argc, char* argv[])
     assert(sizeof(RomHeader) == 32);
     assert(sizeof(DirEntry) == 32);
 
-    if(argc != 2)
+    bool statsEnabled = false;
+    bool uring = false;
+    DedupTable dedup;
+    uint32_t offset = ROM_OFFSET_AUTO;
+    std::vector<const char*> romFiles;
+    romFiles.reserve(argc);
+
+    for(int i=1; i<argc; ++i)
+    {
+        if(!parse_stats_option(argv[i], statsEnabled) && !parse_io_option(argv[i], uring) && !parse_offset_option(argv[i], offset) &&
+           !parse_dedup_option(argv[i], dedup.mode))
+        {
+            romFiles.push_back(argv[i]);
+        }
+    }
+
+    if(romFiles.empty())
     {
         usage();
         exit(-1);
     }
 
-    std::string fileName = argv[1];
+    RomStats stats;
+    RomStats* statsPtr = statsEnabled ? &stats : NULL;
+
+    bool done = false;
+    uint32_t failed = 0;
 
-    std::ifstream inFile(fileName, std::ios::in | std::ios::binary);
+    if(uring && dedup.mode != DEDUP_NONE)
+    {
+        // Each file must be written before any can be linked to it
+        std::cerr << "--dedup uses synchronous I/O." << std::endl;
+        uring = false;
+    }
 
-    if(!inFile)
+    if(uring)
     {
-        fatal("failed to open input file.");
+#ifdef ROM_HAVE_IO_URING
+        done = dump_batch_uring(romFiles, romFiles.size() > 1, offset, failed, statsPtr);
+#endif
+        if(!done)
+        {
+            std::cerr << "io_uring not available, using synchronous I/O." << std::endl;
+        }
     }
 
-    std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(inFile)),
-                 std::istreambuf_iterator<char>());
+    for(size_t i=0; i<romFiles.size() && !done; ++i)
+    {
+        if(!dump_rom(romFiles[i], romFiles.size() > 1, offset, dedup.mode != DEDUP_NONE ? &dedup : NULL, statsPtr))
+        {
+            ++failed;
+        }
+    }
 
-    if(buffer.size() == 0x8000)
+    if(statsEnabled)
     {
-        // convert physical to logical addresses
-        std::vector<uint8_t> temp = buffer;
-        memcpy(&buffer[0], &temp[0x4000], 0x4000);
-        memcpy(&buffer[0x4000], &temp[0], 0x4000);
+        stats.print_json(std::cout, "dumprom");
     }
 
-    dump_files(buffer.data(), (uint32_t)buffer.size());
+    if(failed)
+    {
+        if(romFiles.size() > 1)
+        {
+            std::cerr << failed << " images could not be extracted." << std::endl;
+        }
+
+        return -1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,1182 @@
+/*
+epsonrom.h - Andy Anderson 2020
+
+Shared definitions for the Epson PX-8 ROM capsule tools (dumprom, makerom, rombench).
+
+Header only, so each tool still compiles with a single g++ command line.
+
+Reference documentation;
+* PX-8 OS Reference Manual - chapter 15
+* EHT-10 Development Tool User's Guide - Appendix 1
+
+*/
+
+#ifndef EPSONROM_H
+#define EPSONROM_H
+
+#include <cstdint>
+#include <cassert>
+#include <cstdlib>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+
+#include "romhex.h"
+
+#ifdef _MSC_VER
+#define PACK_PRE __pragma (pack( push, 1))
+#define PACK_POST __pragma (pack( pop ))
+#define PACK_ATTRIBUTE
+#else
+#define PACK_PRE
+#define PACK_POST
+#define PACK_ATTRIBUTE __attribute__((packed))
+#endif
+
+const uint8_t MAGIC = 0xe5;
+const uint8_t MAGIC_P = 0x50; // Programs execute in place, from the capsule
+const uint8_t MAGIC_M = 0x37;
+
+const uint8_t CAPACITY_64kbit = 0x08;
+const uint8_t CAPACITY_128kbit = 0x10;
+const uint8_t CAPACITY_256kbit = 0x20;
+const uint8_t CAPACITY_512kbit = 0x40; // Not supported
+const uint8_t CAPACITY_1024kbit = 0x80; // Not supported
+
+const uint8_t MAX_DIR_ENTRIES = 0x20;
+
+const uint8_t DIR_ENTRY_INVALID = 0xe5;
+const uint8_t DIR_ENTRY_VALID = 0x00;
+
+const uint32_t RECORD_SIZE = 128;
+const uint32_t BLOCK_SIZE = 1024;
+
+PACK_PRE
+struct RomHeader
+{
+    uint8_t id[2]; // 0xE5, (0x37=M format, 0x50=P format)
+    uint8_t capacity; // 0x08=64kbits, 0x10=128kbits, 0x20=256kbits, 0x40=512kbits, 0x80=1mbits
+    uint8_t checksum[2];
+    uint8_t system_name[3];
+    uint8_t rom_name[14];
+    uint8_t dir_entries; // number of entries + 1 (then rounded up to a multiple of 4)
+    uint8_t v;
+    uint8_t version[2];
+    uint8_t month[2];
+    uint8_t day[2];
+    uint8_t year[2];
+} PACK_ATTRIBUTE;
+
+struct DirEntry
+{
+    uint8_t validity; // 0x00=valid 0xE5=invalid
+    uint8_t file_name[8];
+    uint8_t file_type[3];
+    uint8_t logical_extent;
+    uint16_t zero;
+    uint8_t record_count; // 0 to 128. number of 128 byte records controlled by the dir entry
+    uint8_t allocation_map[16]; // The IDs of each 1K block used by the file
+} PACK_ATTRIBUTE;
+PACK_POST
+
+// A problem with one image or its inputs. The functions that check and build images return one
+// rather than ending the program, so a batch can report a bad image and carry on, and a service
+// can answer with it. message is a static string (NULL for success), param what it concerns.
+struct RomError
+{
+    const char* message;
+    const char* param;
+};
+
+static inline RomError rom_error(const char* message, const char* param = NULL)
+{
+    RomError error = { message, param };
+    return error;
+}
+
+// Print an error the way fatal() does, without ending the program.
+static inline void report_error(const char* msg, const char* param = NULL)
+{
+    std::cerr << msg;
+
+    if(param)
+    {
+        std::cerr << " : " << param;
+    }
+
+    std::cerr << std::endl;
+}
+
+static inline void fatal(const char* msg, const char* param = NULL)
+{
+    report_error(msg, param);
+
+    exit(-1);
+}
+
+// Size in bytes of a ROM with the given header capacity code (e.g. 0x20 -> 32KB).
+static inline uint32_t rom_size(const uint8_t capacity)
+{
+    return (uint32_t)capacity * 1024;
+}
+
+// Bytes an image needs for the given number of directory entries (including the header entry) and blocks.
+static inline uint32_t required_size(const uint32_t entries, const uint32_t blocks)
+{
+    return ((entries + 3) / 4) * 4 * (uint32_t)sizeof(DirEntry) + blocks * BLOCK_SIZE;
+}
+
+// Smallest supported capacity code whose ROM holds size bytes, or 0 if none does.
+static inline uint8_t smallest_capacity(const uint32_t size)
+{
+    static const uint8_t capacities[] = { CAPACITY_64kbit, CAPACITY_128kbit, CAPACITY_256kbit };
+
+    for(size_t i=0; i<sizeof(capacities); ++i)
+    {
+        if(size <= rom_size(capacities[i]))
+        {
+            return capacities[i];
+        }
+    }
+
+    return 0;
+}
+
+static inline uint8_t* file_area_offset(const RomHeader* const hdr)
+{
+    assert(hdr->dir_entries%4 == 0);
+    assert(hdr->dir_entries >= 0 && hdr->dir_entries <=0x20);
+
+    return ((uint8_t*)hdr) + (hdr->dir_entries * sizeof(DirEntry));
+}
+
+static inline DirEntry* dir_entry_offset(const RomHeader* const hdr, const uint8_t dir_entry)
+{
+    assert(dir_entry >= 1);
+    assert(dir_entry <= hdr->dir_entries);
+
+    return (DirEntry*)(((uint8_t*)hdr) + dir_entry * sizeof(DirEntry));
+}
+
+static inline uint8_t* block_address(uint8_t* fileBase, const uint8_t blockNo)
+{
+    assert(blockNo >=1);
+
+    return fileBase + ((blockNo-1) * BLOCK_SIZE);
+}
+
+// 27256 ROMs require to convert physical to logical addresses
+static inline bool is_half_swapped(const uint8_t capacity)
+{
+    return capacity == CAPACITY_256kbit;
+}
+
+// 27256 ROMs have the two 16K halves swapped between physical and logical addresses.
+// The conversion is symmetrical, so this is used in both directions. Swaps in place, without a temporary copy.
+static inline void swap_halves(uint8_t* rom, const uint32_t romSize)
+{
+    assert(romSize == 0x8000);
+
+    std::swap_ranges(rom, rom + 0x4000, rom + 0x4000);
+}
+
+// 16 bit sum of every byte in the image, as shown by most EPROM programmers.
+static inline uint16_t image_sum16(const uint8_t* rom, const uint32_t romSize)
+{
+    uint32_t sum = 0;
+
+    for(uint32_t i=0; i<romSize; ++i)
+    {
+        sum += rom[i];
+    }
+
+    return (uint16_t)sum;
+}
+
+// Copy a space padded directory field up to its first space. Returns the number of characters copied.
+static inline size_t copy_trimmed(char* dest, const uint8_t* field, const size_t fieldSize)
+{
+    size_t len = 0;
+
+    while(len < fieldSize && field[len] != ' ')
+    {
+        dest[len] = (char)field[len];
+        ++len;
+    }
+
+    return len;
+}
+
+// M format capsules (programs are loaded into the TPA) and P format (programs execute in place).
+static inline bool is_known_format(const RomHeader* header)
+{
+    return header->id[0] == MAGIC && (header->id[1] == MAGIC_M || header->id[1] == MAGIC_P);
+}
+
+// The capsule format for "m" or "p" (either case). Returns false for anything else.
+static inline bool capsule_from_name(const char* name, uint8_t& capsule)
+{
+    if(strcmp(name, "m") == 0 || strcmp(name, "M") == 0)
+    {
+        capsule = MAGIC_M;
+    }
+    else if(strcmp(name, "p") == 0 || strcmp(name, "P") == 0)
+    {
+        capsule = MAGIC_P;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// True for .COM files, ignoring the attribute bits in the type.
+static inline bool is_executable(const uint8_t type[3])
+{
+    return (type[0] & 0x7f) == 'C' && (type[1] & 0x7f) == 'O' && (type[2] & 0x7f) == 'M';
+}
+
+// Check that a logical ROM image has a valid header and that every directory entry
+// refers only to blocks inside the image. Returns NULL if valid, otherwise a description of the problem.
+// This is the only bounds check extraction makes: it proves every block ID and record count the
+// directory holds is in range, so walk_files() can then read the blocks without checking each one.
+static inline const char* verify_rom(const uint8_t* romBase, const uint32_t romSize)
+{
+    if(romSize < sizeof(RomHeader))
+    {
+        return "Image too small.";
+    }
+
+    const RomHeader* header = (const RomHeader*)romBase;
+
+    if(!is_known_format(header))
+    {
+        return "Not a valid rom file.";
+    }
+
+    if((header->dir_entries % 4) != 0 || header->dir_entries > MAX_DIR_ENTRIES)
+    {
+        return "Invalid directory size.";
+    }
+
+    const uint32_t fileAreaOffset = header->dir_entries * sizeof(DirEntry);
+
+    if(fileAreaOffset > romSize)
+    {
+        return "Directory larger than image.";
+    }
+
+    const uint32_t blockCount = (romSize - fileAreaOffset) / BLOCK_SIZE;
+
+    // A P format program runs straight from the image, so its blocks must follow each other
+    const bool executeInPlace = header->id[1] == MAGIC_P;
+    uint32_t lastBlock = 0;
+
+    for(uint8_t dirNo=1; dirNo<header->dir_entries; ++dirNo)
+    {
+        const DirEntry* dir = (const DirEntry*)(romBase + dirNo * sizeof(DirEntry));
+
+        if(dir->validity != DIR_ENTRY_VALID)
+        {
+            continue;
+        }
+
+        if(dir->record_count > 128)
+        {
+            return "Invalid record count.";
+        }
+
+        const bool contiguous = executeInPlace && is_executable(dir->file_type);
+        if(dir->logical_extent == 0)
+        {
+            lastBlock = 0;
+        }
+
+        uint32_t blocksUsed = 0;
+
+        for(uint8_t i=0; i<16; ++i)
+        {
+            if(dir->allocation_map[i])
+            {
+                if(dir->allocation_map[i] > blockCount)
+                {
+                    return "Block outside of image.";
+                }
+
+                if(contiguous && lastBlock && dir->allocation_map[i] != lastBlock + 1)
+                {
+                    return "Program blocks are not contiguous.";
+                }
+
+                lastBlock = dir->allocation_map[i];
+                ++blocksUsed;
+            }
+        }
+
+        if(dir->record_count * RECORD_SIZE > blocksUsed * BLOCK_SIZE)
+        {
+            return "Record count exceeds allocated blocks.";
+        }
+    }
+
+    return NULL;
+}
+
+// How a dump holds its image: the image is the first size bytes, in physical order if swapped.
+struct RomLayout
+{
+    uint32_t size;
+    bool swapped;
+    int score;
+};
+
+// Score a candidate layout by how much of the header and directory make sense for it. Only the
+// directory (at most 1K) is read, so every candidate can be scored for every image in a batch.
+static inline int score_layout(const uint8_t* directory, const uint8_t capacity, const uint32_t imageSize)
+{
+    const RomHeader* header = (const RomHeader*)directory;
+    int score = 0;
+
+    score += (header->id[0] == MAGIC) ? 4 : 0;
+    score += is_known_format(header) ? 4 : 0;
+    score += (header->capacity == capacity) ? 4 : 0;
+
+    const char* invalid = verify_rom(directory, imageSize);
+    if(invalid)
+    {
+        return score;
+    }
+
+    score += 8;
+
+    // Printable names in the valid entries - a valid header over random data rarely has them
+    for(uint8_t dirNo=1; dirNo<header->dir_entries; ++dirNo)
+    {
+        const DirEntry* dir = (const DirEntry*)(directory + dirNo * sizeof(DirEntry));
+        if(dir->validity != DIR_ENTRY_VALID)
+        {
+            score += (dir->validity == DIR_ENTRY_INVALID) ? 1 : -2;
+            continue;
+        }
+
+        bool printable = true;
+        for(size_t i=0; i<sizeof(DirEntry::file_name); ++i)
+        {
+            printable &= dir->file_name[i] >= 0x20 && dir->file_name[i] < 0x7f;
+        }
+        score += printable ? 2 : -2;
+    }
+
+    return score;
+}
+
+// Pick the most likely layout of a dump: each capacity that fits in it, with and without the 27256
+// half swap. A dump may have trailing padding, hold a smaller ROM, or be already in logical order.
+// Returns false if no candidate looks like a ROM at all.
+static inline bool detect_layout(const uint8_t* data, const uint32_t size, RomLayout& layout)
+{
+    static const uint8_t capacities[] = { CAPACITY_64kbit, CAPACITY_128kbit, CAPACITY_256kbit, CAPACITY_512kbit, CAPACITY_1024kbit };
+
+    layout.size = size;
+    layout.swapped = size == 0x8000;
+    layout.score = 0;
+
+    for(size_t c=0; c<sizeof(capacities); ++c)
+    {
+        const uint32_t imageSize = rom_size(capacities[c]);
+        if(imageSize > size)
+        {
+            break;
+        }
+
+        for(int swapped=0; swapped<=(is_half_swapped(capacities[c]) ? 1 : 0); ++swapped)
+        {
+            // The header is at the start of the logical image
+            const int score = score_layout(data + (swapped ? 0x4000 : 0), capacities[c], imageSize);
+
+            // Ties go to the larger image (so to the whole dump, the largest candidate), then to the
+            // 27256 half swap, the physical order a programmer reads the part in
+            const bool larger = imageSize > layout.size || (imageSize == layout.size && swapped);
+            if(score > layout.score || (score == layout.score && score > 0 && larger))
+            {
+                layout.size = imageSize;
+                layout.swapped = swapped != 0;
+                layout.score = score;
+            }
+        }
+    }
+
+    return layout.score > 0;
+}
+
+// Convert a decoded dump to a logical image, as detect_layout() finds it. Dumps that do not look
+// like a ROM are left as they were, except that a 32K dump is unswapped, so the usual errors follow.
+static inline void to_logical(std::vector<uint8_t>& image)
+{
+    RomLayout layout;
+    detect_layout(image.data(), (uint32_t)image.size(), layout);
+
+    image.resize(layout.size);
+
+    if(layout.swapped)
+    {
+        // convert physical to logical addresses
+        swap_halves(image.data(), (uint32_t)image.size());
+    }
+}
+
+static const char* const ERROR_OPEN_INPUT = "failed to open input file.";
+
+// Read a ROM image file (binary, Intel HEX or S-records, see decode_rom_input()) and convert it to
+// logical address order (see detect_layout()). Returns NULL on success, otherwise a description of the problem.
+static inline const char* read_image(const char* fileName, std::vector<uint8_t>& image, const uint32_t offset = ROM_OFFSET_AUTO)
+{
+    std::ifstream inFile(fileName, std::ios::in | std::ios::binary);
+    if(!inFile)
+    {
+        return ERROR_OPEN_INPUT;
+    }
+
+    image.assign((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+
+    std::vector<uint8_t> scratch;
+    const char* error = decode_rom_input(image, scratch, offset);
+    if(error)
+    {
+        return error;
+    }
+
+    to_logical(image);
+
+    return NULL;
+}
+
+// As read_image(), but returns false if the file cannot be opened and ends the program for a bad dump.
+static inline bool load_image(const char* fileName, std::vector<uint8_t>& image, const uint32_t offset = ROM_OFFSET_AUTO)
+{
+    const char* error = read_image(fileName, image, offset);
+    if(error == ERROR_OPEN_INPUT)
+    {
+        return false;
+    }
+
+    if(error)
+    {
+        fatal(error, fileName);
+    }
+
+    return true;
+}
+
+// Refuse to overwrite an existing output file.
+static inline void fail_if_exists(const char* fileName)
+{
+    std::ifstream existing(fileName);
+    if(existing)
+    {
+        fatal("Output file already exists.", fileName);
+    }
+}
+
+// Write a logical ROM image to a new file, in physical address order.
+static inline void save_image(const char* fileName, std::vector<uint8_t>& image)
+{
+    fail_if_exists(fileName);
+
+    if(image.size() == 0x8000)
+    {
+        // convert logical to physical addresses
+        swap_halves(image.data(), (uint32_t)image.size());
+    }
+
+    std::ofstream outFile(fileName, std::ios::out | std::ios::binary);
+    outFile.write((const char*)image.data(), image.size());
+
+    if(image.size() == 0x8000)
+    {
+        swap_halves(image.data(), (uint32_t)image.size());
+    }
+
+    if(!outFile.good())
+    {
+        fatal("Failed to write to ouput file.", fileName);
+    }
+}
+
+// Walk the directory of a logical ROM image, reconstructing each file from its extents.
+// The sink receives open(const char* fileName) at logical extent 0, write() for each block and close() at the end of each file.
+// Returns the number of extents (valid directory entries) processed. The image must have passed verify_rom(),
+// which is what keeps every block read inside the image - nothing is checked here. One that is not a known
+// format is not walked at all.
+template<class Sink>
+static inline uint32_t walk_files(const uint8_t* romBase, const uint32_t romSize, Sink& sink)
+{
+    const RomHeader* header = (RomHeader*)romBase;
+
+    if(!is_known_format(header))
+    {
+        return 0;
+    }
+
+    // Checked once for the whole image in debug builds, instead of for every entry and block
+    assert(verify_rom(romBase, romSize) == NULL);
+
+    const uint8_t* fileBase = romBase + header->dir_entries * sizeof(DirEntry);
+
+    // Enumerate files
+    uint8_t dirNo = 1;
+    char fileName[sizeof(DirEntry::file_name) + 1 + sizeof(DirEntry::file_type) + 1]; // 8.3 and terminator
+    bool fileOpen = false;
+    uint32_t extents = 0;
+
+    while(dirNo < header->dir_entries)
+    {
+        const DirEntry* dir = (const DirEntry*)(romBase + dirNo * sizeof(DirEntry));
+
+        if(dir->validity == DIR_ENTRY_VALID)
+        {
+            uint32_t bytesRemaining = dir->record_count * RECORD_SIZE;
+            ++extents;
+
+            if(dir->logical_extent == 0)
+            {
+                // close current file
+                if(fileOpen)
+                {
+                    sink.close();
+                }
+
+                size_t nameLength = copy_trimmed(fileName, dir->file_name, sizeof(DirEntry::file_name));
+                fileName[nameLength++] = '.';
+                char* extension = fileName + nameLength;
+                const size_t extensionLength = copy_trimmed(extension, dir->file_type, sizeof(DirEntry::file_type));
+                extension[extensionLength] = 0;
+
+                // Some ROMs (i.e. the Epson Utils) have bit 0x80 set in the the file type characters.
+                // I think this indicates attributes such as ReadOnly etc. Mask them out to make a valid file name.
+                for(size_t i=0; i<extensionLength; ++i)
+                {
+                    extension[i] &= 0x7f;
+                }
+
+                // open new file
+                sink.open(fileName);
+                fileOpen = true;
+            }
+            else
+            {
+                // TODO - Warning if file name is different
+
+                // TODO - Warning if logical_extent is not one more than the previous extent's
+
+                if(!fileOpen)
+                {
+                    // Continuation extent without a first extent - nothing to append to
+                    ++dirNo;
+                    continue;
+                }
+            }
+
+            // Write each block in the allocation map
+            for(uint8_t i=0; i<16; ++i)
+            {
+                if(dir->allocation_map[i])
+                {
+                    // verify_rom() has checked the block is in the image and the records fit the blocks
+                    const uint32_t chunkSize = (bytesRemaining >= BLOCK_SIZE) ? BLOCK_SIZE : bytesRemaining;
+                    sink.write(fileBase + (dir->allocation_map[i] - 1) * BLOCK_SIZE, chunkSize);
+                    bytesRemaining -= chunkSize;
+                }
+            }
+        }
+
+        ++dirNo;
+    }
+
+    // Close file
+    if(fileOpen)
+    {
+        sink.close();
+    }
+
+    return extents;
+}
+
+// Bump allocator. All of the memory for one image comes from a single fixed block, which
+// reset() releases at once between images. This bounds peak memory for batch runs and avoids
+// reallocating buffers as an image is assembled.
+class Arena
+{
+public:
+    explicit Arena(const size_t capacity) : m_memory(capacity), m_used(0) {}
+
+    // Returns NULL if the arena is full.
+    uint8_t* allocate(const size_t size)
+    {
+        const size_t aligned = (size + 15) & ~(size_t)15;
+
+        if(aligned > m_memory.size() - m_used)
+        {
+            return NULL;
+        }
+
+        uint8_t* p = m_memory.data() + m_used;
+        m_used += aligned;
+        return p;
+    }
+
+    void reset()
+    {
+        m_used = 0;
+    }
+
+    size_t used() const
+    {
+        return m_used;
+    }
+
+    size_t capacity() const
+    {
+        return m_memory.size();
+    }
+
+private:
+    std::vector<uint8_t> m_memory;
+    size_t m_used;
+};
+
+// A file to be stored in a ROM image.
+struct RomInput
+{
+    const char* name; // 8.3 file name
+    const uint8_t* data;
+    size_t size;
+};
+
+static const char* const ERROR_NOT_8_3 = "Input files must be 8.3";
+
+// Split an 8.3 file name into space padded directory fields. Returns false if it is not 8.3.
+static inline bool split_file_name(const char* full, uint8_t name[8], uint8_t type[3])
+{
+    const char* dot = strrchr(full, '.');
+
+    if(dot == NULL)
+    {
+        return false;
+    }
+
+    const size_t nameLength = dot - full;
+    const size_t typeLength = strlen(dot + 1);
+
+    if(nameLength < 1 || nameLength > 8 || typeLength < 1 || typeLength > 3)
+    {
+        return false;
+    }
+
+    memset(name, ' ', 8);
+    memset(type, ' ', 3);
+    memcpy(name, full, nameLength);
+    memcpy(type, dot + 1, typeLength);
+
+    return true;
+}
+
+// Number of directory entries (extents) needed for a file of the given size.
+static inline uint32_t file_extents(const size_t size)
+{
+    const size_t chunks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    return chunks ? (uint32_t)((chunks + 15) / 16) : 1;
+}
+
+// Assemble a ROM image from a set of files. The image (rom_size(capacity) bytes) is allocated from the arena
+// and is in logical address order; swap_halves() it when is_half_swapped(capacity) before programming.
+// format is MAGIC_M or MAGIC_P; blocks are allocated in order, so every file is contiguous as P format needs.
+// Returns NULL, with error set, if the files cannot be stored.
+static inline uint8_t* build_rom(const char* romName, const uint8_t capacity, const RomInput* inputs, const size_t inputCount, Arena& arena,
+                                 RomError& error, const uint8_t format = MAGIC_M)
+{
+    // Size the directory first, so file data can be copied straight to its final place in the image
+    uint32_t entries = 1; // DirEntry 0 is used as the ROM header
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        entries += file_extents(inputs[iFile].size);
+    }
+
+    if(entries > MAX_DIR_ENTRIES)
+    {
+        error = rom_error("Out of directory space.");
+        return NULL;
+    }
+
+    const uint8_t dirEntries = (uint8_t)(((entries + 3) / 4) * 4);
+    const uint32_t romSize = rom_size(capacity);
+    const uint32_t fileAreaSize = romSize - (dirEntries * sizeof(DirEntry));
+
+    uint8_t* rom = arena.allocate(romSize);
+    if(rom == NULL)
+    {
+        error = rom_error("Out of memory.");
+        return NULL;
+    }
+
+    memset(rom, 0xff, romSize);
+
+    // Invalidate all dir entries
+    memset(rom, DIR_ENTRY_INVALID, dirEntries * sizeof(DirEntry));
+
+    // Initialise ROM header
+    DirEntry* dirBase = (DirEntry*)rom;
+    RomHeader* hdr = (RomHeader*)rom;
+    const size_t romNameLength = strlen(romName);
+    hdr->id[0] = MAGIC;
+    hdr->id[1] = format;
+    hdr->capacity = capacity;
+    memcpy(hdr->system_name, "H80", 3);
+    memset(hdr->rom_name, ' ', sizeof(hdr->rom_name));
+    memcpy(hdr->rom_name, romName, romNameLength > sizeof(hdr->rom_name) ? sizeof(hdr->rom_name) : romNameLength);
+    hdr->dir_entries = dirEntries;
+    hdr->v = 'V';
+    hdr->version[0] = '1';
+    hdr->version[1] = '0';
+    memcpy(hdr->month, "11", 2);
+    memcpy(hdr->day, "16", 2);
+    memcpy(hdr->year, "20", 2);
+
+    uint8_t* fileArea = rom + (dirEntries * sizeof(DirEntry));
+    uint8_t currentDirectory = 0;
+    uint8_t nextAllocation = 1;
+
+    // Process each file
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        const RomInput& input = inputs[iFile];
+
+        ++currentDirectory;
+
+        uint8_t name[8];
+        uint8_t type[3];
+        if(!split_file_name(input.name, name, type))
+        {
+            error = rom_error(ERROR_NOT_8_3, input.name);
+            return NULL;
+        }
+
+        // Calculate number of 1K chunks
+        size_t chunks = (input.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        // Calculate number of 128Byte records
+        size_t records = (input.size + RECORD_SIZE - 1) / RECORD_SIZE;
+
+        int allocationIndex = 0;
+        int nextLogicalExtent = 0;
+        size_t buffer_offset = 0;
+
+        // Reserve a directory entry
+        memset(&dirBase[currentDirectory], 0, sizeof(DirEntry));
+        memcpy(&dirBase[currentDirectory].file_name, name, 8);
+        memcpy(&dirBase[currentDirectory].file_type, type, 3);
+        dirBase[currentDirectory].logical_extent = nextLogicalExtent++;
+
+        // Store in the file area in 1K/128byte chunks. Every chunk occupies a whole 1K block
+        // so that the block IDs in the allocation map match the offsets in the file area.
+        uint32_t bytesRemaining = (uint32_t)(records * RECORD_SIZE);
+
+        for(size_t iChunk=0; iChunk<chunks; ++iChunk)
+        {
+            if(allocationIndex >= 16)
+            {
+                // Need to extend into next directory entry
+                ++currentDirectory;
+
+                memset(&dirBase[currentDirectory], 0, sizeof(DirEntry));
+                allocationIndex = 0;
+                memcpy(&dirBase[currentDirectory].file_name, name, 8);
+                memcpy(&dirBase[currentDirectory].file_type, type, 3);
+                dirBase[currentDirectory].logical_extent = nextLogicalExtent++;
+            }
+
+            if(nextAllocation * BLOCK_SIZE > fileAreaSize)
+            {
+                error = rom_error("Out of ROM space.");
+                return NULL;
+            }
+
+            uint32_t chunkSize = (bytesRemaining >= BLOCK_SIZE) ? BLOCK_SIZE : bytesRemaining;
+
+            dirBase[currentDirectory].record_count += (chunkSize/RECORD_SIZE);
+            uint8_t* block = block_address(fileArea, nextAllocation);
+            dirBase[currentDirectory].allocation_map[allocationIndex++] = nextAllocation++;
+
+            // The rest of the last block is zero padded
+            size_t dataSize = (input.size - buffer_offset < chunkSize) ? input.size - buffer_offset : chunkSize;
+            memcpy(block, input.data + buffer_offset, dataSize);
+            memset(block + dataSize, 0, BLOCK_SIZE - dataSize);
+            buffer_offset += chunkSize;
+            bytesRemaining -= chunkSize;
+        }
+
+    }
+
+    // Update the header to reflect the files that have been stored
+    uint16_t checksum = (uint16_t)((nextAllocation - 1) * BLOCK_SIZE);
+    hdr->checksum[0] = checksum & 0xff;
+    hdr->checksum[1] = (checksum >> 8) & 0xff;
+
+    return rom;
+}
+
+// Blocks of one file in a previous image, in file order.
+struct PreviousFile
+{
+    uint8_t name[8];
+    uint8_t type[3];
+    uint32_t records;
+    uint32_t blockCount;
+    uint8_t blocks[MAX_DIR_ENTRIES * 16];
+};
+
+// True if the file's blocks in the previous image hold exactly what build_rom() would store for it.
+static inline bool previous_blocks_match(const PreviousFile& previous, const uint8_t* previousFileArea, const RomInput& input)
+{
+    const size_t chunks = (input.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const size_t records = (input.size + RECORD_SIZE - 1) / RECORD_SIZE;
+
+    if(previous.blockCount != chunks || previous.records != records)
+    {
+        return false;
+    }
+
+    for(size_t iChunk=0; iChunk<chunks; ++iChunk)
+    {
+        const uint8_t* block = block_address((uint8_t*)previousFileArea, previous.blocks[iChunk]);
+        const size_t offset = iChunk * BLOCK_SIZE;
+        const size_t dataSize = (input.size - offset < BLOCK_SIZE) ? input.size - offset : BLOCK_SIZE;
+
+        if(memcmp(block, input.data + offset, dataSize) != 0)
+        {
+            return false;
+        }
+
+        for(size_t i=dataSize; i<BLOCK_SIZE; ++i)
+        {
+            if(block[i] != 0)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// First block of a run of length free blocks, trying start first. Returns 0 if there is none.
+// used is indexed by block ID (a bool array or a bitset).
+template<class Used>
+static inline uint32_t free_run(const Used& used, const uint32_t blockCount, const uint32_t start, const uint32_t length)
+{
+    for(uint32_t pass=0; pass<2; ++pass)
+    {
+        for(uint32_t first=(pass ? 1 : start); first + length - 1 <= blockCount; ++first)
+        {
+            uint32_t i = 0;
+            while(i < length && !used[first + i])
+            {
+                ++i;
+            }
+
+            if(i == length)
+            {
+                return first;
+            }
+
+            if(pass == 0)
+            {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Assemble a ROM image that changes as little of a previous (logical, valid) image of the same capacity
+// as possible, for capsules that are reprogrammed in place. Files whose blocks are unchanged keep their
+// block IDs; changed files reuse their own previous blocks first, then take free ones; new files take
+// free blocks. Blocks no longer used keep their old contents, so they need no programming.
+// The directory keeps its size where the files fit, so block addresses do not move. In P format a
+// changed program is given a contiguous run of blocks, its own previous run where that is free.
+// Returns NULL, with error set, if the files cannot be stored.
+static inline uint8_t* build_rom_update(const char* romName, const uint8_t capacity, const RomInput* inputs, const size_t inputCount,
+                                        const uint8_t* previous, const uint32_t previousSize, Arena& arena, RomError& error,
+                                        const uint8_t format = MAGIC_M)
+{
+    const uint32_t romSize = rom_size(capacity);
+    if(previousSize != romSize)
+    {
+        error = rom_error("Previous image is a different size.");
+        return NULL;
+    }
+
+    const RomHeader* previousHeader = (const RomHeader*)previous;
+
+    uint32_t entries = 1; // DirEntry 0 is used as the ROM header
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        entries += file_extents(inputs[iFile].size);
+    }
+
+    if(entries > MAX_DIR_ENTRIES)
+    {
+        error = rom_error("Out of directory space.");
+        return NULL;
+    }
+
+    uint8_t dirEntries = (uint8_t)(((entries + 3) / 4) * 4);
+    if(dirEntries < previousHeader->dir_entries)
+    {
+        dirEntries = previousHeader->dir_entries;
+    }
+
+    const uint32_t blockCount = (romSize - dirEntries * sizeof(DirEntry)) / BLOCK_SIZE;
+
+    // Gather the block lists of the previous files
+    PreviousFile* previousFiles = (PreviousFile*)arena.allocate(MAX_DIR_ENTRIES * sizeof(PreviousFile));
+    uint8_t* rom = arena.allocate(romSize);
+    if(previousFiles == NULL || rom == NULL)
+    {
+        error = rom_error("Out of memory.");
+        return NULL;
+    }
+
+    size_t previousCount = 0;
+    for(uint8_t dirNo=1; dirNo<previousHeader->dir_entries; ++dirNo)
+    {
+        const DirEntry* dir = (const DirEntry*)(previous + dirNo * sizeof(DirEntry));
+        if(dir->validity != DIR_ENTRY_VALID)
+        {
+            continue;
+        }
+
+        if(dir->logical_extent == 0 || previousCount == 0)
+        {
+            PreviousFile& file = previousFiles[previousCount++];
+            memcpy(file.name, dir->file_name, 8);
+            memcpy(file.type, dir->file_type, 3);
+            file.records = 0;
+            file.blockCount = 0;
+        }
+
+        PreviousFile& file = previousFiles[previousCount - 1];
+        file.records += dir->record_count;
+        for(uint8_t i=0; i<16; ++i)
+        {
+            if(dir->allocation_map[i])
+            {
+                file.blocks[file.blockCount++] = dir->allocation_map[i];
+            }
+        }
+    }
+
+    const uint8_t* previousFileArea = previous + previousHeader->dir_entries * sizeof(DirEntry);
+    const bool sameLayout = dirEntries == previousHeader->dir_entries;
+
+    // Match each input to its previous version, and keep the blocks of those that are unchanged
+    const PreviousFile** matched = (const PreviousFile**)arena.allocate(inputCount * sizeof(PreviousFile*));
+    bool* unchanged = (bool*)arena.allocate(inputCount * sizeof(bool));
+    uint8_t* blockIds = arena.allocate(inputCount * MAX_DIR_ENTRIES * 16);
+    if(matched == NULL || unchanged == NULL || blockIds == NULL)
+    {
+        error = rom_error("Out of memory.");
+        return NULL;
+    }
+
+    bool used[256] = { false };
+
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        uint8_t name[8];
+        uint8_t type[3];
+        if(!split_file_name(inputs[iFile].name, name, type))
+        {
+            error = rom_error(ERROR_NOT_8_3, inputs[iFile].name);
+            return NULL;
+        }
+
+        matched[iFile] = NULL;
+        unchanged[iFile] = false;
+
+        for(size_t p=0; p<previousCount; ++p)
+        {
+            if(memcmp(previousFiles[p].name, name, 8) == 0 && memcmp(previousFiles[p].type, type, 3) == 0)
+            {
+                matched[iFile] = &previousFiles[p];
+                break;
+            }
+        }
+
+        bool inPlace = sameLayout && matched[iFile] && previous_blocks_match(*matched[iFile], previousFileArea, inputs[iFile]);
+
+        // A program kept from an M format image may not be contiguous
+        for(uint32_t b=1; inPlace && format == MAGIC_P && is_executable(type) && b<matched[iFile]->blockCount; ++b)
+        {
+            inPlace = matched[iFile]->blocks[b] == matched[iFile]->blocks[b - 1] + 1;
+        }
+
+        if(inPlace)
+        {
+            unchanged[iFile] = true;
+            for(uint32_t b=0; b<matched[iFile]->blockCount; ++b)
+            {
+                blockIds[iFile * MAX_DIR_ENTRIES * 16 + b] = matched[iFile]->blocks[b];
+                used[matched[iFile]->blocks[b]] = true;
+            }
+        }
+    }
+
+    // Start from the previous image, so untouched blocks are not reprogrammed
+    memcpy(rom, previous, romSize);
+    uint8_t* fileArea = rom + dirEntries * sizeof(DirEntry);
+
+    // Place the changed and new files
+    uint32_t nextFree = 1;
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        if(unchanged[iFile])
+        {
+            continue;
+        }
+
+        const RomInput& input = inputs[iFile];
+        const size_t chunks = (input.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint8_t* ids = blockIds + iFile * MAX_DIR_ENTRIES * 16;
+        uint32_t reuse = 0;
+
+        uint8_t name[8];
+        uint8_t type[3];
+        split_file_name(input.name, name, type);
+
+        uint32_t runStart = 0;
+        if(format == MAGIC_P && is_executable(type) && chunks)
+        {
+            const uint32_t preferred = (sameLayout && matched[iFile]) ? matched[iFile]->blocks[0] : 1;
+            runStart = free_run(used, blockCount, preferred, (uint32_t)chunks);
+            if(runStart == 0)
+            {
+                error = rom_error("Out of contiguous ROM space.", input.name);
+                return NULL;
+            }
+        }
+
+        for(size_t iChunk=0; iChunk<chunks; ++iChunk)
+        {
+            uint32_t blockNo = runStart ? runStart + (uint32_t)iChunk : 0;
+
+            // The file's own previous blocks first - rewriting a block in place changes fewer pages
+            while(sameLayout && matched[iFile] && reuse < matched[iFile]->blockCount && blockNo == 0)
+            {
+                const uint8_t candidate = matched[iFile]->blocks[reuse++];
+                if(!used[candidate] && candidate <= blockCount)
+                {
+                    blockNo = candidate;
+                }
+            }
+
+            while(blockNo == 0 && nextFree <= blockCount)
+            {
+                if(!used[nextFree])
+                {
+                    blockNo = nextFree;
+                }
+                ++nextFree;
+            }
+
+            if(blockNo == 0)
+            {
+                error = rom_error("Out of ROM space.");
+                return NULL;
+            }
+
+            used[blockNo] = true;
+            ids[iChunk] = (uint8_t)blockNo;
+
+            // The rest of the last block is zero padded
+            uint8_t* block = block_address(fileArea, blockNo);
+            const size_t offset = iChunk * BLOCK_SIZE;
+            const size_t dataSize = (input.size - offset < BLOCK_SIZE) ? input.size - offset : BLOCK_SIZE;
+            memcpy(block, input.data + offset, dataSize);
+            memset(block + dataSize, 0, BLOCK_SIZE - dataSize);
+        }
+    }
+
+    // Rewrite the header and directory
+    memset(rom, DIR_ENTRY_INVALID, dirEntries * sizeof(DirEntry));
+
+    DirEntry* dirBase = (DirEntry*)rom;
+    RomHeader* hdr = (RomHeader*)rom;
+    const size_t romNameLength = strlen(romName);
+    hdr->id[0] = MAGIC;
+    hdr->id[1] = format;
+    hdr->capacity = capacity;
+    memcpy(hdr->system_name, "H80", 3);
+    memset(hdr->rom_name, ' ', sizeof(hdr->rom_name));
+    memcpy(hdr->rom_name, romName, romNameLength > sizeof(hdr->rom_name) ? sizeof(hdr->rom_name) : romNameLength);
+    hdr->dir_entries = dirEntries;
+    hdr->v = 'V';
+    hdr->version[0] = '1';
+    hdr->version[1] = '0';
+    memcpy(hdr->month, "11", 2);
+    memcpy(hdr->day, "16", 2);
+    memcpy(hdr->year, "20", 2);
+
+    uint8_t currentDirectory = 0;
+    uint32_t highestBlock = 0;
+
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        const RomInput& input = inputs[iFile];
+        const size_t chunks = (input.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t recordsRemaining = (uint32_t)((input.size + RECORD_SIZE - 1) / RECORD_SIZE);
+        const uint8_t* ids = blockIds + iFile * MAX_DIR_ENTRIES * 16;
+
+        uint8_t name[8];
+        uint8_t type[3];
+        split_file_name(input.name, name, type);
+
+        const uint32_t extents = file_extents(input.size);
+        for(uint32_t extent=0; extent<extents; ++extent)
+        {
+            DirEntry& dir = dirBase[++currentDirectory];
+            memset(&dir, 0, sizeof(DirEntry));
+            memcpy(dir.file_name, name, 8);
+            memcpy(dir.file_type, type, 3);
+            dir.logical_extent = (uint8_t)extent;
+
+            for(uint32_t i=0; i<16 && extent * 16 + i < chunks; ++i)
+            {
+                const uint8_t blockNo = ids[extent * 16 + i];
+                const uint32_t records = (recordsRemaining < BLOCK_SIZE / RECORD_SIZE) ? recordsRemaining : BLOCK_SIZE / RECORD_SIZE;
+
+                dir.allocation_map[i] = blockNo;
+                dir.record_count += (uint8_t)records;
+                recordsRemaining -= records;
+                highestBlock = (blockNo > highestBlock) ? blockNo : highestBlock;
+            }
+        }
+    }
+
+    // As build_rom(), the end of the used blocks
+    const uint16_t checksum = (uint16_t)(highestBlock * BLOCK_SIZE);
+    hdr->checksum[0] = checksum & 0xff;
+    hdr->checksum[1] = (checksum >> 8) & 0xff;
+
+    return rom;
+}
+
+#endif // EPSONROM_H
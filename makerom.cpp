@@ -4,14 +4,45 @@ makerom - Andy Anderson 2020
 Quick and dirty tool to build ROM images for Epson PX-8 ROM capsules (and probably PX-4, EHT-10).
 
 Currently hard-coded for;
-* 256kbit PROM (e.g. 27C256).
-* M format (loaded into TPA for execution).
+* 64, 128 or 256kbit PROM (2764, 27128, 27C256) - the smallest that holds the files, unless --capacity is given.
+* M format (loaded into TPA for execution), or with --capsule=p P format (executed in place).
 * Requires all files in current directory (i.e. the file-name splitting code will break if directories are specified).
 
 To compile on linux;
 
     g++ makerom.cpp -o makerom
 
+Usage;
+
+    makerom [--stats=json] [--format=bin|ihex|srec] [--capsule=m|p] [--capacity=auto|64|128|256] [--select] <romfile> <file1> [file2...]
+    makerom [--stats=json] [--format=bin|ihex|srec] [--capsule=m|p] [--capacity=auto|64|128|256] [--select] [--io=sync|uring] -b <listfile>
+    makerom [--format=bin|ihex|srec] [--capsule=m|p] --previous=<romfile> [--plan=<planfile>] <romfile> <file1> [file2...]
+
+A listfile builds several images in one run, one "<romfile> <file1> [file2...]" per line.
+--stats=json prints per-phase timings and I/O counters for the whole run to stdout.
+--io=uring builds a batch with many reads and writes in flight through io_uring (linux),
+falling back to synchronous I/O where it is not available. --format=ihex or --format=srec
+writes Intel HEX or Motorola S-records (in physical address order) for EPROM programmers
+instead of a binary image.
+
+The capacity is worked out from the sizes of the files before any are read. --capacity=256
+(or 64, 128) builds that size whatever the files need. An update keeps the previous capacity.
+
+--select is for more files than fit: each file may be given as <file>:<priority> (default 1)
+and makerom builds the set with the greatest total priority that fits the capacity (the largest
+part when the capacity is automatic), listing the files left out. See select_files() in romplan.h.
+
+--capsule=p builds a P format capsule, whose programs run directly from the ROM rather than
+being copied into the TPA. Each .COM file is stored in consecutive blocks so that it can be
+executed in place; every build keeps that, including --previous updates.
+
+--previous builds an update of an image already programmed into an EEPROM or flash capsule:
+files that have not changed keep their blocks, and changed or new files are placed so that as
+few bytes as possible differ from the previous image. --plan writes the 64 byte pages that
+differ (physical address and data, one page per line), which is all that needs reprogramming.
+
+Shared structures and the ROM assembler are in epsonrom.h.
+
 Reference documentation;
 * PX-8 OS Reference Manual - chapter 15
 * EHT-10 Development Tool User's Guide - Appendix 1
@@ -27,275 +58,1002 @@ Reference documentation;
 #include <iostream>
 #include <streambuf>
 
-
-#ifdef _MSC_VER
-#define PACK_PRE __pragma (pack( push, 1))
-#define PACK_POST __pragma (pack( pop ))
-#define PACK_ATTRIBUTE
-#else
-#define PACK_PRE
-#define PACK_POST
-#define PACK_ATTRIBUTE __attribute__((packed))
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
-const uint8_t MAGIC = 0xe5;
-const uint8_t MAGIC_P = 0x50; // Not supported
-const uint8_t MAGIC_M = 0x37;
+#include "epsonrom.h"
+#include "romstats.h"
+#include "romio.h"
+#include "romhex.h"
+#include "romplan.h"
 
-const uint8_t CAPACITY_64kbit = 0x08;
-const uint8_t CAPACITY_128kbit = 0x10;
-const uint8_t CAPACITY_256kbit = 0x20;
-const uint8_t CAPACITY_512kbit = 0x40; // Not supported
-const uint8_t CAPACITY_1024kbit = 0x80; // Not supported
+static void usage()
+{
+    std::cout << "Usage: makerom [--stats=json] [--format=bin|ihex|srec] [--capsule=m|p] [--capacity=auto|64|128|256] [--select] <romfile> <file1> [file2 [file3 [file..x]]]\n"
+                 "       makerom [--stats=json] [--format=bin|ihex|srec] [--capsule=m|p] [--capacity=auto|64|128|256] [--select] [--io=sync|uring] -b <listfile>\n"
+                 "       makerom [--format=bin|ihex|srec] [--capsule=m|p] --previous=<romfile> [--plan=<planfile>] <romfile> <file1> [file2...]\n\n"
+                 "Each line of a listfile is: <romfile> <file1> [file2...]\n" << std::endl;
+}
 
-const uint8_t MAX_DIR_ENTRIES = 0x20;
+// Largest image makerom builds - the arena holds the input files (which must fit in the image),
+// the image itself, its hex encoding and the parsed list file line.
+const uint32_t MAX_ROM_SIZE = 0x8000;
+const size_t ARENA_SIZE = 2 * MAX_ROM_SIZE + hex_encoded_size(MAX_ROM_SIZE) + 64 * 1024;
 
-const uint8_t DIR_ENTRY_INVALID = 0xe5;
-const uint8_t DIR_ENTRY_VALID = 0x00;
+// How every image in a run is built, from the command line.
+struct BuildOptions
+{
+    RomFormat format;
+    uint8_t capsule;  // MAGIC_M or MAGIC_P
+    uint8_t capacity; // CAPACITY_*, or 0 for the smallest that holds the files
+    bool select;      // build the highest priority subset of the files that fits
 
-const uint32_t RECORD_SIZE = 128;
+    BuildOptions() : format(FORMAT_BINARY), capsule(MAGIC_M), capacity(0), select(false) {}
+};
 
-PACK_PRE
-struct RomHeader
+// Everything needed to build one image, reused for every image in a batch run.
+// All per-image memory comes from the arena, which is reset before each image.
+struct BuildContext
 {
-    uint8_t id[2]; // 0xE5, (0x37=M format, 0x50=P format)
-    uint8_t capacity; // 0x08=64kbits, 0x10=128kbits, 0x20=256kbits, 0x40=512kbits, 0x80=1mbits
-    uint8_t checksum[2];
-    uint8_t system_name[3];
-    uint8_t rom_name[14];
-    uint8_t dir_entries; // number of entries + 1 (then rounded up to a multiple of 4)
-    uint8_t v;
-    uint8_t version[2];
-    uint8_t month[2];
-    uint8_t day[2];
-    uint8_t year[2];
-} PACK_ATTRIBUTE;
-
-struct DirEntry
+    Arena arena;
+    std::ifstream inFile;
+    char inBuffer[4096];
+    std::ofstream outFile;
+    char outBuffer[4096];
+    BuildOptions options;
+    std::vector<uint8_t> previous; // logical order; empty unless building an update
+    const char* planName;
+
+    BuildContext() : arena(ARENA_SIZE), planName(NULL)
+    {
+        // Set before the first open, so the streams do not allocate a buffer on every open
+        inFile.rdbuf()->pubsetbuf(inBuffer, sizeof(inBuffer));
+        outFile.rdbuf()->pubsetbuf(outBuffer, sizeof(outBuffer));
+    }
+};
+
+// Read a whole file into the arena. Returns NULL, with error set, if it cannot.
+static uint8_t* read_file(BuildContext& context, const char* fileName, size_t& size, RomError& error, RomStats* stats)
 {
-    uint8_t validity; // 0x00=valid 0xE5=invalid
-    uint8_t file_name[8];
-    uint8_t file_type[3];
-    uint8_t logical_extent;
-    uint16_t zero;
-    uint8_t record_count; // 0 to 128. number of 128 byte records controlled by the dir entry
-    uint8_t allocation_map[16]; // The IDs of each 1K block used by the file
-} PACK_ATTRIBUTE;
-PACK_POST
-
-static void fatal(const char* msg, const char* param = NULL)
+    PhaseTimer timer(stats, PHASE_READ);
+
+    std::ifstream& inFile = context.inFile;
+    inFile.clear();
+    inFile.open(fileName, std::ios::in | std::ios::binary);
+    if(!inFile)
+    {
+        error = rom_error(ERROR_OPEN_INPUT, fileName);
+        return NULL;
+    }
+
+    inFile.seekg(0, std::ios::end);
+    size = (size_t)inFile.tellg();
+    inFile.seekg(0, std::ios::beg);
+
+    uint8_t* data = (size > MAX_ROM_SIZE) ? NULL : context.arena.allocate(size);
+    if(data == NULL)
+    {
+        inFile.close();
+        error = rom_error("Out of ROM space.", fileName);
+        return NULL;
+    }
+
+    inFile.read((char*)data, size);
+    if(!inFile)
+    {
+        inFile.close();
+        error = rom_error("failed to read input file.", fileName);
+        return NULL;
+    }
+
+    inFile.close();
+
+    if(stats)
+    {
+        ++stats->files;
+        ++stats->opens;
+        ++stats->reads;
+        ++stats->closes;
+        stats->bytesRead += size;
+    }
+
+    return data;
+}
+
+// For --select: split "<file>:<priority>" arguments and keep the highest priority set of files that
+// fits the capacity (or the largest part, if the capacity is chosen afterwards). Returns the number
+// of inputs kept, moved to the front in their original order, or sets error.
+static size_t select_inputs(BuildContext& context, RomInput* inputs, const size_t inputCount, const uint8_t budget, RomError& error)
 {
-    std::cerr << msg;
-    
-    if(param)
+    uint32_t* priorities = (uint32_t*)context.arena.allocate(inputCount * sizeof(uint32_t));
+    bool* selected = (bool*)context.arena.allocate(inputCount * sizeof(bool));
+    if(priorities == NULL || selected == NULL)
+    {
+        error = rom_error("Out of memory.");
+        return 0;
+    }
+
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        const char* colon = strrchr(inputs[iFile].name, ':');
+        priorities[iFile] = 1;
+
+        if(colon)
+        {
+            const size_t length = colon - inputs[iFile].name;
+            char* name = (char*)context.arena.allocate(length + 1);
+            if(name == NULL)
+            {
+                error = rom_error("Out of memory.");
+                return 0;
+            }
+
+            memcpy(name, inputs[iFile].name, length);
+            name[length] = 0;
+
+            priorities[iFile] = (uint32_t)strtoul(colon + 1, NULL, 0);
+            inputs[iFile].name = name;
+        }
+
+        if(!stat_file_size(inputs[iFile].name, inputs[iFile].size))
+        {
+            error = rom_error(ERROR_OPEN_INPUT, inputs[iFile].name);
+            return 0;
+        }
+    }
+
+    const uint64_t total = select_files(inputs, priorities, inputCount, budget, selected);
+
+    size_t kept = 0;
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
     {
-        std::cerr << " : " << param;
-    } 
-    
-    std::cerr << std::endl;
+        if(selected[iFile])
+        {
+            inputs[kept++] = inputs[iFile];
+        }
+        else
+        {
+            std::cout << "Left out " << inputs[iFile].name << " (priority " << priorities[iFile] << ")" << std::endl;
+        }
+    }
+
+    std::cout << "Selected " << kept << " of " << inputCount << " files, total priority " << total << "." << std::endl;
 
-    exit(-1);
+    return kept;
 }
 
-static void usage()
+// Encode the (physical order) image in the output format. Returns what to write and sets size to its length,
+// or NULL if there is no room to encode it.
+static uint8_t* encode_output(Arena& arena, uint8_t* rom, uint32_t& size, const RomFormat format, const char* outName)
 {
-    std::cout << "Usage: makerom <romfile> <file1> [file2 [file3 [file..x]]]\n" << std::endl;
+    if(format == FORMAT_BINARY)
+    {
+        return rom;
+    }
+
+    char* text = (char*)arena.allocate(hex_encoded_size(size));
+    if(text == NULL)
+    {
+        return NULL;
+    }
+
+    size = (uint32_t)((format == FORMAT_IHEX) ? encode_ihex(rom, size, text) : encode_srec(rom, size, outName, text));
+
+    return (uint8_t*)text;
 }
 
-bool split_file_name(const std::string& full, uint8_t name[8], uint8_t type[3])
+// EEPROM page size - the unit a programmer writes, and so the unit of the programming plan
+const uint32_t PLAN_PAGE_SIZE = 64;
+
+// Write the pages of the new (physical order) image that differ from the previous one.
+static void write_plan(const char* planName, const uint8_t* rom, const std::vector<uint8_t>& previousLogical, const uint32_t romSize)
 {
-    std::string::size_type pos = full.find_last_of('.');
+    std::vector<uint8_t> previous(previousLogical);
+    if(previous.size() == 0x8000)
+    {
+        swap_halves(previous.data(), romSize);
+    }
+
+    const uint32_t pageCount = romSize / PLAN_PAGE_SIZE;
+    std::vector<uint32_t> changed;
+
+    for(uint32_t page=0; page<pageCount; ++page)
+    {
+        const uint32_t offset = page * PLAN_PAGE_SIZE;
+        if(memcmp(rom + offset, previous.data() + offset, PLAN_PAGE_SIZE) != 0)
+        {
+            changed.push_back(offset);
+        }
+    }
 
-    if(pos == std::string::npos)
+    std::ofstream planFile(planName, std::ios::out | std::ios::binary);
+    if(!planFile)
     {
-        fatal("Input files must be 8.3", full.c_str());
+        fatal("Failed to open output file for writing.", planName);
     }
 
-    std::string sname = full.substr(0, pos);
-    std::string sext = full.substr(pos+1);
+    planFile << "# " << changed.size() << " of " << pageCount << " pages of " << PLAN_PAGE_SIZE << " bytes changed\n";
+
+    const HexTable& table = hex_table();
+    char line[7 + 2 * PLAN_PAGE_SIZE + 1];
 
-    if(sname.length() < 1 || sname.length() > 8 || sext.length() < 1 || sext.length() > 3)
+    for(size_t i=0; i<changed.size(); ++i)
     {
-        fatal("Input files must be 8.3", full.c_str());
+        snprintf(line, sizeof(line), "0x%04X ", changed[i]);
+        for(uint32_t b=0; b<PLAN_PAGE_SIZE; ++b)
+        {
+            memcpy(line + 7 + 2 * b, table.pairs[rom[changed[i] + b]], 2);
+        }
+        line[7 + 2 * PLAN_PAGE_SIZE] = '\n';
+        planFile.write(line, sizeof(line));
     }
 
-    memset(name, ' ', 8);
-    memset(type, ' ', 3);
-    memcpy(name, sname.c_str(), sname.length());
-    memcpy(type, sext.c_str(), sext.length());
+    if(!planFile.good())
+    {
+        fatal("Failed to write to ouput file.", planName);
+    }
 
-    return true;
+    std::cout << changed.size() << " of " << pageCount << " pages changed." << std::endl;
 }
 
-int main(int argc, char* argv[])
+// Build one image. Returns an error with a NULL message on success; nothing is written on failure.
+static RomError make_rom(BuildContext& context, const char* outName, const char* const* files, size_t fileCount, RomStats* stats)
 {
-    if(argc < 2)
+    std::ifstream& existing = context.inFile;
+    existing.clear();
+    existing.open(outName);
+    if(existing)
     {
-        usage();
-        exit(-1);
+        existing.close();
+        return rom_error("Output file already exists.", outName);
+    }
+
+    RomInput* inputs = (RomInput*)context.arena.allocate(fileCount * sizeof(RomInput));
+    if(inputs == NULL)
+    {
+        return rom_error("Out of directory space.", outName);
+    }
+
+    RomError error = rom_error(NULL);
+
+    // Size the image from the file sizes, so nothing is read for files that will not fit
+    for(size_t iFile=0; iFile<fileCount; ++iFile)
+    {
+        inputs[iFile].name = files[iFile];
+        inputs[iFile].data = NULL;
+        inputs[iFile].size = 0;
+
+        if(!context.options.select && !stat_file_size(files[iFile], inputs[iFile].size))
+        {
+            return rom_error(ERROR_OPEN_INPUT, files[iFile]);
+        }
+    }
+
+    if(context.options.select)
+    {
+        const uint8_t budget = !context.previous.empty() ? ((const RomHeader*)context.previous.data())->capacity
+                                                         : (context.options.capacity ? context.options.capacity : CAPACITY_256kbit);
+        fileCount = select_inputs(context, inputs, fileCount, budget, error);
+        if(error.message)
+        {
+            return error;
+        }
+    }
+
+    // An update keeps the capacity of the image it updates
+    const uint8_t capacity = context.previous.empty() ? choose_capacity(context.options.capacity, inputs, fileCount, outName, error)
+                                                      : ((const RomHeader*)context.previous.data())->capacity;
+    if(capacity == 0)
+    {
+        return error;
+    }
+
+    // Read each file
+    for(size_t iFile=0; iFile<fileCount; ++iFile)
+    {
+        inputs[iFile].data = read_file(context, inputs[iFile].name, inputs[iFile].size, error, stats);
+        if(inputs[iFile].data == NULL)
+        {
+            return error;
+        }
+    }
+
+    const uint32_t romSize = rom_size(capacity);
+    uint8_t* rom;
+
+    {
+        PhaseTimer timer(stats, PHASE_BUILD);
+        if(context.previous.empty())
+        {
+            rom = build_rom(outName, capacity, inputs, fileCount, context.arena, error, context.options.capsule);
+        }
+        else
+        {
+            rom = build_rom_update(outName, capacity, inputs, fileCount, context.previous.data(), (uint32_t)context.previous.size(), context.arena,
+                                   error, context.options.capsule);
+        }
+
+        if(rom == NULL)
+        {
+            return error;
+        }
+
+        if(stats)
+        {
+            const RomHeader* hdr = (const RomHeader*)rom;
+            for(uint8_t i=1; i<hdr->dir_entries; ++i)
+            {
+                stats->extents += ((const DirEntry*)(rom + i * sizeof(DirEntry)))->validity == DIR_ENTRY_VALID;
+            }
+        }
+    }
+
+    // 27256 ROMs require to convert physical to logical addresses
+    if(is_half_swapped(capacity))
+    {
+        PhaseTimer timer(stats, PHASE_SWAP);
+        swap_halves(rom, romSize);
     }
 
-    std::string outName = argv[1];
+    // Write the ROM to disk
+    PhaseTimer timer(stats, PHASE_WRITE);
+
+    uint32_t outSize = romSize;
+    const uint8_t* output = encode_output(context.arena, rom, outSize, context.options.format, outName);
+    if(output == NULL)
+    {
+        return rom_error("Out of memory.", outName);
+    }
 
-    std::fstream outFile;
-    outFile.open(outName);
-    if(outFile)
+    std::ofstream& outFile = context.outFile;
+    outFile.clear();
+    outFile.open(outName, std::ios::out | std::ios::binary);
+    if(!outFile)
     {
-        fatal("Output file already exists.", outName.c_str());
+        return rom_error("Failed to open output file for writing.", outName);
     }
 
+    outFile.write((const char*)output, outSize);
+
+    const bool written = outFile.good();
     outFile.close();
 
+    if(!written)
+    {
+        return rom_error("Failed to write to ouput file.", outName);
+    }
+
+    // Only once the image it describes is on disk
+    if(context.planName)
+    {
+        write_plan(context.planName, rom, context.previous, romSize);
+    }
+
+    if(stats)
+    {
+        ++stats->images;
+        ++stats->opens;
+        ++stats->writes;
+        ++stats->closes;
+        stats->bytesWritten += outSize;
+    }
+
+    return error;
+}
+
+// Split a list file line, copied into the arena, into the rom name and file names.
+// Returns the number of fields; 0 for blank and comment lines, and for lines too long to split (with error set).
+static size_t parse_list_line(Arena& arena, const std::string& line, const char**& fields, RomError& error)
+{
+    char* text = (char*)arena.allocate(line.length() + 1);
+    fields = (const char**)arena.allocate((line.length() / 2 + 1) * sizeof(char*));
+    if(text == NULL || fields == NULL)
+    {
+        error = rom_error("List file line too long.");
+        return 0;
+    }
+
+    memcpy(text, line.c_str(), line.length() + 1);
+
+    size_t fieldCount = 0;
+    for(char* field = strtok(text, " \t\r"); field; field = strtok(NULL, " \t\r"))
+    {
+        fields[fieldCount++] = field;
+    }
+
+    if(fieldCount == 0 || fields[0][0] == '#')
+    {
+        return 0;
+    }
 
-    // Initialise ROM header
-    std::vector<uint8_t> directory((sizeof(DirEntry) * MAX_DIR_ENTRIES), DIR_ENTRY_INVALID);
-    DirEntry* dirBase = (DirEntry*)directory.data();
-    RomHeader* hdr = (RomHeader*)directory.data(); // DirEntry 0 is used as the ROM header
-    hdr->id[0] = MAGIC;
-    hdr->id[1] = MAGIC_M;
-    hdr->capacity = CAPACITY_256kbit; // 27256 (32KB)
-    memcpy(hdr->system_name, "H80", 3);
-    memset(hdr->rom_name, ' ', sizeof(hdr->rom_name));
-    memcpy(hdr->rom_name, outName.c_str(), outName.length() > sizeof(hdr->rom_name) ? sizeof(hdr->rom_name) : outName.length());
-    hdr->dir_entries = 4;
-    hdr->v = 'V';
-    hdr->version[0] = '1';
-    hdr->version[1] = '0';
-    memcpy(hdr->month, "11", 2);
-    memcpy(hdr->day, "16", 2);
-    memcpy(hdr->year, "20", 2);
+    return fieldCount;
+}
 
-    // Invalidate all dir entries
-    for(int i=1; i<MAX_DIR_ENTRIES; ++i)
+// Build every image described in a list file, one "<romfile> <file1> [file2...]" per line.
+// An image that cannot be built is reported and the rest are still built. Returns the number that failed.
+static uint32_t make_batch(BuildContext& context, const char* listName, RomStats* stats)
+{
+    std::ifstream listFile(listName);
+    if(!listFile)
     {
-        dirBase[i].validity = DIR_ENTRY_INVALID;
+        fatal("failed to open list file.", listName);
     }
 
-    std::vector<uint8_t> file_area;
-    uint8_t currentDirectory = 0;
-    uint8_t nextAllocation = 1;
+    std::string line;
+    uint32_t failed = 0;
 
-    // Process each file
-    for(int iFile=2; iFile<argc; ++iFile)
+    while(std::getline(listFile, line))
     {
-        if(++currentDirectory > MAX_DIR_ENTRIES-1)
+        context.arena.reset();
+
+        const char** fields;
+        RomError error = rom_error(NULL);
+        const size_t fieldCount = parse_list_line(context.arena, line, fields, error);
+
+        if(fieldCount > 0)
         {
-            fatal("Out of directory space.");
+            error = make_rom(context, fields[0], fields + 1, fieldCount - 1, stats);
         }
 
-        // open file
-        std::ifstream inFile(argv[iFile], std::ios::in | std::ios::binary);
-        if(!inFile)
+        if(error.message)
         {
-            fatal("failed to open input file.", argv[iFile]);
+            report_error(error.message, error.param);
+            ++failed;
         }
+    }
+
+    return failed;
+}
+
+#ifdef ROM_HAVE_IO_URING
+
+// Batch building through io_uring. Up to URING_SLOTS images are in progress at once, each with
+// its own arena; all of the input reads and image writes go through the ring.
+
+const unsigned URING_SLOTS = 16;
+const unsigned URING_ENTRIES = 64;
+const uint32_t OP_INDEX_WRITE = 0xffffffff;
+
+struct UringBuild
+{
+    Arena arena;
+    const char* outName;
+    const char* const* files;
+    size_t fileCount;
+    RomInput* inputs;
+    int* inFds;
+    uint32_t* bytesRead;
+    size_t nextRead; // first input not yet queued
+    size_t readsPending;
+    uint8_t* rom;
+    uint32_t romSize;
+    uint32_t written;
+    int outFd;
+    bool writeQueued;
+    bool busy;
+    RomError error; // the image has failed; set while reads already queued complete
+
+    UringBuild() : arena(ARENA_SIZE), busy(false), error(rom_error(NULL)) {}
+};
+
+// Open the inputs of one list file line. Returns false, with error set and nothing left open, if it cannot.
+static bool uring_start(UringBuild& slot, const char** fields, const size_t fieldCount, RomError& error, RomStats* stats)
+{
+    PhaseTimer timer(stats, PHASE_READ);
 
-        uint8_t name[8];
-        uint8_t type[3];
-        split_file_name(argv[iFile], name, type);
+    slot.outName = fields[0];
+    slot.files = fields + 1;
+    slot.fileCount = fieldCount - 1;
 
-        // read into buffer
-        std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+    if(access(slot.outName, F_OK) == 0)
+    {
+        error = rom_error("Output file already exists.", slot.outName);
+        return false;
+    }
 
-        // Calculate number of 1K chunks
-        size_t chunks = (buffer.size() + 1023) / 1024;
+    slot.inputs = (RomInput*)slot.arena.allocate(slot.fileCount * sizeof(RomInput));
+    slot.inFds = (int*)slot.arena.allocate(slot.fileCount * sizeof(int));
+    slot.bytesRead = (uint32_t*)slot.arena.allocate(slot.fileCount * sizeof(uint32_t));
+    if(slot.inputs == NULL || slot.inFds == NULL || slot.bytesRead == NULL)
+    {
+        error = rom_error("Out of directory space.", slot.outName);
+        return false;
+    }
 
-        // Calculate number of 128Byte records
-        size_t records = (buffer.size() + 127) / 128;
+    for(size_t iFile=0; iFile<slot.fileCount; ++iFile)
+    {
+        const char* fileName = slot.files[iFile];
+        error = rom_error(NULL);
 
-        // pad file to 128Byte boundary
-        if(buffer.size() < (records * 128))
+        slot.inFds[iFile] = ::open(fileName, O_RDONLY);
+        if(slot.inFds[iFile] < 0)
         {
-            size_t diff = (records*128) - buffer.size();
-            buffer.resize(buffer.size() + diff);
-            memset(&buffer[buffer.size()-diff], (int)diff, 0);
+            error = rom_error(ERROR_OPEN_INPUT, fileName);
         }
 
-        // Make space for the file
-        int allocationIndex = 0;
-        int nextLogicalExtent = 0;
-        int file_area_offset = (int)file_area.size();
-        int buffer_offset = 0;
-        file_area.resize(file_area.size() + (records*128));
+        if(stats && error.message == NULL)
+        {
+            ++stats->files;
+            ++stats->opens;
+            ++stats->reads;
+        }
 
-        // Reserve a directory entry
-        memset(&dirBase[currentDirectory], 0, sizeof(DirEntry));
-        memcpy(&dirBase[currentDirectory].file_name, name, 8);
-        memcpy(&dirBase[currentDirectory].file_type, type, 3);
-        dirBase[currentDirectory].logical_extent = nextLogicalExtent++;
+        struct stat st;
+        if(error.message == NULL && fstat(slot.inFds[iFile], &st) != 0)
+        {
+            error = rom_error("failed to read input file.", fileName);
+        }
 
-        // Append to file area in 1K/128byte chunks
-        uint32_t bytesRemaining = records * 128;
+        uint8_t* data = NULL;
+        if(error.message == NULL && ((uint64_t)st.st_size > MAX_ROM_SIZE || (data = slot.arena.allocate((size_t)st.st_size)) == NULL))
+        {
+            error = rom_error("Out of ROM space.", fileName);
+        }
 
-        for(size_t iChunk=0; iChunk<chunks; ++iChunk)
+        if(error.message)
         {
-            if(allocationIndex >= 16)
+            // Close the inputs opened so far
+            for(size_t i=0; i<=iFile; ++i)
             {
-                // Need to extend into next directory entry
-                if(++currentDirectory > MAX_DIR_ENTRIES-1)
+                if(slot.inFds[i] >= 0)
                 {
-                    fatal("Out of directory space.");
+                    ::close(slot.inFds[i]);
+
+                    if(stats)
+                    {
+                        ++stats->closes;
+                    }
                 }
+            }
+            return false;
+        }
+
+        slot.inputs[iFile].name = fileName;
+        slot.inputs[iFile].data = data;
+        slot.inputs[iFile].size = (size_t)st.st_size;
+        slot.bytesRead[iFile] = 0;
+    }
+
+    slot.nextRead = 0;
+    slot.readsPending = slot.fileCount;
+    slot.rom = NULL;
+    slot.error = rom_error(NULL);
+    slot.busy = true;
 
-                memset(&dirBase[currentDirectory], 0, sizeof(DirEntry));
-                allocationIndex = 0;
-                memcpy(&dirBase[currentDirectory].file_name, name, 8);
-                memcpy(&dirBase[currentDirectory].file_type, type, 3);
-                dirBase[currentDirectory].logical_extent = nextLogicalExtent++;
+    return true;
+}
+
+// All of the inputs have been read - assemble the image and open the output.
+// Returns false, with slot.error set, if the image cannot be built.
+static bool uring_build(UringBuild& slot, const BuildOptions& options, RomStats* stats)
+{
+    if(slot.error.message)
+    {
+        // An input could not be read
+        return false;
+    }
+
+    const uint8_t capacity = choose_capacity(options.capacity, slot.inputs, slot.fileCount, slot.outName, slot.error);
+    if(capacity == 0)
+    {
+        return false;
+    }
+
+    const uint32_t romSize = rom_size(capacity);
+    uint8_t* rom;
+
+    {
+        PhaseTimer timer(stats, PHASE_BUILD);
+        rom = build_rom(slot.outName, capacity, slot.inputs, slot.fileCount, slot.arena, slot.error, options.capsule);
+        if(rom == NULL)
+        {
+            return false;
+        }
+
+        if(stats)
+        {
+            const RomHeader* hdr = (const RomHeader*)rom;
+            for(uint8_t i=1; i<hdr->dir_entries; ++i)
+            {
+                stats->extents += ((const DirEntry*)(rom + i * sizeof(DirEntry)))->validity == DIR_ENTRY_VALID;
+            }
+        }
+    }
+
+    // 27256 ROMs require to convert physical to logical addresses
+    if(is_half_swapped(capacity))
+    {
+        PhaseTimer timer(stats, PHASE_SWAP);
+        swap_halves(rom, romSize);
+    }
+
+    PhaseTimer timer(stats, PHASE_WRITE);
+
+    slot.romSize = romSize;
+    uint8_t* output = encode_output(slot.arena, rom, slot.romSize, options.format, slot.outName);
+    if(output == NULL)
+    {
+        slot.error = rom_error("Out of memory.", slot.outName);
+        return false;
+    }
+
+    // O_EXCL makes the "already exists" check and the create a single step
+    slot.outFd = ::open(slot.outName, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if(slot.outFd < 0)
+    {
+        slot.error = rom_error(errno == EEXIST ? "Output file already exists." : "Failed to open output file for writing.", slot.outName);
+        return false;
+    }
+
+    slot.rom = output;
+    slot.written = 0;
+    slot.writeQueued = false;
+
+    if(stats)
+    {
+        ++stats->opens;
+        ++stats->writes;
+    }
+
+    return true;
+}
+
+// Report an image that could not be built and free its slot.
+static void uring_fail(UringBuild& slot, size_t& busySlots, uint32_t& failed)
+{
+    report_error(slot.error.message, slot.error.param);
+    ++failed;
+
+    slot.busy = false;
+    --busySlots;
+}
+
+// Returns false if io_uring is not available, in which case nothing has been done. Images that cannot
+// be built are reported and counted in failed; the rest are still built.
+static bool make_batch_uring(const char* listName, const BuildOptions& options, uint32_t& failed, RomStats* stats)
+{
+    Uring ring;
+    if(!ring.init(URING_ENTRIES))
+    {
+        return false;
+    }
+
+    std::ifstream listFile(listName);
+    if(!listFile)
+    {
+        fatal("failed to open list file.", listName);
+    }
+
+    std::vector<UringBuild> slots(URING_SLOTS);
+    std::string line;
+    bool moreLines = true;
+    size_t busySlots = 0;
+
+    while(moreLines || busySlots > 0)
+    {
+        // Start the next images in any free slots
+        for(unsigned iSlot=0; iSlot<URING_SLOTS && moreLines; ++iSlot)
+        {
+            UringBuild& slot = slots[iSlot];
+
+            // A line that cannot be started is reported, and the slot takes the next one
+            while(!slot.busy && (moreLines = (bool)std::getline(listFile, line)))
+            {
+                slot.arena.reset();
+
+                const char** fields = NULL;
+                RomError error = rom_error(NULL);
+                const size_t fieldCount = parse_list_line(slot.arena, line, fields, error);
+
+                if(fieldCount > 0 && uring_start(slot, fields, fieldCount, error, stats))
+                {
+                    ++busySlots;
+
+                    if(slot.fileCount == 0 && !uring_build(slot, options, stats))
+                    {
+                        uring_fail(slot, busySlots, failed);
+                    }
+                }
+                else if(error.message)
+                {
+                    report_error(error.message, error.param);
+                    ++failed;
+                }
+            }
+        }
+
+        // Queue reads and writes while the ring has room
+        for(unsigned iSlot=0; iSlot<URING_SLOTS && ring.can_queue(); ++iSlot)
+        {
+            UringBuild& slot = slots[iSlot];
+            if(!slot.busy)
+            {
+                continue;
+            }
+
+            while(slot.nextRead < slot.fileCount && ring.can_queue())
+            {
+                const RomInput& input = slot.inputs[slot.nextRead];
+
+                if(input.size == 0 || slot.error.message)
+                {
+                    // Nothing to read, or the image has already failed
+                    ::close(slot.inFds[slot.nextRead]);
+                    --slot.readsPending;
+
+                    if(stats)
+                    {
+                        ++stats->closes;
+                    }
+                }
+                else
+                {
+                    ring.queue_read(slot.inFds[slot.nextRead], (void*)input.data, (uint32_t)input.size, 0, ((uint64_t)iSlot << 32) | slot.nextRead);
+                }
+
+                ++slot.nextRead;
+            }
+
+            if(slot.nextRead == slot.fileCount && slot.readsPending == 0 && slot.rom == NULL)
+            {
+                // Only empty files, or the last reads were skipped
+                if(!uring_build(slot, options, stats))
+                {
+                    uring_fail(slot, busySlots, failed);
+                    continue;
+                }
             }
 
-            uint32_t chunkSize = (bytesRemaining >= 1024) ? 1024 : bytesRemaining;
+            if(slot.rom && !slot.writeQueued && ring.can_queue())
+            {
+                ring.queue_write(slot.outFd, slot.rom, slot.romSize, 0, ((uint64_t)iSlot << 32) | OP_INDEX_WRITE);
+                slot.writeQueued = true;
+            }
+        }
 
-            dirBase[currentDirectory].record_count += (chunkSize/128);
-            dirBase[currentDirectory].allocation_map[allocationIndex++] = nextAllocation++;
+        if(ring.in_flight() == 0)
+        {
+            continue;
+        }
 
-            memcpy(&file_area[file_area_offset], &buffer[buffer_offset], chunkSize);
-            buffer_offset += chunkSize;
-            file_area_offset += chunkSize;
+        {
+            PhaseTimer timer(stats, PHASE_WRITE);
+            if(!ring.submit_and_wait())
+            {
+                fatal("io_uring_enter failed.");
+            }
         }
 
+        uint64_t userData;
+        int32_t result;
+
+        while(ring.completion(userData, result))
+        {
+            UringBuild& slot = slots[userData >> 32];
+            const uint32_t opIndex = (uint32_t)userData;
+
+            if(opIndex == OP_INDEX_WRITE)
+            {
+                if(result > 0)
+                {
+                    slot.written += result;
+
+                    if(slot.written < slot.romSize)
+                    {
+                        // Short write - write the rest
+                        ring.queue_write(slot.outFd, slot.rom + slot.written, slot.romSize - slot.written, slot.written, userData);
+                        continue;
+                    }
+                }
+
+                ::close(slot.outFd);
+
+                if(stats)
+                {
+                    ++stats->closes;
+                }
+
+                if(result <= 0)
+                {
+                    slot.error = rom_error("Failed to write to ouput file.", slot.outName);
+                    uring_fail(slot, busySlots, failed);
+                    continue;
+                }
+
+                if(stats)
+                {
+                    ++stats->images;
+                    stats->bytesWritten += slot.romSize;
+                }
+
+                slot.busy = false;
+                --busySlots;
+                continue;
+            }
+
+            const RomInput& input = slot.inputs[opIndex];
+
+            if(result > 0)
+            {
+                slot.bytesRead[opIndex] += result;
+
+                if(slot.bytesRead[opIndex] < input.size)
+                {
+                    // Short read - read the rest
+                    ring.queue_read(slot.inFds[opIndex], (void*)(input.data + slot.bytesRead[opIndex]), (uint32_t)(input.size - slot.bytesRead[opIndex]), slot.bytesRead[opIndex], userData);
+                    continue;
+                }
+            }
+            else if(slot.error.message == NULL)
+            {
+                // The other reads already queued for the image still complete into its arena
+                slot.error = rom_error("failed to read input file.", input.name);
+            }
+
+            ::close(slot.inFds[opIndex]);
+
+            if(stats)
+            {
+                ++stats->closes;
+                stats->bytesRead += slot.bytesRead[opIndex];
+            }
+
+            if(--slot.readsPending == 0 && slot.nextRead == slot.fileCount && !uring_build(slot, options, stats))
+            {
+                uring_fail(slot, busySlots, failed);
+            }
+        }
     }
 
-    // Update the header to reflect the files that have been stored
-    hdr->dir_entries = ((currentDirectory + 3) / 4) * 4;
-    uint16_t checksum = (uint16_t)file_area.size();
-    hdr->checksum[0] = checksum & 0xff;
-    hdr->checksum[1] = (checksum >> 8) & 0xff;
+    if(stats)
+    {
+        stats->uringEnters += ring.enter_calls();
+    }
+
+    return true;
+}
 
-    uint16_t romSize = 0x8000; // TODO - base this on hdr->capacity
+#endif // ROM_HAVE_IO_URING
 
-    if(((hdr->dir_entries * sizeof(DirEntry)) + file_area.size()) > romSize)
+static bool parse_capsule_option(const char* arg, uint8_t& capsule)
+{
+    if(strncmp(arg, "--capsule=", 10) != 0)
     {
-        fatal("Out of ROM space.");
+        return false;
     }
 
-    std::vector<uint8_t> rom(romSize, 0xff);
-    memcpy(rom.data(), dirBase, hdr->dir_entries * sizeof(DirEntry));
-    memcpy(rom.data() + (hdr->dir_entries * sizeof(DirEntry)), file_area.data(), file_area.size()); 
+    if(!capsule_from_name(arg + 10, capsule))
+    {
+        std::cerr << "Unknown capsule format : " << (arg + 10) << std::endl;
+        exit(-1);
+    }
 
-    // 27256 ROMs require to convert physical to logical addresses
-    if(hdr->capacity == CAPACITY_256kbit)
+    return true;
+}
+
+static bool parse_select_option(const char* arg, bool& select)
+{
+    if(strcmp(arg, "--select") != 0)
     {
-        std::vector<uint8_t> temp = rom;
-        memcpy(&rom[0], &temp[0x4000], 0x4000);
-        memcpy(&rom[0x4000], &temp[0], 0x4000);
+        return false;
     }
 
-    // Write the ROM to disk
-    outFile.open(outName, std::ios::out | std::ios::binary);
-    if(!outFile)
+    select = true;
+    return true;
+}
+
+// Options taking a file name, e.g. --previous=<romfile>.
+static bool parse_file_option(const char* arg, const char* option, const char*& fileName)
+{
+    const size_t length = strlen(option);
+
+    if(strncmp(arg, option, length) != 0 || arg[length] != '=')
     {
-        fatal("Failed to open output file for writing.", outName.c_str());
+        return false;
     }
 
-    outFile.write((char*)rom.data(), rom.size());
+    fileName = arg + length + 1;
+    return true;
+}
 
-    if(!outFile.good())
+int main(int argc, char* argv[])
+{
+    bool statsEnabled = false;
+    bool uring = false;
+    BuildOptions options;
+    const char* previousName = NULL;
+    const char* planName = NULL;
+    std::vector<const char*> args;
+
+    for(int i=1; i<argc; ++i)
     {
-        fatal("Failed to write to ouput file.", outName.c_str());
+        if(!parse_stats_option(argv[i], statsEnabled) && !parse_io_option(argv[i], uring) && !parse_format_option(argv[i], options.format) &&
+           !parse_capsule_option(argv[i], options.capsule) && !parse_capacity_option(argv[i], options.capacity) &&
+           !parse_select_option(argv[i], options.select) &&
+           !parse_file_option(argv[i], "--previous", previousName) && !parse_file_option(argv[i], "--plan", planName))
+        {
+            args.push_back(argv[i]);
+        }
     }
 
-    outFile.close();
+    const bool batch = args.size() >= 1 && strcmp(args[0], "-b") == 0;
+
+    if(args.size() < 1 || (batch && args.size() != 2) || (batch && previousName) || (planName && !previousName))
+    {
+        usage();
+        exit(-1);
+    }
+
+    RomStats stats;
+    RomStats* statsPtr = statsEnabled ? &stats : NULL;
+
+    BuildContext context;
+    context.options = options;
+    context.planName = planName;
+
+    if(planName)
+    {
+        fail_if_exists(planName);
+    }
+
+    if(previousName)
+    {
+        if(!load_image(previousName, context.previous))
+        {
+            fatal("failed to open input file.", previousName);
+        }
+
+        const char* invalid = verify_rom(context.previous.data(), (uint32_t)context.previous.size());
+        if(invalid)
+        {
+            fatal(invalid, previousName);
+        }
+    }
 
-    return 0;
-}
\ No newline at end of file
+    bool done = false;
+    uint32_t failed = 0;
+
+    // Selection needs the sizes before the reads are queued, so a batch with --select runs synchronously
+    if(batch && uring && !options.select)
+    {
+#ifdef ROM_HAVE_IO_URING
+        done = make_batch_uring(args[1], context.options, failed, statsPtr);
+#endif
+        if(!done)
+        {
+            std::cerr << "io_uring not available, using synchronous I/O." << std::endl;
+        }
+    }
+
+    if(batch)
+    {
+        if(!done)
+        {
+            failed = make_batch(context, args[1], statsPtr);
+        }
+
+        if(failed)
+        {
+            std::cerr << failed << " images could not be built." << std::endl;
+        }
+    }
+    else
+    {
+        const RomError error = make_rom(context, args[0], args.data() + 1, args.size() - 1, statsPtr);
+        if(error.message)
+        {
+            report_error(error.message, error.param);
+            failed = 1;
+        }
+    }
+
+    if(statsEnabled)
+    {
+        stats.print_json(std::cout, "makerom");
+    }
+
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,444 @@
+/*
+rombench - Andy Anderson 2020
+
+Benchmarks for the ROM capsule code shared by dumprom and makerom.
+
+A deterministic generator builds valid capsule images covering each supported capacity,
+different file counts, multi-extent files and the half-swapped 27C256 layout. Each stage
+(parse, extract, build, checksum, verify) is then timed in isolation in memory, so disk
+speed does not hide regressions in the code itself. Heap allocations per image are reported
+alongside the throughput. Before timing, each image is checked to extract to the generated
+files, to be left untouched by a romedit replace that cannot fit, and to be found in a dump
+that mirrors it twice.
+
+To compile on linux;
+
+    g++ -O2 rombench.cpp -o rombench
+
+Usage;
+
+    rombench [seconds per test]
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <new>
+
+#include "epsonrom.h"
+#include "romedit.h"
+
+// Count heap allocations so that allocation-free paths stay that way.
+static uint64_t allocation_count;
+
+void* operator new(size_t size)
+{
+    ++allocation_count;
+
+    void* p = malloc(size ? size : 1);
+    if(!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+struct Scenario
+{
+    const char* name;
+    uint8_t capacity;
+    int fileCount;
+    int largeFileBlocks; // 0 for none, otherwise one file of this many blocks (>16 needs several extents)
+};
+
+static const Scenario scenarios[] =
+{
+    { "64kbit, 2 files", CAPACITY_64kbit, 2, 0 },
+    { "128kbit, 6 files", CAPACITY_128kbit, 6, 0 },
+    { "256kbit, 4 files", CAPACITY_256kbit, 4, 0 },
+    { "256kbit, 28 files", CAPACITY_256kbit, 28, 0 },
+    { "256kbit, multi-extent", CAPACITY_256kbit, 3, 24 },
+};
+
+// Small deterministic PRNG (xorshift32) so every run benchmarks identical images.
+struct Random
+{
+    uint32_t state;
+
+    explicit Random(uint32_t seed) : state(seed ? seed : 1) {}
+
+    uint32_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    uint32_t below(uint32_t n)
+    {
+        return next() % n;
+    }
+};
+
+struct GeneratedImage
+{
+    std::vector<std::vector<uint8_t> > contents;
+    std::vector<std::string> names;
+    std::vector<RomInput> inputs;
+    std::vector<uint8_t> rom; // physical address order
+};
+
+// Generate a file set that is guaranteed to fit the scenario's capacity and build it.
+static void generate_image(const Scenario& scenario, const uint32_t seed, GeneratedImage& image)
+{
+    Random rnd(seed);
+
+    const uint32_t romSize = rom_size(scenario.capacity);
+
+    // Share out the blocks left after the largest possible directory
+    int blocksFree = (int)((romSize - MAX_DIR_ENTRIES * sizeof(DirEntry)) / BLOCK_SIZE);
+    std::vector<int> blocks(scenario.fileCount, 1);
+    blocksFree -= scenario.fileCount;
+
+    if(scenario.largeFileBlocks)
+    {
+        blocks[0] = scenario.largeFileBlocks;
+        blocksFree -= scenario.largeFileBlocks - 1;
+    }
+
+    if(blocksFree < 0)
+    {
+        fatal("Scenario does not fit its capacity.", scenario.name);
+    }
+
+    for(int i=scenario.largeFileBlocks ? 1 : 0; i<scenario.fileCount && blocksFree > 0; ++i)
+    {
+        int extra = (int)rnd.below((uint32_t)(blocksFree / 2 + 1));
+        if(blocks[i] + extra > 16)
+        {
+            extra = 16 - blocks[i];
+        }
+        blocks[i] += extra;
+        blocksFree -= extra;
+    }
+
+    image.contents.resize(scenario.fileCount);
+    image.names.resize(scenario.fileCount);
+    image.inputs.resize(scenario.fileCount);
+
+    for(int i=0; i<scenario.fileCount; ++i)
+    {
+        // Leave the last block partly used, and not always on a record boundary
+        size_t size = blocks[i] * BLOCK_SIZE - rnd.below(BLOCK_SIZE);
+
+        std::vector<uint8_t>& data = image.contents[i];
+        data.resize(size);
+        for(size_t j=0; j<size; ++j)
+        {
+            data[j] = (uint8_t)rnd.next();
+        }
+
+        char name[13];
+        snprintf(name, sizeof(name), "FILE%02d.COM", i % 100);
+
+        image.names[i] = name;
+        image.inputs[i].name = image.names[i].c_str();
+        image.inputs[i].data = data.data();
+        image.inputs[i].size = data.size();
+    }
+
+    Arena arena(rom_size(scenario.capacity));
+    RomError error;
+    const uint8_t* rom = build_rom("BENCH", scenario.capacity, image.inputs.data(), image.inputs.size(), arena, error);
+    if(rom == NULL)
+    {
+        fatal(error.message, error.param);
+    }
+    image.rom.assign(rom, rom + rom_size(scenario.capacity));
+
+    if(is_half_swapped(scenario.capacity))
+    {
+        swap_halves(image.rom.data(), (uint32_t)image.rom.size());
+    }
+}
+
+// Counts what the directory walk finds without touching the file data.
+struct CountingSink
+{
+    uint32_t files;
+    uint32_t bytes;
+
+    CountingSink() : files(0), bytes(0) {}
+
+    void open(const char*) { ++files; }
+    void write(const uint8_t*, const uint32_t size) { bytes += size; }
+    void close() {}
+};
+
+// Reconstructs each file into memory, as dumprom does without the disk writes.
+struct MemorySink
+{
+    std::vector<std::vector<uint8_t> > files;
+    size_t count;
+
+    MemorySink() : count(0) {}
+
+    void open(const char*)
+    {
+        if(files.size() <= count)
+        {
+            files.resize(count + 1);
+        }
+        files[count].clear();
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        files[count].insert(files[count].end(), data, data + size);
+    }
+
+    void close()
+    {
+        ++count;
+    }
+};
+
+// Confirm that extraction reproduces the generated files (padded to whole records).
+static void check_round_trip(const Scenario& scenario, const GeneratedImage& image)
+{
+    std::vector<uint8_t> logical = image.rom;
+    if(is_half_swapped(scenario.capacity))
+    {
+        swap_halves(logical.data(), (uint32_t)logical.size());
+    }
+
+    const char* error = verify_rom(logical.data(), (uint32_t)logical.size());
+    if(error)
+    {
+        fatal(error, scenario.name);
+    }
+
+    MemorySink sink;
+    walk_files(logical.data(), (uint32_t)logical.size(), sink);
+
+    if(sink.count != image.contents.size())
+    {
+        fatal("Round trip file count mismatch.", scenario.name);
+    }
+
+    for(size_t i=0; i<sink.count; ++i)
+    {
+        const std::vector<uint8_t>& original = image.contents[i];
+        const std::vector<uint8_t>& extracted = sink.files[i];
+
+        if(extracted.size() != ((original.size() + RECORD_SIZE - 1) / RECORD_SIZE) * RECORD_SIZE ||
+           memcmp(extracted.data(), original.data(), original.size()) != 0)
+        {
+            fatal("Round trip data mismatch.", scenario.name);
+        }
+    }
+}
+
+// Confirm that replacing a file with one too big to fit fails without touching the image, so the
+// original file is still there.
+static void check_failed_replace(const Scenario& scenario, const GeneratedImage& image)
+{
+    std::vector<uint8_t> logical = image.rom;
+    if(is_half_swapped(scenario.capacity))
+    {
+        swap_halves(logical.data(), (uint32_t)logical.size());
+    }
+
+    const std::vector<uint8_t> original = logical;
+    const std::vector<uint8_t> tooBig(logical.size(), 0x5a);
+
+    RomInput input = image.inputs[0];
+    input.data = tooBig.data();
+    input.size = tooBig.size();
+
+    RomEditor editor(logical.data(), (uint32_t)logical.size());
+    if(!editor.replace(input))
+    {
+        fatal("Oversized replace succeeded.", scenario.name);
+    }
+
+    if(!editor.changes().empty() || logical != original)
+    {
+        fatal("Failed replace changed the image.", scenario.name);
+    }
+
+    // The editor is still usable, and still has the original file to replace
+    input.size = image.inputs[0].size;
+    if(editor.replace(input) || verify_rom(logical.data(), (uint32_t)logical.size()))
+    {
+        fatal("Replace after a failed replace did not succeed.", scenario.name);
+    }
+}
+
+// Confirm that an over-dump - the image mirrored to fill a part twice its size, as a 64K dump of
+// a 32K capsule - is detected as the image, in its own layout.
+static void check_mirrored_dump(const Scenario& scenario, const GeneratedImage& image)
+{
+    std::vector<uint8_t> dump(image.rom);
+    dump.insert(dump.end(), image.rom.begin(), image.rom.end());
+
+    RomLayout layout;
+    if(!detect_layout(dump.data(), (uint32_t)dump.size(), layout) || layout.size != image.rom.size() ||
+       layout.swapped != is_half_swapped(scenario.capacity))
+    {
+        fatal("Mirrored dump layout not detected.", scenario.name);
+    }
+}
+
+// Runs op() repeatedly for at least the given time and reports its throughput.
+template<class Op>
+static void run_test(const char* testName, const uint32_t bytesPerImage, const double seconds, Op op)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // Warm up, so only steady state allocations are counted
+    op();
+
+    uint64_t iterations = 0;
+    uint64_t batch = 1;
+    const uint64_t allocationsBefore = allocation_count;
+    const Clock::time_point start = Clock::now();
+    double elapsed = 0;
+
+    while(elapsed < seconds)
+    {
+        for(uint64_t i=0; i<batch; ++i)
+        {
+            op();
+        }
+
+        iterations += batch;
+        if(batch < 4096)
+        {
+            batch *= 2;
+        }
+
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    const double imagesPerSecond = iterations / elapsed;
+    const double mbPerSecond = imagesPerSecond * bytesPerImage / (1024.0 * 1024.0);
+    const double allocationsPerImage = (double)(allocation_count - allocationsBefore) / iterations;
+
+    printf("  %-10s %12.0f images/s %10.1f MB/s %8.1f allocs/image\n", testName, imagesPerSecond, mbPerSecond, allocationsPerImage);
+}
+
+// Stops the optimiser discarding results of the benchmarked code.
+static volatile uint32_t sink_value;
+
+int main(int argc, char* argv[])
+{
+    double seconds = 0.5;
+
+    if(argc > 2)
+    {
+        std::cout << "Usage: rombench [seconds per test]\n" << std::endl;
+        exit(-1);
+    }
+
+    if(argc == 2)
+    {
+        seconds = atof(argv[1]);
+        if(seconds <= 0)
+        {
+            fatal("Invalid time.", argv[1]);
+        }
+    }
+
+    for(size_t iScenario=0; iScenario<sizeof(scenarios)/sizeof(scenarios[0]); ++iScenario)
+    {
+        const Scenario& scenario = scenarios[iScenario];
+
+        GeneratedImage image;
+        generate_image(scenario, 0x5eed + (uint32_t)iScenario, image);
+        check_round_trip(scenario, image);
+        check_failed_replace(scenario, image);
+        check_mirrored_dump(scenario, image);
+
+        const uint32_t romSize = (uint32_t)image.rom.size();
+        const bool swapped = is_half_swapped(scenario.capacity);
+
+        std::vector<uint8_t> logical = image.rom;
+        if(swapped)
+        {
+            swap_halves(logical.data(), romSize);
+        }
+
+        printf("%s (%u bytes%s)\n", scenario.name, romSize, swapped ? ", half-swapped" : "");
+
+        std::vector<uint8_t> work(romSize);
+
+        // physical to logical conversion plus validation and directory walk, as dumprom does it
+        run_test("parse", romSize, seconds, [&]()
+        {
+            memcpy(work.data(), image.rom.data(), romSize);
+            if(swapped)
+            {
+                swap_halves(work.data(), romSize);
+            }
+
+            if(verify_rom(work.data(), romSize) == NULL)
+            {
+                CountingSink counter;
+                walk_files(work.data(), romSize, counter);
+                sink_value += counter.bytes;
+            }
+        });
+
+        MemorySink memorySink;
+        run_test("extract", romSize, seconds, [&]()
+        {
+            memorySink.count = 0;
+            walk_files(logical.data(), romSize, memorySink);
+            sink_value += (uint32_t)memorySink.count;
+        });
+
+        Arena arena(romSize);
+        RomError error;
+        run_test("build", romSize, seconds, [&]()
+        {
+            arena.reset();
+            // The same inputs built when the scenario was generated, so this cannot fail
+            uint8_t* built = build_rom("BENCH", scenario.capacity, image.inputs.data(), image.inputs.size(), arena, error);
+            if(swapped)
+            {
+                swap_halves(built, romSize);
+            }
+            sink_value += built[0];
+        });
+
+        run_test("checksum", romSize, seconds, [&]()
+        {
+            sink_value += image_sum16(image.rom.data(), romSize);
+        });
+
+        run_test("verify", romSize, seconds, [&]()
+        {
+            sink_value += verify_rom(logical.data(), romSize) == NULL;
+        });
+    }
+
+    return 0;
+}
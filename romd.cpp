@@ -0,0 +1,688 @@
+/*
+romd - Andy Anderson 2020
+
+Long running ROM capsule service for frontends that would otherwise run dumprom for every request.
+
+Listens on a local (unix domain) socket and answers list, extract-one-file, verify and build
+requests. Parsed images - the logical image and the extent map of every file - are kept in an
+LRU cache keyed by (device, inode, mtime, size), so repeated requests for popular images are
+answered from memory without re-reading or re-parsing them.
+
+Linux/POSIX only. To compile on linux;
+
+    g++ -O2 romd.cpp -o romd
+
+Usage;
+
+    romd [-c <cached images>] <socket path>
+
+Protocol - one request per line, any number of requests per connection;
+
+    LIST <romfile>                 one line per file: <name> <bytes> <extents>
+    EXTRACT <romfile> <name.ext>   the file contents
+    VERIFY <romfile>               header and directory check
+    BUILD [options] <romfile> <file1> [...]
+                                   build an image, as makerom; the options are makerom's
+                                   --capacity=auto|64|128|256, --capsule=m|p and
+                                   --format=bin|ihex|srec
+    STATS                          cache statistics
+
+Each response is "OK <length>\n" followed by <length> bytes of payload, or "ERR <message>\n".
+
+*/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <fstream>
+#include <iostream>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "epsonrom.h"
+#include "romhex.h"
+#include "romplan.h"
+
+const size_t DEFAULT_CACHE_ENTRIES = 256;
+const size_t MAX_REQUEST_LENGTH = 8192;
+
+// Where one extent's data lives in the cached logical image.
+struct Chunk
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct CachedFile
+{
+    char name[13];
+    uint32_t size;
+    uint32_t extents;
+    uint32_t firstChunk;
+    uint32_t chunkCount;
+};
+
+struct ParsedImage
+{
+    std::vector<uint8_t> image; // logical address order
+    std::vector<CachedFile> files;
+    std::vector<Chunk> chunks;
+};
+
+// Records the extent map of each file, without copying any data.
+struct ExtentMapSink
+{
+    ParsedImage* parsed;
+
+    void open(const char* fileName)
+    {
+        CachedFile file;
+        memset(&file, 0, sizeof(file));
+        snprintf(file.name, sizeof(file.name), "%s", fileName);
+        file.firstChunk = (uint32_t)parsed->chunks.size();
+        parsed->files.push_back(file);
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        Chunk chunk;
+        chunk.offset = (uint32_t)(data - parsed->image.data());
+        chunk.length = size;
+        parsed->chunks.push_back(chunk);
+
+        CachedFile& file = parsed->files.back();
+        file.size += size;
+        ++file.chunkCount;
+    }
+
+    void close()
+    {
+    }
+};
+
+struct CacheKey
+{
+    dev_t dev;
+    ino_t ino;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int64_t size;
+
+    bool operator==(const CacheKey& other) const
+    {
+        return dev == other.dev && ino == other.ino && mtimeSec == other.mtimeSec &&
+               mtimeNsec == other.mtimeNsec && size == other.size;
+    }
+};
+
+struct CacheKeyHash
+{
+    size_t operator()(const CacheKey& key) const
+    {
+        uint64_t h = 1469598103934665603ull;
+        const uint64_t parts[5] = { (uint64_t)key.dev, (uint64_t)key.ino, (uint64_t)key.mtimeSec, (uint64_t)key.mtimeNsec, (uint64_t)key.size };
+        for(int i=0; i<5; ++i)
+        {
+            h = (h ^ parts[i]) * 1099511628211ull;
+        }
+        return (size_t)h;
+    }
+};
+
+// LRU cache of parsed images. A changed file gets a new key, so stale entries simply age out.
+class ImageCache
+{
+public:
+    explicit ImageCache(const size_t capacity) : m_capacity(capacity), m_hits(0), m_misses(0) {}
+
+    // Returns the parsed image, or NULL with error set.
+    const ParsedImage* get(const char* romFile, std::string& error)
+    {
+        struct stat st;
+        if(stat(romFile, &st) != 0)
+        {
+            error = "failed to open input file.";
+            return NULL;
+        }
+
+        CacheKey key;
+        key.dev = st.st_dev;
+        key.ino = st.st_ino;
+        key.mtimeSec = st.st_mtim.tv_sec;
+        key.mtimeNsec = st.st_mtim.tv_nsec;
+        key.size = st.st_size;
+
+        Map::iterator found = m_map.find(key);
+        if(found != m_map.end())
+        {
+            // Most recently used goes to the front
+            m_lru.splice(m_lru.begin(), m_lru, found->second);
+            ++m_hits;
+            return &found->second->second;
+        }
+
+        ++m_misses;
+
+        ParsedImage parsed;
+        if(!parse(romFile, parsed, error))
+        {
+            return NULL;
+        }
+
+        m_lru.push_front(Entry(key, ParsedImage()));
+        m_lru.front().second.image.swap(parsed.image);
+        m_lru.front().second.files.swap(parsed.files);
+        m_lru.front().second.chunks.swap(parsed.chunks);
+        m_map[key] = m_lru.begin();
+
+        if(m_lru.size() > m_capacity)
+        {
+            m_map.erase(m_lru.back().first);
+            m_lru.pop_back();
+        }
+
+        return &m_lru.front().second;
+    }
+
+    void print_stats(std::string& out) const
+    {
+        char text[128];
+        snprintf(text, sizeof(text), "entries %zu\ncapacity %zu\nhits %llu\nmisses %llu\n",
+                 m_lru.size(), m_capacity, (unsigned long long)m_hits, (unsigned long long)m_misses);
+        out = text;
+    }
+
+private:
+    static bool parse(const char* romFile, ParsedImage& parsed, std::string& error)
+    {
+        const char* unreadable = read_image(romFile, parsed.image);
+        if(unreadable)
+        {
+            error = unreadable;
+            return false;
+        }
+
+        // Reject bad images here - the walk relies on a checked image
+        const char* invalid = verify_rom(parsed.image.data(), (uint32_t)parsed.image.size());
+        if(invalid)
+        {
+            error = invalid;
+            return false;
+        }
+
+        ExtentMapSink sink;
+        sink.parsed = &parsed;
+        walk_files(parsed.image.data(), (uint32_t)parsed.image.size(), sink);
+
+        // Count the extents of each file, matching the files the walk opened
+        const RomHeader* header = (const RomHeader*)parsed.image.data();
+        int fileIndex = -1;
+        for(uint8_t dirNo=1; dirNo<header->dir_entries; ++dirNo)
+        {
+            const DirEntry* dir = dir_entry_offset(header, dirNo);
+            if(dir->validity != DIR_ENTRY_VALID)
+            {
+                continue;
+            }
+
+            if(dir->logical_extent == 0)
+            {
+                ++fileIndex;
+            }
+
+            if(fileIndex >= 0)
+            {
+                ++parsed.files[fileIndex].extents;
+            }
+        }
+
+        return true;
+    }
+
+    typedef std::pair<CacheKey, ParsedImage> Entry;
+    typedef std::list<Entry> Lru;
+    typedef std::unordered_map<CacheKey, Lru::iterator, CacheKeyHash> Map;
+
+    size_t m_capacity;
+    Lru m_lru;
+    Map m_map;
+    uint64_t m_hits;
+    uint64_t m_misses;
+};
+
+struct Client
+{
+    int fd;
+    std::string input;
+    std::string output; // replies not yet taken by the socket
+};
+
+// Replies are queued on the client and written out by the event loop as its socket takes them,
+// so a client that stops reading holds up only itself. send_ok() and send_error() return true,
+// as the connection stays open.
+static void queue_output(std::string& output, const char* data, const size_t length)
+{
+    if(length)
+    {
+        output.append(data, length);
+    }
+}
+
+static bool send_ok(std::string& output, const char* payload, const size_t length)
+{
+    char header[32];
+    const int headerLength = snprintf(header, sizeof(header), "OK %zu\n", length);
+
+    queue_output(output, header, headerLength);
+    queue_output(output, payload, length);
+    return true;
+}
+
+static bool send_error(std::string& output, const std::string& message)
+{
+    const std::string response = "ERR " + message + "\n";
+    queue_output(output, response.c_str(), response.length());
+    return true;
+}
+
+static bool handle_build(std::string& output, const std::vector<std::string>& request)
+{
+    // As makerom's defaults: the smallest part that holds the files, M format, binary
+    uint8_t capacity = 0;
+    uint8_t capsule = MAGIC_M;
+    RomFormat format = FORMAT_BINARY;
+    std::vector<std::string> args(1, request[0]);
+
+    for(size_t i=1; i<request.size(); ++i)
+    {
+        const std::string& arg = request[i];
+
+        if(arg.compare(0, 11, "--capacity=") == 0)
+        {
+            if(!capacity_from_name(arg.c_str() + 11, capacity))
+            {
+                return send_error(output, "Unknown capacity : " + arg.substr(11));
+            }
+        }
+        else if(arg.compare(0, 10, "--capsule=") == 0)
+        {
+            if(!capsule_from_name(arg.c_str() + 10, capsule))
+            {
+                return send_error(output, "Unknown capsule format : " + arg.substr(10));
+            }
+        }
+        else if(arg.compare(0, 9, "--format=") == 0)
+        {
+            if(!format_from_name(arg.c_str() + 9, format))
+            {
+                return send_error(output, "Unknown output format : " + arg.substr(9));
+            }
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    if(args.size() < 2)
+    {
+        return send_error(output, "usage: BUILD [--capacity=auto|64|128|256] [--capsule=m|p] [--format=bin|ihex|srec] <romfile> <file1> [file2...]");
+    }
+
+    const char* outName = args[1].c_str();
+
+    struct stat st;
+    if(stat(outName, &st) == 0)
+    {
+        return send_error(output, std::string("Output file already exists. : ") + outName);
+    }
+
+    std::vector<std::vector<uint8_t> > buffers(args.size() - 2);
+    std::vector<RomInput> inputs(args.size() - 2);
+
+    for(size_t i=0; i<inputs.size(); ++i)
+    {
+        std::ifstream inFile(args[i + 2], std::ios::in | std::ios::binary);
+        if(!inFile)
+        {
+            return send_error(output, "failed to open input file. : " + args[i + 2]);
+        }
+
+        buffers[i].assign((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+        // The daemon has no working directory of its own, so name the ROM entry after the basename
+        const char* slash = strrchr(args[i + 2].c_str(), '/');
+        inputs[i].name = slash ? slash + 1 : args[i + 2].c_str();
+        inputs[i].data = buffers[i].data();
+        inputs[i].size = buffers[i].size();
+    }
+
+    // The same capacity makerom would choose, from the file sizes
+    RomError error = rom_error(NULL);
+    capacity = choose_capacity(capacity, inputs.data(), inputs.size(), outName, error);
+
+    Arena arena(rom_size(capacity ? capacity : CAPACITY_256kbit));
+    uint8_t* rom = capacity ? build_rom(outName, capacity, inputs.data(), inputs.size(), arena, error, capsule) : NULL;
+    if(rom == NULL)
+    {
+        return send_error(output, error.param ? std::string(error.message) + " : " + error.param : error.message);
+    }
+
+    uint32_t size = rom_size(capacity);
+    if(is_half_swapped(capacity))
+    {
+        swap_halves(rom, size);
+    }
+
+    std::vector<char> text;
+    const char* encoded = (const char*)rom;
+    if(format != FORMAT_BINARY)
+    {
+        text.resize(hex_encoded_size(size));
+        size = (uint32_t)((format == FORMAT_IHEX) ? encode_ihex(rom, size, text.data()) : encode_srec(rom, size, outName, text.data()));
+        encoded = text.data();
+    }
+
+    std::ofstream outFile(outName, std::ios::out | std::ios::binary);
+    outFile.write(encoded, size);
+    if(!outFile.good())
+    {
+        return send_error(output, std::string("Failed to write to ouput file. : ") + outName);
+    }
+
+    return send_ok(output, NULL, 0);
+}
+
+// Handle one request line. Returns false if the connection should be closed.
+static bool handle_request(std::string& output, const std::string& line, ImageCache& cache)
+{
+    std::vector<std::string> args;
+    size_t pos = 0;
+
+    while(pos < line.length())
+    {
+        const size_t start = line.find_first_not_of(" \t\r", pos);
+        if(start == std::string::npos)
+        {
+            break;
+        }
+
+        size_t end = line.find_first_of(" \t\r", start);
+        if(end == std::string::npos)
+        {
+            end = line.length();
+        }
+
+        args.push_back(line.substr(start, end - start));
+        pos = end;
+    }
+
+    if(args.empty())
+    {
+        return true;
+    }
+
+    const std::string& command = args[0];
+    std::string error;
+
+    if(command == "STATS")
+    {
+        std::string text;
+        cache.print_stats(text);
+        return send_ok(output, text.c_str(), text.length());
+    }
+
+    if(command == "BUILD")
+    {
+        return handle_build(output, args);
+    }
+
+    if(command != "LIST" && command != "EXTRACT" && command != "VERIFY")
+    {
+        return send_error(output, "unknown request " + command);
+    }
+
+    if(args.size() < 2 || (command == "EXTRACT" && args.size() != 3))
+    {
+        return send_error(output, "missing argument");
+    }
+
+    const ParsedImage* parsed = cache.get(args[1].c_str(), error);
+    if(parsed == NULL)
+    {
+        return send_error(output, error);
+    }
+
+    if(command == "VERIFY")
+    {
+        return send_ok(output, NULL, 0);
+    }
+
+    if(command == "LIST")
+    {
+        std::string text;
+        char row[64];
+
+        for(size_t i=0; i<parsed->files.size(); ++i)
+        {
+            const CachedFile& file = parsed->files[i];
+            snprintf(row, sizeof(row), "%s %u %u\n", file.name, file.size, file.extents);
+            text += row;
+        }
+
+        return send_ok(output, text.c_str(), text.length());
+    }
+
+    // EXTRACT - send the chunks straight from the cached image
+    for(size_t i=0; i<parsed->files.size(); ++i)
+    {
+        const CachedFile& file = parsed->files[i];
+
+        if(strcasecmp(file.name, args[2].c_str()) != 0)
+        {
+            continue;
+        }
+
+        char header[32];
+        const int headerLength = snprintf(header, sizeof(header), "OK %u\n", file.size);
+        queue_output(output, header, headerLength);
+
+        for(uint32_t c=0; c<file.chunkCount; ++c)
+        {
+            const Chunk& chunk = parsed->chunks[file.firstChunk + c];
+            queue_output(output, (const char*)parsed->image.data() + chunk.offset, chunk.length);
+        }
+
+        return true;
+    }
+
+    return send_error(output, "no such file " + args[2]);
+}
+
+// Write as much of the client's queued output as its socket takes without blocking.
+// Returns false if the connection has failed.
+static bool flush_output(Client& client)
+{
+    while(!client.output.empty())
+    {
+        const ssize_t sent = send(client.fd, client.output.data(), client.output.length(), MSG_NOSIGNAL);
+        if(sent < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            break;
+        }
+
+        if(sent <= 0)
+        {
+            return false;
+        }
+
+        client.output.erase(0, sent);
+    }
+
+    return true;
+}
+
+// Answer the complete requests in the client's input, one reply at a time: the next request
+// waits until the client has taken the last reply. Returns false if the connection should be closed.
+static bool serve_requests(Client& client, ImageCache& cache)
+{
+    size_t newline;
+    while(client.output.empty() && (newline = client.input.find('\n')) != std::string::npos)
+    {
+        const std::string line = client.input.substr(0, newline);
+        client.input.erase(0, newline + 1);
+
+        if(!handle_request(client.output, line, cache) || !flush_output(client))
+        {
+            return false;
+        }
+    }
+
+    if(client.input.length() > MAX_REQUEST_LENGTH && client.input.find('\n') == std::string::npos)
+    {
+        send_error(client.output, "request too long");
+        flush_output(client);
+        return false;
+    }
+
+    return true;
+}
+
+static void usage()
+{
+    std::cout << "Usage: romd [-c <cached images>] <socket path>\n" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t cacheEntries = DEFAULT_CACHE_ENTRIES;
+    const char* socketPath = NULL;
+
+    for(int i=1; i<argc; ++i)
+    {
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            cacheEntries = (size_t)atol(argv[++i]);
+        }
+        else if(socketPath == NULL)
+        {
+            socketPath = argv[i];
+        }
+        else
+        {
+            usage();
+            exit(-1);
+        }
+    }
+
+    if(socketPath == NULL || cacheEntries == 0)
+    {
+        usage();
+        exit(-1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    const int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd < 0)
+    {
+        fatal("Could not create socket.");
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        fatal("Socket path too long.", socketPath);
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    unlink(socketPath);
+
+    if(bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0)
+    {
+        fatal("Could not listen on socket.", socketPath);
+    }
+
+    ImageCache cache(cacheEntries);
+    std::vector<Client> clients;
+    std::vector<struct pollfd> fds;
+
+    for(;;)
+    {
+        fds.resize(clients.size() + 1);
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        for(size_t i=0; i<clients.size(); ++i)
+        {
+            // A client is not read from while it has a reply to take
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = clients[i].output.empty() ? POLLIN : POLLOUT;
+        }
+
+        if(poll(fds.data(), fds.size(), -1) < 0)
+        {
+            continue;
+        }
+
+        // Serve existing clients first, so the indexes in fds still match
+        for(size_t i=clients.size(); i-- > 0;)
+        {
+            if(!fds[i + 1].revents)
+            {
+                continue;
+            }
+
+            Client& client = clients[i];
+            bool keep = flush_output(client);
+
+            if(keep && (fds[i + 1].revents & ~POLLOUT))
+            {
+                char buffer[4096];
+                const ssize_t received = recv(client.fd, buffer, sizeof(buffer), 0);
+                keep = received > 0 || (received < 0 && (errno == EAGAIN || errno == EINTR));
+
+                if(received > 0)
+                {
+                    client.input.append(buffer, received);
+                }
+            }
+
+            if(keep)
+            {
+                keep = serve_requests(client, cache);
+            }
+
+            if(!keep)
+            {
+                close(client.fd);
+                clients.erase(clients.begin() + i);
+            }
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            const int clientFd = accept(listenFd, NULL, NULL);
+            if(clientFd >= 0 && fcntl(clientFd, F_SETFL, O_NONBLOCK) == 0)
+            {
+                Client client;
+                client.fd = clientFd;
+                clients.push_back(client);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,953 @@
+/*
+romdat - Andy Anderson 2020
+
+Make ROM manager DAT files for a collection of capsule dumps, and audit a collection against one.
+
+Each dump is hashed (size, CRC-32, MD5 and SHA-1) as it is on disk, all three hashes being
+updated from the same pass over the data. With --files the files in each image are hashed too,
+as the directory walk reconstructs them (as dumprom extracts them, padded to whole records),
+and listed in the image's game as <game>/<file> - the layout of a dumprom batch run.
+
+DATs are written in Logiqx XML (as used by No-Intro) or ClrMamePro format, and either can be
+audited against. An audit hashes the dumps on several threads and reports each as ok (it
+matches a rom in the DAT), bad (it has the name of a rom in the DAT but different contents -
+with per-file hashes in the DAT, the files that differ are listed) or unknown, then the roms in
+the DAT that no dump matched as missing.
+
+To compile on linux;
+
+    g++ -O2 -pthread romdat.cpp -o romdat
+
+Usage;
+
+    romdat make [--files] [--format=xml|cmp] [--name=<name>] <datfile> <romfile> [romfile...]
+    romdat audit [--threads=<n>] <datfile> <romfile> [romfile...]
+
+The exit status of an audit is 0 if every dump is ok and nothing is missing, and 1 otherwise.
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+
+#include "epsonrom.h"
+#include "romhash.h"
+
+struct Digests
+{
+    uint64_t size;
+    uint32_t crc;
+    uint8_t md5[MD5_SIZE];
+    uint8_t sha1[SHA1_SIZE];
+};
+
+// All the hashes of the same data, updated together.
+struct MultiHash
+{
+    Crc32 crc;
+    Md5 md5;
+    Sha1 sha;
+    uint64_t size;
+
+    MultiHash() : size(0)
+    {
+    }
+
+    void reset()
+    {
+        crc.reset();
+        md5.reset();
+        sha.reset();
+        size = 0;
+    }
+
+    void update(const uint8_t* data, const size_t length)
+    {
+        crc.update(data, length);
+        md5.update(data, length);
+        sha.update(data, length);
+        size += length;
+    }
+
+    void final(Digests& digests)
+    {
+        digests.size = size;
+        digests.crc = crc.final();
+        md5.final(digests.md5);
+        sha.final(digests.sha1);
+    }
+};
+
+struct FileDigests
+{
+    char name[13];
+    Digests digests;
+};
+
+// Hashes each file reconstructed by walk_files().
+struct DigestSink
+{
+    std::vector<FileDigests>* files;
+    MultiHash hash;
+
+    void open(const char* fileName)
+    {
+        FileDigests file;
+        snprintf(file.name, sizeof(file.name), "%s", fileName);
+        files->push_back(file);
+        hash.reset();
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        hash.update(data, size);
+    }
+
+    void close()
+    {
+        hash.final(files->back().digests);
+    }
+};
+
+struct ImageDigests
+{
+    const char* romFile;
+    std::string name;  // without the path
+    std::string game;  // name without the extension
+    const char* error; // could not be read, or (with files) is not a valid image
+    Digests digests;
+    std::vector<FileDigests> files;
+};
+
+static void hash_image(ImageDigests& result, const bool files)
+{
+    result.error = NULL;
+    result.files.clear();
+
+    const char* name = result.romFile;
+    for(const char* p=result.romFile; *p; ++p)
+    {
+        if(*p == '/' || *p == '\\')
+        {
+            name = p + 1;
+        }
+    }
+    result.name = name;
+
+    const char* dot = strrchr(name, '.');
+    result.game.assign(name, (dot && dot > name) ? dot - name : strlen(name));
+
+    std::ifstream inFile(result.romFile, std::ios::in | std::ios::binary);
+    if(!inFile)
+    {
+        result.error = ERROR_OPEN_INPUT;
+        return;
+    }
+
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+
+    // As it is on disk, which is what a DAT describes
+    MultiHash hash;
+    hash.update(image.data(), image.size());
+    hash.final(result.digests);
+
+    if(!files)
+    {
+        return;
+    }
+
+    std::vector<uint8_t> scratch;
+    result.error = decode_rom_input(image, scratch, ROM_OFFSET_AUTO);
+    if(result.error)
+    {
+        return;
+    }
+
+    to_logical(image);
+
+    result.error = verify_rom(image.data(), (uint32_t)image.size());
+    if(result.error)
+    {
+        return;
+    }
+
+    DigestSink sink;
+    sink.files = &result.files;
+    walk_files(image.data(), (uint32_t)image.size(), sink);
+}
+
+// Hash every image, on the given number of threads.
+static void hash_images(std::vector<ImageDigests>& images, const bool files, const unsigned threads)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+
+    for(unsigned t=0; t<threads; ++t)
+    {
+        pool.push_back(std::thread([&]()
+        {
+            for(size_t i=next++; i<images.size(); i=next++)
+            {
+                hash_image(images[i], files);
+            }
+        }));
+    }
+
+    for(size_t t=0; t<pool.size(); ++t)
+    {
+        pool[t].join();
+    }
+}
+
+static std::string hex_string(const uint8_t* digest, const size_t size)
+{
+    char text[SHA1_SIZE * 2 + 1];
+    hex_digest(digest, size, text);
+    return text;
+}
+
+static std::string crc_string(const uint32_t crc)
+{
+    char text[9];
+    snprintf(text, sizeof(text), "%08x", crc);
+    return text;
+}
+
+static std::string xml_escape(const std::string& text)
+{
+    std::string escaped;
+    for(size_t i=0; i<text.size(); ++i)
+    {
+        switch(text[i])
+        {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        default: escaped += text[i];
+        }
+    }
+    return escaped;
+}
+
+static void write_rom(std::ostream& out, const bool xml, const std::string& name, const Digests& digests)
+{
+    if(xml)
+    {
+        out << "\t\t<rom name=\"" << xml_escape(name) << "\" size=\"" << digests.size << "\" crc=\"" << crc_string(digests.crc)
+            << "\" md5=\"" << hex_string(digests.md5, MD5_SIZE) << "\" sha1=\"" << hex_string(digests.sha1, SHA1_SIZE) << "\"/>\n";
+    }
+    else
+    {
+        out << "\trom ( name \"" << name << "\" size " << digests.size << " crc " << crc_string(digests.crc)
+            << " md5 " << hex_string(digests.md5, MD5_SIZE) << " sha1 " << hex_string(digests.sha1, SHA1_SIZE) << " )\n";
+    }
+}
+
+static void make_dat(const char* datName, const bool xml, const std::string& name, std::vector<ImageDigests>& images, const bool files)
+{
+    fail_if_exists(datName);
+
+    std::ostringstream out;
+
+    if(xml)
+    {
+        out << "<?xml version=\"1.0\"?>\n"
+               "<!DOCTYPE datafile PUBLIC \"-//Logiqx//DTD ROM Management Datafile//EN\" \"http://www.logiqx.com/Dats/datafile.dtd\">\n"
+               "<datafile>\n"
+               "\t<header>\n"
+               "\t\t<name>" << xml_escape(name) << "</name>\n"
+               "\t\t<description>" << xml_escape(name) << "</description>\n"
+               "\t</header>\n";
+    }
+    else
+    {
+        out << "clrmamepro (\n\tname \"" << name << "\"\n\tdescription \"" << name << "\"\n)\n";
+    }
+
+    for(size_t i=0; i<images.size(); ++i)
+    {
+        const ImageDigests& image = images[i];
+
+        if(image.error == ERROR_OPEN_INPUT)
+        {
+            fatal(image.error, image.romFile);
+        }
+
+        if(image.error)
+        {
+            std::cerr << image.romFile << ": " << image.error << " Only the dump is listed." << std::endl;
+        }
+
+        if(xml)
+        {
+            out << "\t<game name=\"" << xml_escape(image.game) << "\">\n\t\t<description>" << xml_escape(image.game) << "</description>\n";
+        }
+        else
+        {
+            out << "\ngame (\n\tname \"" << image.game << "\"\n\tdescription \"" << image.game << "\"\n";
+        }
+
+        write_rom(out, xml, image.name, image.digests);
+
+        for(size_t f=0; files && f<image.files.size(); ++f)
+        {
+            write_rom(out, xml, image.game + "/" + image.files[f].name, image.files[f].digests);
+        }
+
+        out << (xml ? "\t</game>\n" : ")\n");
+    }
+
+    if(xml)
+    {
+        out << "</datafile>\n";
+    }
+
+    const std::string text = out.str();
+    std::ofstream outFile(datName, std::ios::out | std::ios::binary);
+    outFile.write(text.data(), text.size());
+
+    if(!outFile.good())
+    {
+        fatal("Failed to write to ouput file.", datName);
+    }
+
+    std::cout << images.size() << " images listed." << std::endl;
+}
+
+struct DatRom
+{
+    std::string name;
+    uint64_t size;
+    uint32_t crc;
+    uint8_t md5[MD5_SIZE];
+    uint8_t sha1[SHA1_SIZE];
+    bool hasSize;
+    bool hasCrc;
+    bool hasMd5;
+    bool hasSha1;
+    size_t game;
+    bool found;
+};
+
+struct DatGame
+{
+    std::string name;
+};
+
+static bool parse_hex(const std::string& text, uint8_t* bytes, const size_t size)
+{
+    if(text.size() != size * 2)
+    {
+        return false;
+    }
+
+    for(size_t i=0; i<size; ++i)
+    {
+        const int high = hex_digit_value((uint8_t)text[i * 2]);
+        const int low = hex_digit_value((uint8_t)text[i * 2 + 1]);
+        if(high < 0 || low < 0)
+        {
+            return false;
+        }
+        bytes[i] = (uint8_t)((high << 4) | low);
+    }
+
+    return true;
+}
+
+static void set_rom_field(DatRom& rom, const std::string& key, const std::string& value)
+{
+    uint8_t crc[4];
+
+    if(key == "name")
+    {
+        rom.name = value;
+    }
+    else if(key == "size")
+    {
+        rom.size = strtoull(value.c_str(), NULL, 10);
+        rom.hasSize = true;
+    }
+    else if(key == "crc" && parse_hex(value, crc, 4))
+    {
+        rom.crc = ((uint32_t)crc[0] << 24) | ((uint32_t)crc[1] << 16) | ((uint32_t)crc[2] << 8) | crc[3];
+        rom.hasCrc = true;
+    }
+    else if(key == "md5")
+    {
+        rom.hasMd5 = parse_hex(value, rom.md5, MD5_SIZE);
+    }
+    else if(key == "sha1")
+    {
+        rom.hasSha1 = parse_hex(value, rom.sha1, SHA1_SIZE);
+    }
+}
+
+static DatRom new_rom(const size_t game)
+{
+    DatRom rom;
+    rom.size = 0;
+    rom.crc = 0;
+    rom.hasSize = rom.hasCrc = rom.hasMd5 = rom.hasSha1 = false;
+    rom.game = game;
+    rom.found = false;
+    return rom;
+}
+
+static std::string xml_unescape(const std::string& text)
+{
+    static const char* const entities[][2] = { { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" } };
+
+    std::string plain;
+    for(size_t i=0; i<text.size(); ++i)
+    {
+        bool replaced = false;
+        for(size_t e=0; e<5 && text[i] == '&'; ++e)
+        {
+            const size_t length = strlen(entities[e][0]);
+            if(text.compare(i, length, entities[e][0]) == 0)
+            {
+                plain += entities[e][1];
+                i += length - 1;
+                replaced = true;
+                break;
+            }
+        }
+
+        if(!replaced)
+        {
+            plain += text[i];
+        }
+    }
+    return plain;
+}
+
+// Logiqx XML: only the game (or machine) and rom elements and their attributes are needed.
+static void parse_xml_dat(const std::string& text, std::vector<DatGame>& games, std::vector<DatRom>& roms)
+{
+    size_t pos = 0;
+
+    while((pos = text.find('<', pos)) != std::string::npos)
+    {
+        const size_t end = text.find('>', pos);
+        if(end == std::string::npos)
+        {
+            break;
+        }
+
+        const std::string tag = text.substr(pos + 1, end - pos - 1);
+        pos = end + 1;
+
+        const size_t nameEnd = tag.find_first_of(" \t\r\n/");
+        const std::string element = tag.substr(0, nameEnd);
+        const bool game = (element == "game" || element == "machine");
+
+        if(!game && element != "rom")
+        {
+            continue;
+        }
+
+        if(game)
+        {
+            games.push_back(DatGame());
+        }
+        else if(games.empty())
+        {
+            continue;
+        }
+
+        DatRom rom = new_rom(games.size() - 1);
+
+        // key="value" or key='value'
+        size_t a = nameEnd;
+        while(a < tag.size())
+        {
+            const size_t equals = tag.find('=', a);
+            if(equals == std::string::npos || equals + 1 >= tag.size())
+            {
+                break;
+            }
+
+            const size_t keyStart = tag.find_last_of(" \t\r\n", equals) + 1;
+            const std::string key = tag.substr(keyStart, equals - keyStart);
+            const char quote = tag[equals + 1];
+            const size_t valueEnd = tag.find(quote, equals + 2);
+            if((quote != '"' && quote != '\'') || valueEnd == std::string::npos)
+            {
+                break;
+            }
+
+            const std::string value = xml_unescape(tag.substr(equals + 2, valueEnd - equals - 2));
+            if(game)
+            {
+                if(key == "name")
+                {
+                    games.back().name = value;
+                }
+            }
+            else
+            {
+                set_rom_field(rom, key, value);
+            }
+
+            a = valueEnd + 1;
+        }
+
+        if(!game)
+        {
+            roms.push_back(rom);
+        }
+    }
+}
+
+// Quoted strings are tokens that keep their opening quote, so they are never taken for keywords or brackets.
+static std::string token_value(const std::string& token)
+{
+    return (!token.empty() && token[0] == '"') ? token.substr(1) : token;
+}
+
+// ClrMamePro: blocks of key value pairs, e.g. game ( name "x" rom ( name x.rom size 8192 crc ... ) ).
+static void parse_cmp_dat(const std::string& text, std::vector<DatGame>& games, std::vector<DatRom>& roms)
+{
+    std::vector<std::string> tokens;
+    size_t pos = 0;
+
+    while(pos < text.size())
+    {
+        const char c = text[pos];
+        if(c == ' ' || c == '\t' || c == '\r' || c == '\n')
+        {
+            ++pos;
+        }
+        else if(c == '(' || c == ')')
+        {
+            tokens.push_back(std::string(1, c));
+            ++pos;
+        }
+        else if(c == '"')
+        {
+            const size_t end = text.find('"', pos + 1);
+            const size_t stop = (end == std::string::npos) ? text.size() : end;
+            tokens.push_back("\"" + text.substr(pos + 1, stop - pos - 1));
+            pos = stop + 1;
+        }
+        else
+        {
+            const size_t end = text.find_first_of(" \t\r\n()\"", pos);
+            const size_t stop = (end == std::string::npos) ? text.size() : end;
+            tokens.push_back(text.substr(pos, stop - pos));
+            pos = stop;
+        }
+    }
+
+    int depth = 0;
+    bool inGame = false;
+
+    for(size_t t=0; t<tokens.size(); ++t)
+    {
+        const std::string& token = tokens[t];
+
+        if(token == "(")
+        {
+            ++depth;
+            continue;
+        }
+
+        if(token == ")")
+        {
+            --depth;
+            inGame = inGame && depth > 0;
+            continue;
+        }
+
+        if(depth == 0)
+        {
+            if((token == "game" || token == "machine" || token == "resource") && t + 1 < tokens.size() && tokens[t + 1] == "(")
+            {
+                games.push_back(DatGame());
+                inGame = true;
+            }
+            continue;
+        }
+
+        if(!inGame || depth != 1 || t + 1 >= tokens.size())
+        {
+            continue;
+        }
+
+        if(token == "name")
+        {
+            games.back().name = token_value(tokens[++t]);
+        }
+        else if(token == "rom" && tokens[t + 1] == "(")
+        {
+            DatRom rom = new_rom(games.size() - 1);
+
+            for(t+=2; t<tokens.size() && tokens[t] != ")"; t+=2)
+            {
+                if(t + 1 < tokens.size() && tokens[t + 1] != ")")
+                {
+                    set_rom_field(rom, tokens[t], token_value(tokens[t + 1]));
+                }
+            }
+
+            roms.push_back(rom);
+        }
+    }
+}
+
+static bool is_file_rom(const DatRom& rom)
+{
+    return rom.name.find('/') != std::string::npos || rom.name.find('\\') != std::string::npos;
+}
+
+// Does the rom describe data with these digests? Every hash the DAT gives must agree.
+static bool rom_matches(const DatRom& rom, const Digests& digests)
+{
+    return (!rom.hasSize || rom.size == digests.size) &&
+           (!rom.hasCrc || rom.crc == digests.crc) &&
+           (!rom.hasMd5 || memcmp(rom.md5, digests.md5, MD5_SIZE) == 0) &&
+           (!rom.hasSha1 || memcmp(rom.sha1, digests.sha1, SHA1_SIZE) == 0) &&
+           (rom.hasCrc || rom.hasMd5 || rom.hasSha1);
+}
+
+// Key of a rom's digest in the audit's lookup table, from the first bytes of a hash.
+static uint64_t digest_key(const uint8_t* hash)
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return key;
+}
+
+// How a bad dump differs from the rom with its name: the first of crc, sha1, md5 and size that
+// the DAT gives and the dump does not match.
+static std::string hash_difference(const DatRom& rom, const Digests& digests)
+{
+    if(rom.hasCrc && rom.crc != digests.crc)
+    {
+        return "crc " + crc_string(digests.crc) + ", expected " + crc_string(rom.crc);
+    }
+
+    if(rom.hasSha1 && memcmp(rom.sha1, digests.sha1, SHA1_SIZE) != 0)
+    {
+        return "sha1 " + hex_string(digests.sha1, SHA1_SIZE) + ", expected " + hex_string(rom.sha1, SHA1_SIZE);
+    }
+
+    if(rom.hasMd5 && memcmp(rom.md5, digests.md5, MD5_SIZE) != 0)
+    {
+        return "md5 " + hex_string(digests.md5, MD5_SIZE) + ", expected " + hex_string(rom.md5, MD5_SIZE);
+    }
+
+    std::ostringstream text;
+    text << "size " << digests.size << ", expected " << rom.size;
+    return text.str();
+}
+
+static std::string lower_case(std::string text)
+{
+    for(size_t i=0; i<text.size(); ++i)
+    {
+        text[i] = (char)tolower((uint8_t)text[i]);
+    }
+    return text;
+}
+
+// With per-file hashes in the DAT, list the files of a bad dump that differ from it.
+static void report_files(const ImageDigests& image, const std::string& game, const std::vector<DatRom>& roms, const size_t gameIndex)
+{
+    if(image.error)
+    {
+        std::cout << "    " << image.error << "\n";
+        return;
+    }
+
+    std::vector<bool> listed(image.files.size(), false);
+
+    for(size_t r=0; r<roms.size(); ++r)
+    {
+        if(roms[r].game != gameIndex || !is_file_rom(roms[r]))
+        {
+            continue;
+        }
+
+        const std::string fileName = roms[r].name.substr(roms[r].name.find_last_of("/\\") + 1);
+        bool present = false;
+
+        for(size_t f=0; f<image.files.size(); ++f)
+        {
+            if(lower_case(image.files[f].name) == lower_case(fileName))
+            {
+                present = true;
+                listed[f] = true;
+                if(!rom_matches(roms[r], image.files[f].digests))
+                {
+                    std::cout << "    " << game << "/" << fileName << " differs\n";
+                }
+            }
+        }
+
+        if(!present)
+        {
+            std::cout << "    " << game << "/" << fileName << " missing\n";
+        }
+    }
+
+    for(size_t f=0; f<image.files.size(); ++f)
+    {
+        if(!listed[f])
+        {
+            std::cout << "    " << game << "/" << image.files[f].name << " not in the DAT\n";
+        }
+    }
+}
+
+static bool audit(const char* datName, std::vector<ImageDigests>& images, const unsigned threads)
+{
+    std::ifstream datFile(datName, std::ios::in | std::ios::binary);
+    if(!datFile)
+    {
+        fatal("failed to open input file.", datName);
+    }
+
+    const std::string text((std::istreambuf_iterator<char>(datFile)), std::istreambuf_iterator<char>());
+
+    std::vector<DatGame> games;
+    std::vector<DatRom> roms;
+
+    const size_t first = text.find_first_not_of(" \t\r\n\xef\xbb\xbf");
+    if(first != std::string::npos && text[first] == '<')
+    {
+        parse_xml_dat(text, games, roms);
+    }
+    else
+    {
+        parse_cmp_dat(text, games, roms);
+    }
+
+    if(roms.empty())
+    {
+        fatal("No roms in the DAT file.", datName);
+    }
+
+    // Dumps are found by size and CRC, or by SHA-1 or MD5 for roms without both, then checked
+    // against the other hashes; bad dumps by name. Each rom is in one table, under the first key
+    // it has; the few with none of them (a CRC without a size) are checked against every dump.
+    enum { KEY_CRC, KEY_SHA1, KEY_MD5, KEY_COUNT };
+    std::unordered_multimap<uint64_t, size_t> byKey[KEY_COUNT];
+    std::vector<size_t> unkeyed;
+    std::unordered_map<std::string, size_t> byName;
+    bool fileHashes = false;
+
+    for(size_t r=0; r<roms.size(); ++r)
+    {
+        const DatRom& rom = roms[r];
+        if(is_file_rom(rom))
+        {
+            fileHashes = true;
+            continue;
+        }
+
+        if(rom.hasSize && rom.hasCrc)
+        {
+            byKey[KEY_CRC].insert(std::make_pair((rom.size << 32) | rom.crc, r));
+        }
+        else if(rom.hasSha1)
+        {
+            byKey[KEY_SHA1].insert(std::make_pair(digest_key(rom.sha1), r));
+        }
+        else if(rom.hasMd5)
+        {
+            byKey[KEY_MD5].insert(std::make_pair(digest_key(rom.md5), r));
+        }
+        else
+        {
+            unkeyed.push_back(r);
+        }
+
+        byName.insert(std::make_pair(lower_case(rom.name), r));
+    }
+
+    hash_images(images, fileHashes, threads);
+
+    uint32_t ok = 0, bad = 0, unknown = 0, missing = 0, errors = 0;
+
+    for(size_t i=0; i<images.size(); ++i)
+    {
+        ImageDigests& image = images[i];
+
+        if(image.error == ERROR_OPEN_INPUT)
+        {
+            std::cout << "error    " << image.romFile << ": " << image.error << "\n";
+            ++errors;
+            continue;
+        }
+
+        std::vector<size_t> candidates(unkeyed);
+        const uint64_t keys[KEY_COUNT] = { (image.digests.size << 32) | image.digests.crc, digest_key(image.digests.sha1),
+                                           digest_key(image.digests.md5) };
+
+        for(int k=0; k<KEY_COUNT; ++k)
+        {
+            typedef std::unordered_multimap<uint64_t, size_t>::iterator Iterator;
+            const std::pair<Iterator, Iterator> keyed = byKey[k].equal_range(keys[k]);
+            for(Iterator c=keyed.first; c!=keyed.second; ++c)
+            {
+                candidates.push_back(c->second);
+            }
+        }
+
+        bool matched = false;
+        for(size_t c=0; c<candidates.size(); ++c)
+        {
+            DatRom& rom = roms[candidates[c]];
+            if(rom_matches(rom, image.digests))
+            {
+                if(!matched)
+                {
+                    std::cout << "ok       " << image.romFile;
+                    if(lower_case(rom.name) != lower_case(image.name))
+                    {
+                        std::cout << " (" << games[rom.game].name << ": " << rom.name << ")";
+                    }
+                    std::cout << "\n";
+                }
+                matched = true;
+                rom.found = true;
+            }
+        }
+
+        if(matched)
+        {
+            ++ok;
+            continue;
+        }
+
+        std::unordered_map<std::string, size_t>::iterator named = byName.find(lower_case(image.name));
+        if(named != byName.end())
+        {
+            DatRom& rom = roms[named->second];
+            std::cout << "bad      " << image.romFile << " (" << games[rom.game].name << "): " << hash_difference(rom, image.digests) << "\n";
+            if(fileHashes)
+            {
+                report_files(image, games[rom.game].name, roms, rom.game);
+            }
+            rom.found = true; // present, if bad, so not also missing
+            ++bad;
+            continue;
+        }
+
+        std::cout << "unknown  " << image.romFile << " crc " << crc_string(image.digests.crc) << " sha1 "
+                  << hex_string(image.digests.sha1, SHA1_SIZE) << "\n";
+        ++unknown;
+    }
+
+    for(size_t r=0; r<roms.size(); ++r)
+    {
+        if(!roms[r].found && !is_file_rom(roms[r]))
+        {
+            std::cout << "missing  " << games[roms[r].game].name << ": " << roms[r].name << "\n";
+            ++missing;
+        }
+    }
+
+    std::cout << ok << " ok, " << bad << " bad, " << unknown << " unknown, " << missing << " missing";
+    if(errors)
+    {
+        std::cout << ", " << errors << " unreadable";
+    }
+    std::cout << std::endl;
+
+    return bad == 0 && unknown == 0 && missing == 0 && errors == 0;
+}
+
+static void usage()
+{
+    std::cout << "Usage: romdat make [--files] [--format=xml|cmp] [--name=<name>] <datfile> <romfile> [romfile...]\n"
+                 "       romdat audit [--threads=<n>] <datfile> <romfile> [romfile...]\n" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        usage();
+        exit(-1);
+    }
+
+    const bool make = strcmp(argv[1], "make") == 0;
+    if(!make && strcmp(argv[1], "audit") != 0)
+    {
+        usage();
+        exit(-1);
+    }
+
+    bool files = false;
+    bool xml = true;
+    std::string name = "Epson PX-8 ROM capsules";
+    unsigned threads = std::thread::hardware_concurrency();
+    int first = 2;
+
+    for(; first<argc && strncmp(argv[first], "--", 2) == 0; ++first)
+    {
+        if(make && strcmp(argv[first], "--files") == 0)
+        {
+            files = true;
+        }
+        else if(make && strcmp(argv[first], "--format=xml") == 0)
+        {
+            xml = true;
+        }
+        else if(make && strcmp(argv[first], "--format=cmp") == 0)
+        {
+            xml = false;
+        }
+        else if(make && strncmp(argv[first], "--name=", 7) == 0)
+        {
+            name = argv[first] + 7;
+        }
+        else if(strncmp(argv[first], "--threads=", 10) == 0)
+        {
+            threads = (unsigned)atoi(argv[first] + 10);
+        }
+        else
+        {
+            std::cerr << "Unknown option : " << argv[first] << std::endl;
+            exit(-1);
+        }
+    }
+
+    if(argc - first < 2)
+    {
+        usage();
+        exit(-1);
+    }
+
+    threads = threads ? threads : 1;
+
+    const char* datName = argv[first];
+    std::vector<ImageDigests> images(argc - first - 1);
+    for(size_t i=0; i<images.size(); ++i)
+    {
+        images[i].romFile = argv[first + 1 + i];
+    }
+
+    if(make)
+    {
+        hash_images(images, files, threads);
+        make_dat(datName, xml, name, images, files);
+        return 0;
+    }
+
+    return audit(datName, images, threads) ? 0 : 1;
+}
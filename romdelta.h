@@ -0,0 +1,451 @@
+/*
+romdelta.h - Andy Anderson 2020
+
+Block level patches between two ROM capsule images (romdiff, rompatch).
+
+Patches are made between logical images, so the half swap of a 27C256 does not turn a small
+change into a change of every block. The new image is encoded as a sequence of operations in
+output order, so a patch is applied in a single pass;
+
+    COPY_OLD  - bytes from the old image (unchanged or moved blocks)
+    COPY_NEW  - bytes already written to the new image (duplicated blocks)
+    FILL      - a run of one byte value (erased blocks, padding)
+    LITERAL   - new data
+
+Operations are made for the directory region and then each 1K block of the new image, as
+addressed by block_address(). A block found whole anywhere in the old image (at its own block
+addresses) or earlier in the new image is a single reference; otherwise it is encoded against
+the same block of the old image, copying the unchanged runs.
+
+Patch layout (little endian);
+
+    char     magic[4]     "EPRP"
+    uint8_t  version      1
+    uint32_t oldSize
+    uint32_t newSize
+    uint8_t  oldSha1[20]  of the old logical image
+    uint8_t  newSha1[20]  of the new logical image
+    operations..., OP_END
+
+*/
+
+#ifndef ROMDELTA_H
+#define ROMDELTA_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+
+#include "epsonrom.h"
+#include "romhash.h"
+
+const char PATCH_MAGIC[4] = { 'E', 'P', 'R', 'P' };
+const uint8_t PATCH_VERSION = 1;
+const size_t PATCH_HEADER_SIZE = 4 + 1 + 4 + 4 + SHA1_SIZE + SHA1_SIZE;
+
+const uint8_t OP_END = 0x00;
+const uint8_t OP_COPY_OLD = 0x01; // uint32_t offset, uint16_t length
+const uint8_t OP_COPY_NEW = 0x02; // uint32_t offset, uint16_t length
+const uint8_t OP_FILL = 0x03;     // uint16_t length, uint8_t value
+const uint8_t OP_LITERAL = 0x04;  // uint16_t length, data
+
+const uint32_t MAX_OP_LENGTH = 0xffff;
+
+// Shorter runs of unchanged bytes are cheaper to send as part of a literal
+const uint32_t MIN_COPY_RUN = 8;
+
+static inline void put_u16(std::vector<uint8_t>& out, const uint32_t value)
+{
+    out.push_back((uint8_t)value);
+    out.push_back((uint8_t)(value >> 8));
+}
+
+static inline void put_u32(std::vector<uint8_t>& out, const uint32_t value)
+{
+    put_u16(out, value & 0xffff);
+    put_u16(out, value >> 16);
+}
+
+static inline uint32_t get_u16(const uint8_t* p)
+{
+    return p[0] | ((uint32_t)p[1] << 8);
+}
+
+static inline uint32_t get_u32(const uint8_t* p)
+{
+    return get_u16(p) | (get_u16(p + 2) << 16);
+}
+
+// Offset of the first byte that differs between a and b, or size if they are the same.
+// Compares 64 bytes per step with SSE2 where available, so identical regions are passed quickly.
+static inline uint32_t first_difference(const uint8_t* a, const uint8_t* b, const uint32_t size)
+{
+    uint32_t i = 0;
+
+#ifdef ROM_HAVE_SSE2
+    for(; i + 64 <= size; i += 64)
+    {
+        const __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        const __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        const __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32)));
+        const __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)));
+        const __m128i all = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+
+        if(_mm_movemask_epi8(all) != 0xffff)
+        {
+            break;
+        }
+    }
+#endif
+
+    for(; i < size; ++i)
+    {
+        if(a[i] != b[i])
+        {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+// Offsets of the 1K blocks of a logical image. Images that are not valid ROMs are treated as
+// having no directory, so they can still be patched.
+static inline uint32_t block_grid_start(const uint8_t* image, const uint32_t size)
+{
+    if(verify_rom(image, size) != NULL)
+    {
+        return 0;
+    }
+
+    return ((const RomHeader*)image)->dir_entries * sizeof(DirEntry);
+}
+
+// Appends operations, merging each with the previous operation where they are contiguous.
+class PatchWriter
+{
+public:
+    explicit PatchWriter(std::vector<uint8_t>& out) : m_out(out), m_lastOp(OP_END), m_lastAt(0), m_lastSource(0), m_lastLength(0) {}
+
+    void copy(const uint8_t op, const uint32_t source, uint32_t length)
+    {
+        if(m_lastOp == op && m_lastSource + m_lastLength == source && m_lastLength + length <= MAX_OP_LENGTH)
+        {
+            m_lastLength += length;
+            rewrite_length(m_lastAt + 5);
+            return;
+        }
+
+        m_lastOp = op;
+        m_lastAt = m_out.size();
+        m_lastSource = source;
+        m_lastLength = length;
+        m_out.push_back(op);
+        put_u32(m_out, source);
+        put_u16(m_out, length);
+    }
+
+    void fill(const uint8_t value, const uint32_t length)
+    {
+        if(m_lastOp == OP_FILL && m_out.back() == value && m_lastLength + length <= MAX_OP_LENGTH)
+        {
+            m_lastLength += length;
+            rewrite_length(m_lastAt + 1);
+            return;
+        }
+
+        m_lastOp = OP_FILL;
+        m_lastAt = m_out.size();
+        m_lastLength = length;
+        m_out.push_back(OP_FILL);
+        put_u16(m_out, length);
+        m_out.push_back(value);
+    }
+
+    void literal(const uint8_t* data, const uint32_t length)
+    {
+        if(m_lastOp == OP_LITERAL && m_lastLength + length <= MAX_OP_LENGTH)
+        {
+            m_lastLength += length;
+            rewrite_length(m_lastAt + 1);
+            m_out.insert(m_out.end(), data, data + length);
+            return;
+        }
+
+        m_lastOp = OP_LITERAL;
+        m_lastAt = m_out.size();
+        m_lastLength = length;
+        m_out.push_back(OP_LITERAL);
+        put_u16(m_out, length);
+        m_out.insert(m_out.end(), data, data + length);
+    }
+
+    void end()
+    {
+        m_out.push_back(OP_END);
+        m_lastOp = OP_END;
+    }
+
+private:
+    void rewrite_length(const size_t at)
+    {
+        m_out[at] = (uint8_t)m_lastLength;
+        m_out[at + 1] = (uint8_t)(m_lastLength >> 8);
+    }
+
+    std::vector<uint8_t>& m_out;
+    uint8_t m_lastOp;
+    size_t m_lastAt;
+    uint32_t m_lastSource;
+    uint32_t m_lastLength;
+};
+
+// Encode target (at offset in the new image) against the old image at the same offset,
+// copying unchanged runs and sending the rest as literals.
+static inline void encode_against(PatchWriter& writer, const uint8_t* oldImage, const uint32_t oldSize,
+                                  const uint8_t* target, const uint32_t offset, const uint32_t length)
+{
+    const uint32_t overlap = (offset < oldSize) ? std::min(length, oldSize - offset) : 0;
+    uint32_t i = 0;
+    uint32_t literalStart = 0;
+
+    while(i < overlap)
+    {
+        if(target[i] != oldImage[offset + i])
+        {
+            ++i;
+            continue;
+        }
+
+        const uint32_t run = i + first_difference(target + i, oldImage + offset + i, overlap - i);
+
+        if(run - i >= MIN_COPY_RUN || run == length)
+        {
+            if(i > literalStart)
+            {
+                writer.literal(target + literalStart, i - literalStart);
+            }
+            writer.copy(OP_COPY_OLD, offset + i, run - i);
+            literalStart = run;
+        }
+
+        i = run;
+    }
+
+    if(length > literalStart)
+    {
+        writer.literal(target + literalStart, length - literalStart);
+    }
+}
+
+static inline bool is_fill(const uint8_t* data, const uint32_t length)
+{
+    for(uint32_t i=1; i<length; ++i)
+    {
+        if(data[i] != data[0])
+        {
+            return false;
+        }
+    }
+
+    return length > 0;
+}
+
+// Make a patch that turns the old logical image into the new logical image.
+static inline void make_patch(const uint8_t* oldImage, const uint32_t oldSize, const uint8_t* newImage, const uint32_t newSize,
+                              std::vector<uint8_t>& patch)
+{
+    patch.assign(PATCH_MAGIC, PATCH_MAGIC + sizeof(PATCH_MAGIC));
+    patch.push_back(PATCH_VERSION);
+    put_u32(patch, oldSize);
+    put_u32(patch, newSize);
+
+    uint8_t digest[SHA1_SIZE];
+    Sha1 sha;
+    sha.update(oldImage, oldSize);
+    sha.final(digest);
+    patch.insert(patch.end(), digest, digest + SHA1_SIZE);
+    sha.reset();
+    sha.update(newImage, newSize);
+    sha.final(digest);
+    patch.insert(patch.end(), digest, digest + SHA1_SIZE);
+
+    // Every whole block of the old image, by content
+    std::unordered_map<uint64_t, uint32_t> oldBlocks;
+    for(uint32_t offset=block_grid_start(oldImage, oldSize); offset + BLOCK_SIZE <= oldSize; offset += BLOCK_SIZE)
+    {
+        oldBlocks.insert(std::make_pair(hash64(oldImage + offset, BLOCK_SIZE), offset));
+    }
+
+    std::unordered_map<uint64_t, uint32_t> newBlocks;
+    PatchWriter writer(patch);
+
+    const uint32_t gridStart = std::min(block_grid_start(newImage, newSize), newSize);
+    uint32_t offset = 0;
+
+    while(offset < newSize)
+    {
+        // The directory region, then a block at a time
+        const uint32_t length = (offset < gridStart) ? gridStart - offset : std::min(BLOCK_SIZE, newSize - offset);
+        const uint8_t* target = newImage + offset;
+
+        if(is_fill(target, length))
+        {
+            writer.fill(target[0], length);
+        }
+        else if(length == BLOCK_SIZE)
+        {
+            const uint64_t hash = hash64(target, length);
+
+            std::unordered_map<uint64_t, uint32_t>::const_iterator found = oldBlocks.find(hash);
+            if(found != oldBlocks.end() && memcmp(oldImage + found->second, target, length) == 0)
+            {
+                writer.copy(OP_COPY_OLD, found->second, length);
+            }
+            else if((found = newBlocks.find(hash)) != newBlocks.end() && memcmp(newImage + found->second, target, length) == 0)
+            {
+                writer.copy(OP_COPY_NEW, found->second, length);
+            }
+            else
+            {
+                encode_against(writer, oldImage, oldSize, target, offset, length);
+            }
+
+            newBlocks.insert(std::make_pair(hash, offset));
+        }
+        else
+        {
+            encode_against(writer, oldImage, oldSize, target, offset, length);
+        }
+
+        offset += length;
+    }
+
+    writer.end();
+}
+
+// Apply a patch to the old logical image. Returns NULL on success, otherwise a description of the problem.
+static inline const char* apply_patch(const uint8_t* oldImage, const uint32_t oldSize, const uint8_t* patch, const size_t patchSize,
+                                      std::vector<uint8_t>& newImage)
+{
+    if(patchSize < PATCH_HEADER_SIZE || memcmp(patch, PATCH_MAGIC, sizeof(PATCH_MAGIC)) != 0)
+    {
+        return "Not a ROM patch.";
+    }
+
+    if(patch[4] != PATCH_VERSION)
+    {
+        return "Unsupported patch version.";
+    }
+
+    if(get_u32(patch + 5) != oldSize)
+    {
+        return "Patch is for a different image.";
+    }
+
+    uint8_t digest[SHA1_SIZE];
+    Sha1 sha;
+    sha.update(oldImage, oldSize);
+    sha.final(digest);
+
+    if(memcmp(digest, patch + 13, SHA1_SIZE) != 0)
+    {
+        return "Patch is for a different image.";
+    }
+
+    const uint32_t newSize = get_u32(patch + 9);
+    if(newSize > MAX_DECODED_SIZE)
+    {
+        return "Corrupt patch.";
+    }
+
+    newImage.resize(newSize);
+
+    const uint8_t* p = patch + PATCH_HEADER_SIZE;
+    const uint8_t* end = patch + patchSize;
+    uint32_t written = 0;
+
+    while(p < end && *p != OP_END)
+    {
+        const uint8_t op = *p++;
+
+        if(op == OP_COPY_OLD || op == OP_COPY_NEW)
+        {
+            if(end - p < 6)
+            {
+                return "Truncated patch.";
+            }
+
+            const uint32_t source = get_u32(p);
+            const uint32_t length = get_u16(p + 4);
+            p += 6;
+
+            if(length > newSize - written ||
+               (op == OP_COPY_OLD && (source > oldSize || length > oldSize - source)) ||
+               (op == OP_COPY_NEW && (source > written || length > written - source)))
+            {
+                return "Patch copies outside of an image.";
+            }
+
+            memcpy(newImage.data() + written, (op == OP_COPY_OLD ? oldImage : newImage.data()) + source, length);
+            written += length;
+        }
+        else if(op == OP_FILL)
+        {
+            if(end - p < 3)
+            {
+                return "Truncated patch.";
+            }
+
+            const uint32_t length = get_u16(p);
+            if(length > newSize - written)
+            {
+                return "Patch writes outside of the image.";
+            }
+
+            memset(newImage.data() + written, p[2], length);
+            p += 3;
+            written += length;
+        }
+        else if(op == OP_LITERAL)
+        {
+            if(end - p < 2 || (size_t)(end - p - 2) < get_u16(p))
+            {
+                return "Truncated patch.";
+            }
+
+            const uint32_t length = get_u16(p);
+            if(length > newSize - written)
+            {
+                return "Patch writes outside of the image.";
+            }
+
+            memcpy(newImage.data() + written, p + 2, length);
+            p += 2 + length;
+            written += length;
+        }
+        else
+        {
+            return "Invalid patch operation.";
+        }
+    }
+
+    if(p == end || written != newSize)
+    {
+        return "Truncated patch.";
+    }
+
+    sha.reset();
+    sha.update(newImage.data(), newSize);
+    sha.final(digest);
+
+    if(memcmp(digest, patch + 13 + SHA1_SIZE, SHA1_SIZE) != 0)
+    {
+        return "Patched image does not match.";
+    }
+
+    return NULL;
+}
+
+#endif // ROMDELTA_H
@@ -0,0 +1,443 @@
+/*
+romdiff - Andy Anderson 2020
+
+Compare two ROM capsule images, or make a patch that turns one into the other (see rompatch).
+
+The comparison is structural: changed header fields, files added or removed, changed
+directory entries and changed blocks reported against the file (and block of the file) they
+belong to. Identical images and identical blocks are passed over with a vectorised compare,
+so checking many pairs (-b) is cheap. The exit status is 0 when the images are the same and
+1 when they differ, as for diff. A pair that cannot be read is reported and the rest of a batch
+is still compared, but the exit status is then -1.
+
+A patch only sends what changed: unchanged, moved and duplicated 1K blocks become references,
+and changed blocks are encoded against the old block. See romdelta.h for the format.
+
+To compile on linux;
+
+    g++ -O2 romdiff.cpp -o romdiff
+
+Usage;
+
+    romdiff <old romfile> <new romfile>
+    romdiff -b <listfile>
+    romdiff <old romfile> <new romfile> <patchfile>
+
+A listfile compares one "<old romfile> <new romfile>" pair per line.
+
+*/
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "epsonrom.h"
+#include "romdelta.h"
+
+struct HeaderField
+{
+    const char* name;
+    size_t offset;
+    size_t size;
+    bool text;
+};
+
+static const HeaderField header_fields[] =
+{
+    { "id", offsetof(RomHeader, id), sizeof(RomHeader::id), false },
+    { "capacity", offsetof(RomHeader, capacity), sizeof(RomHeader::capacity), false },
+    { "checksum", offsetof(RomHeader, checksum), sizeof(RomHeader::checksum), false },
+    { "system_name", offsetof(RomHeader, system_name), sizeof(RomHeader::system_name), true },
+    { "rom_name", offsetof(RomHeader, rom_name), sizeof(RomHeader::rom_name), true },
+    { "dir_entries", offsetof(RomHeader, dir_entries), sizeof(RomHeader::dir_entries), false },
+    { "v", offsetof(RomHeader, v), sizeof(RomHeader::v), true },
+    { "version", offsetof(RomHeader, version), sizeof(RomHeader::version), true },
+    { "month", offsetof(RomHeader, month), sizeof(RomHeader::month), true },
+    { "day", offsetof(RomHeader, day), sizeof(RomHeader::day), true },
+    { "year", offsetof(RomHeader, year), sizeof(RomHeader::year), true },
+};
+
+// A file as the directory walk reconstructs it; the data of each block stays in the image.
+struct FileMap
+{
+    std::string name;
+    uint32_t size;
+    std::vector<uint32_t> chunkOffsets;
+    std::vector<uint32_t> chunkLengths;
+};
+
+struct FileMapSink
+{
+    const uint8_t* image;
+    std::vector<FileMap> files;
+
+    void open(const char* fileName)
+    {
+        files.push_back(FileMap());
+        files.back().name = fileName;
+        files.back().size = 0;
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        files.back().chunkOffsets.push_back((uint32_t)(data - image));
+        files.back().chunkLengths.push_back(size);
+        files.back().size += size;
+    }
+
+    void close()
+    {
+    }
+};
+
+static const FileMap* find_file(const std::vector<FileMap>& files, const std::string& name)
+{
+    for(size_t i=0; i<files.size(); ++i)
+    {
+        if(files[i].name == name)
+        {
+            return &files[i];
+        }
+    }
+
+    return NULL;
+}
+
+static std::string field_text(const uint8_t* field, const HeaderField& info)
+{
+    std::string text;
+    char hex[4];
+
+    if(info.text)
+    {
+        text = "\"";
+        for(size_t i=0; i<info.size; ++i)
+        {
+            text += (field[i] >= 0x20 && field[i] < 0x7f) ? (char)field[i] : '?';
+        }
+        return text + "\"";
+    }
+
+    for(size_t i=0; i<info.size; ++i)
+    {
+        snprintf(hex, sizeof(hex), "%02x", field[i]);
+        text += hex;
+    }
+
+    return text;
+}
+
+static std::string block_list(const std::vector<uint32_t>& blocks)
+{
+    std::ostringstream text;
+
+    for(size_t i=0; i<blocks.size(); ++i)
+    {
+        text << (i ? ", " : "") << blocks[i];
+    }
+
+    return text.str();
+}
+
+// The directory entries of a file, for comparing layout rather than content.
+static std::string file_entries(const uint8_t* image, const std::string& name)
+{
+    const RomHeader* header = (const RomHeader*)image;
+    std::string entries;
+    char fileName[8 + 1 + 3 + 1];
+
+    for(uint8_t dirNo=1; dirNo<header->dir_entries; ++dirNo)
+    {
+        const DirEntry* dir = dir_entry_offset(header, dirNo);
+        if(dir->validity != DIR_ENTRY_VALID)
+        {
+            continue;
+        }
+
+        size_t nameLength = copy_trimmed(fileName, dir->file_name, sizeof(DirEntry::file_name));
+        fileName[nameLength++] = '.';
+        const size_t typeLength = copy_trimmed(fileName + nameLength, dir->file_type, sizeof(DirEntry::file_type));
+        for(size_t i=0; i<typeLength; ++i)
+        {
+            fileName[nameLength + i] &= 0x7f;
+        }
+        fileName[nameLength + typeLength] = 0;
+
+        if(name == fileName)
+        {
+            entries.append((const char*)&dir->logical_extent, sizeof(DirEntry) - offsetof(DirEntry, logical_extent));
+        }
+    }
+
+    return entries;
+}
+
+// Print the differences between two logical images. Returns true if they differ.
+static bool report(const char* oldName, const std::vector<uint8_t>& oldImage, const char* newName, const std::vector<uint8_t>& newImage)
+{
+    const uint32_t oldSize = (uint32_t)oldImage.size();
+    const uint32_t newSize = (uint32_t)newImage.size();
+
+    // The common case in a large comparison
+    if(oldSize == newSize && first_difference(oldImage.data(), newImage.data(), oldSize) == oldSize)
+    {
+        return false;
+    }
+
+    std::cout << "--- " << oldName << "\n+++ " << newName << "\n";
+
+    if(oldSize != newSize)
+    {
+        std::cout << "size " << oldSize << " -> " << newSize << "\n";
+    }
+
+    const char* oldInvalid = verify_rom(oldImage.data(), oldSize);
+    const char* newInvalid = verify_rom(newImage.data(), newSize);
+
+    if(oldInvalid || newInvalid)
+    {
+        // No structure to compare
+        if(oldInvalid)
+        {
+            std::cout << oldName << ": " << oldInvalid << "\n";
+        }
+        if(newInvalid)
+        {
+            std::cout << newName << ": " << newInvalid << "\n";
+        }
+
+        const uint32_t common = std::min(oldSize, newSize);
+        const uint32_t at = first_difference(oldImage.data(), newImage.data(), common);
+        if(at < common)
+        {
+            std::cout << "first difference at offset " << at << "\n";
+        }
+        std::cout << std::flush;
+        return true;
+    }
+
+    for(size_t i=0; i<sizeof(header_fields)/sizeof(header_fields[0]); ++i)
+    {
+        const HeaderField& field = header_fields[i];
+        const uint8_t* oldField = oldImage.data() + field.offset;
+        const uint8_t* newField = newImage.data() + field.offset;
+
+        if(memcmp(oldField, newField, field.size) != 0)
+        {
+            std::cout << "header " << field.name << ": " << field_text(oldField, field) << " -> " << field_text(newField, field) << "\n";
+        }
+    }
+
+    FileMapSink oldFiles;
+    FileMapSink newFiles;
+    oldFiles.image = oldImage.data();
+    newFiles.image = newImage.data();
+    walk_files(oldImage.data(), oldSize, oldFiles);
+    walk_files(newImage.data(), newSize, newFiles);
+
+    const uint32_t newFileArea = ((const RomHeader*)newImage.data())->dir_entries * sizeof(DirEntry);
+
+    for(size_t i=0; i<oldFiles.files.size(); ++i)
+    {
+        if(!find_file(newFiles.files, oldFiles.files[i].name))
+        {
+            std::cout << "removed " << oldFiles.files[i].name << " (" << oldFiles.files[i].size << " bytes)\n";
+        }
+    }
+
+    for(size_t i=0; i<newFiles.files.size(); ++i)
+    {
+        const FileMap& file = newFiles.files[i];
+        const FileMap* previous = find_file(oldFiles.files, file.name);
+
+        if(!previous)
+        {
+            std::cout << "added " << file.name << " (" << file.size << " bytes)\n";
+            continue;
+        }
+
+        // Blocks of the file (counting from 0) that changed, and the ROM block IDs they are now in
+        std::vector<uint32_t> changed;
+        std::vector<uint32_t> changedIds;
+
+        for(size_t c=0; c<file.chunkOffsets.size(); ++c)
+        {
+            const uint32_t length = file.chunkLengths[c];
+            const bool same = c < previous->chunkOffsets.size() && previous->chunkLengths[c] == length &&
+                              first_difference(oldImage.data() + previous->chunkOffsets[c], newImage.data() + file.chunkOffsets[c], length) == length;
+
+            if(!same)
+            {
+                changed.push_back((uint32_t)c);
+                changedIds.push_back((file.chunkOffsets[c] - newFileArea) / BLOCK_SIZE + 1);
+            }
+        }
+
+        if(file.size != previous->size)
+        {
+            std::cout << "changed " << file.name << ": size " << previous->size << " -> " << file.size << "\n";
+        }
+
+        if(!changed.empty())
+        {
+            std::cout << "changed " << file.name << ": file blocks " << block_list(changed) << " (ROM blocks " << block_list(changedIds) << ")\n";
+        }
+        else if(file.size == previous->size && file_entries(oldImage.data(), file.name) != file_entries(newImage.data(), file.name))
+        {
+            std::cout << "moved " << file.name << ": directory entries changed, data unchanged\n";
+        }
+    }
+
+    std::cout << std::flush;
+    return true;
+}
+
+// Read both images. Returns false, having reported why, if either cannot be read.
+static bool read_pair(const char* oldName, std::vector<uint8_t>& oldImage, const char* newName, std::vector<uint8_t>& newImage)
+{
+    const char* error = read_image(oldName, oldImage);
+    if(error)
+    {
+        report_error(error, oldName);
+        return false;
+    }
+
+    error = read_image(newName, newImage);
+    if(error)
+    {
+        report_error(error, newName);
+        return false;
+    }
+
+    return true;
+}
+
+// Sets differ if the images differ. Returns false, having reported why, if they cannot be compared.
+static bool compare_files(const char* oldName, const char* newName, bool& differ)
+{
+    std::vector<uint8_t> oldImage;
+    std::vector<uint8_t> newImage;
+
+    if(!read_pair(oldName, oldImage, newName, newImage))
+    {
+        return false;
+    }
+
+    differ = report(oldName, oldImage, newName, newImage);
+    return true;
+}
+
+// Pairs that cannot be read are reported and counted in failed; the rest are still compared.
+static bool compare_batch(const char* listName, uint32_t& failed)
+{
+    std::ifstream listFile(listName);
+    if(!listFile)
+    {
+        fatal("failed to open input file.", listName);
+    }
+
+    bool differ = false;
+    std::string line;
+
+    while(std::getline(listFile, line))
+    {
+        std::istringstream fields(line);
+        std::string oldName, newName, extra;
+
+        if(!(fields >> oldName) || oldName[0] == '#')
+        {
+            continue;
+        }
+
+        if(!(fields >> newName) || (fields >> extra))
+        {
+            fatal("List lines must be <old romfile> <new romfile>.", line.c_str());
+        }
+
+        bool pairDiffers = false;
+        if(!compare_files(oldName.c_str(), newName.c_str(), pairDiffers))
+        {
+            ++failed;
+        }
+        differ |= pairDiffers;
+    }
+
+    return differ;
+}
+
+static void make_patch_file(const char* oldName, const char* newName, const char* patchName)
+{
+    std::vector<uint8_t> oldImage;
+    std::vector<uint8_t> newImage;
+
+    if(!read_pair(oldName, oldImage, newName, newImage))
+    {
+        exit(-1);
+    }
+
+    fail_if_exists(patchName);
+
+    std::vector<uint8_t> patch;
+    make_patch(oldImage.data(), (uint32_t)oldImage.size(), newImage.data(), (uint32_t)newImage.size(), patch);
+
+    std::ofstream outFile(patchName, std::ios::out | std::ios::binary);
+    outFile.write((const char*)patch.data(), patch.size());
+
+    if(!outFile.good())
+    {
+        fatal("Failed to write to ouput file.", patchName);
+    }
+
+    std::cout << "Patch " << patch.size() << " bytes for a " << newImage.size() << " byte image." << std::endl;
+}
+
+static void usage()
+{
+    std::cout << "Usage: romdiff <old romfile> <new romfile>\n"
+                 "       romdiff -b <listfile>\n"
+                 "       romdiff <old romfile> <new romfile> <patchfile>\n" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc == 3 && strcmp(argv[1], "-b") == 0)
+    {
+        uint32_t failed = 0;
+        const bool differ = compare_batch(argv[2], failed);
+
+        if(failed)
+        {
+            std::cerr << failed << " pairs could not be compared." << std::endl;
+            return -1;
+        }
+
+        return differ ? 1 : 0;
+    }
+
+    if(argc == 3)
+    {
+        bool differ = false;
+        if(!compare_files(argv[1], argv[2], differ))
+        {
+            return -1;
+        }
+
+        return differ ? 1 : 0;
+    }
+
+    if(argc == 4)
+    {
+        make_patch_file(argv[1], argv[2], argv[3]);
+        return 0;
+    }
+
+    usage();
+    exit(-1);
+}
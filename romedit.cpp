@@ -0,0 +1,189 @@
+/*
+romedit - Andy Anderson 2020
+
+Add, replace or delete files in an existing ROM capsule image, in place, or compact it.
+
+The image file is changed directly: only the bytes of the directory, header and blocks that
+the edit changes are written back, at their physical addresses. See romedit.h.
+
+Only binary images can be edited (dumps in Intel HEX or S-records are converted with dumprom
+and makerom). The layout of the image (capacity, swapped halves) is detected as when reading.
+
+To compile on linux;
+
+    g++ -O2 romedit.cpp -o romedit
+
+Usage;
+
+    romedit <romfile> add <file> [file...]
+    romedit <romfile> replace <file> [file...]
+    romedit <romfile> delete <file> [file...]
+    romedit <romfile> compact
+
+compact moves the files into consecutive blocks in directory order, leaving the free space at
+the end, and reports the smallest part the image would now fit.
+
+As for makerom, files must be in the current directory.
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include "epsonrom.h"
+#include "romedit.h"
+
+static void usage()
+{
+    std::cout << "Usage: romedit <romfile> add <file> [file...]\n"
+                 "       romedit <romfile> replace <file> [file...]\n"
+                 "       romedit <romfile> delete <file> [file...]\n"
+                 "       romedit <romfile> compact\n" << std::endl;
+}
+
+static std::vector<uint8_t> read_whole_file(const char* fileName)
+{
+    std::ifstream inFile(fileName, std::ios::in | std::ios::binary);
+    if(!inFile)
+    {
+        fatal("failed to open input file.", fileName);
+    }
+
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 3)
+    {
+        usage();
+        exit(-1);
+    }
+
+    const char* romName = argv[1];
+    const char* command = argv[2];
+    const bool compact = strcmp(command, "compact") == 0;
+
+    if(compact ? argc != 3 : (argc < 4 || (strcmp(command, "add") != 0 && strcmp(command, "replace") != 0 && strcmp(command, "delete") != 0)))
+    {
+        usage();
+        exit(-1);
+    }
+
+    const std::vector<uint8_t> dump = read_whole_file(romName);
+
+    if(detect_format(dump.data(), dump.size()) != FORMAT_BINARY)
+    {
+        fatal("Only binary images can be edited in place.", romName);
+    }
+
+    RomLayout layout;
+    if(!detect_layout(dump.data(), (uint32_t)dump.size(), layout))
+    {
+        fatal("Not a valid rom file.", romName);
+    }
+
+    std::vector<uint8_t> image(dump.begin(), dump.begin() + layout.size);
+    if(layout.swapped)
+    {
+        swap_halves(image.data(), (uint32_t)image.size());
+    }
+
+    const char* invalid = verify_rom(image.data(), (uint32_t)image.size());
+    if(invalid)
+    {
+        fatal(invalid, romName);
+    }
+
+    RomEditor editor(image.data(), (uint32_t)image.size());
+
+    for(int i=3; i<argc; ++i)
+    {
+        const char* error;
+
+        if(strcmp(command, "delete") == 0)
+        {
+            error = editor.remove(argv[i]);
+        }
+        else
+        {
+            const std::vector<uint8_t> data = read_whole_file(argv[i]);
+
+            RomInput input;
+            input.name = argv[i];
+            input.data = data.data();
+            input.size = data.size();
+
+            error = (strcmp(command, "add") == 0) ? editor.add(input) : editor.replace(input);
+        }
+
+        if(error)
+        {
+            fatal(error, argv[i]);
+        }
+    }
+
+    if(compact)
+    {
+        const uint32_t moved = editor.compact();
+        const uint32_t used = editor.used_blocks();
+        const uint32_t needed = required_size(editor.used_entries(), used);
+        const uint8_t capacity = smallest_capacity(needed);
+
+        std::cout << "Moved " << moved << " blocks. " << used << " of " << editor.block_count() << " blocks used, "
+                  << (editor.block_count() - used) * BLOCK_SIZE << " bytes free at the end." << std::endl;
+        std::cout << "Files need " << needed << " bytes";
+        if(capacity)
+        {
+            std::cout << ", which fits a " << (unsigned)capacity * 8 << "kbit (" << (unsigned)capacity << "K) part";
+        }
+        std::cout << "." << std::endl;
+    }
+
+    // Write back only what changed, at its physical address
+    const std::vector<EditRange>& changes = editor.changes();
+
+    std::fstream romFile(romName, std::ios::in | std::ios::out | std::ios::binary);
+    if(!romFile)
+    {
+        fatal("Failed to open output file for writing.", romName);
+    }
+
+    uint32_t bytesWritten = 0;
+    uint32_t writes = 0;
+
+    for(size_t c=0; c<changes.size(); ++c)
+    {
+        uint32_t offset = changes[c].offset;
+        const uint32_t end = offset + changes[c].length;
+
+        while(offset < end)
+        {
+            // A range in a swapped image is split where the halves meet
+            const uint32_t halfEnd = (offset < 0x4000) ? 0x4000 : 0x8000;
+            const uint32_t length = (layout.swapped && end > halfEnd) ? halfEnd - offset : end - offset;
+            const uint32_t physical = layout.swapped ? (offset ^ 0x4000) : offset;
+
+            romFile.seekp(physical);
+            romFile.write((const char*)image.data() + offset, length);
+
+            offset += length;
+            bytesWritten += length;
+            ++writes;
+        }
+    }
+
+    if(!romFile.good())
+    {
+        fatal("Failed to write to ouput file.", romName);
+    }
+
+    std::cout << bytesWritten << " bytes written in " << writes << " ranges." << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,598 @@
+/*
+romedit.h - Andy Anderson 2020
+
+Add, replace and delete files in an existing ROM capsule image without rebuilding it (romedit).
+
+RomEditor works on a logical image in place. Blocks are allocated from a bitset of the blocks
+the directory uses: a new file takes the lowest free blocks, a replaced file reuses its own
+blocks first (in P format a program takes one contiguous run). Deleting a file only marks its
+directory entries invalid and frees its blocks; the data is left where it is.
+
+compact() moves the files back into consecutive blocks from block 1, leaving the free space at
+the end, e.g. to see whether the files would now fit a smaller part.
+
+Only bytes that actually change are written, and each change is recorded, so the caller can
+write back just those ranges of the image file. An edit costs in proportion to the changed
+file, not to the image.
+
+*/
+
+#ifndef ROMEDIT_H
+#define ROMEDIT_H
+
+#include <cstdint>
+#include <cstring>
+#include <bitset>
+#include <vector>
+#include <algorithm>
+
+#include "epsonrom.h"
+
+// A changed range of the logical image.
+struct EditRange
+{
+    uint32_t offset;
+    uint32_t length;
+
+    bool operator<(const EditRange& other) const
+    {
+        return offset < other.offset;
+    }
+};
+
+class RomEditor
+{
+public:
+    // image is a logical image that passes verify_rom().
+    RomEditor(uint8_t* image, const uint32_t size) : m_image(image), m_size(size)
+    {
+        const RomHeader* header = (const RomHeader*)m_image;
+        m_dirEntries = header->dir_entries;
+        m_fileArea = m_image + m_dirEntries * sizeof(DirEntry);
+
+        const uint32_t blocks = (m_size - m_dirEntries * sizeof(DirEntry)) / BLOCK_SIZE;
+        m_blockCount = (blocks > 255) ? 255 : blocks;
+
+        for(uint8_t dirNo=1; dirNo<m_dirEntries; ++dirNo)
+        {
+            const DirEntry* dir = entry(dirNo);
+            for(uint8_t i=0; dir->validity == DIR_ENTRY_VALID && i<16; ++i)
+            {
+                if(dir->allocation_map[i])
+                {
+                    m_used.set(dir->allocation_map[i]);
+                }
+            }
+        }
+    }
+
+    // Each returns NULL on success, otherwise a description of the problem.
+    const char* add(const RomInput& input)
+    {
+        uint8_t name[8];
+        uint8_t type[3];
+        if(!split_file_name(input.name, name, type))
+        {
+            return ERROR_NOT_8_3;
+        }
+
+        uint8_t first, count;
+        if(find_file(name, type, first, count))
+        {
+            return "File already exists.";
+        }
+
+        Snapshot snapshot;
+        save(snapshot);
+
+        const char* error = store(input, name, type, NULL, 0, 0);
+        if(error)
+        {
+            restore(snapshot);
+        }
+
+        return error;
+    }
+
+    const char* replace(const RomInput& input)
+    {
+        uint8_t name[8];
+        uint8_t type[3];
+        if(!split_file_name(input.name, name, type))
+        {
+            return ERROR_NOT_8_3;
+        }
+
+        uint8_t first, count;
+        if(!find_file(name, type, first, count))
+        {
+            return "File not found.";
+        }
+
+        uint8_t previous[MAX_DIR_ENTRIES * 16];
+        const uint32_t previousCount = file_blocks(first, count, previous);
+
+        // The old file's entries and blocks are free to the new one, and reused in place when they
+        // fit. If it does not fit at all, the old file is put back.
+        Snapshot snapshot;
+        save(snapshot);
+        erase(first, count);
+
+        const char* error = store(input, name, type, previous, previousCount, first);
+        if(error)
+        {
+            restore(snapshot);
+        }
+
+        return error;
+    }
+
+    const char* remove(const char* fileName)
+    {
+        uint8_t name[8];
+        uint8_t type[3];
+        if(!split_file_name(fileName, name, type))
+        {
+            return ERROR_NOT_8_3;
+        }
+
+        uint8_t first, count;
+        if(!find_file(name, type, first, count))
+        {
+            return "File not found.";
+        }
+
+        erase(first, count);
+        update_checksum();
+
+        return NULL;
+    }
+
+    // Renumber the blocks so that the files occupy consecutive blocks in directory order from block 1,
+    // with the free blocks (erased to 0xff) at the end. The directory is packed the same way.
+    // Returns the number of blocks moved.
+    uint32_t compact()
+    {
+        pack_directory();
+
+        const std::vector<uint8_t> fileArea(m_fileArea, m_fileArea + m_blockCount * BLOCK_SIZE);
+        uint32_t next = 1;
+        uint32_t moved = 0;
+
+        for(uint8_t dirNo=1; dirNo<m_dirEntries; ++dirNo)
+        {
+            DirEntry dir = *entry(dirNo);
+            if(dir.validity != DIR_ENTRY_VALID)
+            {
+                continue;
+            }
+
+            for(uint8_t i=0; i<16; ++i)
+            {
+                if(dir.allocation_map[i] == 0)
+                {
+                    continue;
+                }
+
+                if(dir.allocation_map[i] != next)
+                {
+                    write_bytes(block_address(m_fileArea, (uint8_t)next), &fileArea[(dir.allocation_map[i] - 1) * BLOCK_SIZE], BLOCK_SIZE);
+                    dir.allocation_map[i] = (uint8_t)next;
+                    ++moved;
+                }
+                ++next;
+            }
+
+            write_bytes((uint8_t*)entry(dirNo), &dir, sizeof(dir));
+        }
+
+        m_used.reset();
+        uint8_t erased[BLOCK_SIZE];
+        memset(erased, 0xff, sizeof(erased));
+
+        for(uint32_t blockNo=1; blockNo<=m_blockCount; ++blockNo)
+        {
+            if(blockNo < next)
+            {
+                m_used.set(blockNo);
+            }
+            else
+            {
+                write_bytes(block_address(m_fileArea, (uint8_t)blockNo), erased, BLOCK_SIZE);
+            }
+        }
+
+        update_checksum();
+
+        return moved;
+    }
+
+    uint32_t block_count() const
+    {
+        return m_blockCount;
+    }
+
+    uint32_t used_blocks() const
+    {
+        return (uint32_t)m_used.count();
+    }
+
+    // Valid directory entries, including the header entry.
+    uint32_t used_entries()
+    {
+        uint32_t entries = 1;
+        for(uint8_t dirNo=1; dirNo<m_dirEntries; ++dirNo)
+        {
+            entries += entry(dirNo)->validity == DIR_ENTRY_VALID;
+        }
+
+        return entries;
+    }
+
+    // The ranges of the logical image changed so far, in address order with neighbours merged.
+    const std::vector<EditRange>& changes()
+    {
+        std::sort(m_changes.begin(), m_changes.end());
+
+        size_t merged = 0;
+        for(size_t i=0; i<m_changes.size(); ++i)
+        {
+            if(merged && m_changes[merged - 1].offset + m_changes[merged - 1].length >= m_changes[i].offset)
+            {
+                const uint32_t end = std::max(m_changes[merged - 1].offset + m_changes[merged - 1].length, m_changes[i].offset + m_changes[i].length);
+                m_changes[merged - 1].length = end - m_changes[merged - 1].offset;
+            }
+            else
+            {
+                m_changes[merged++] = m_changes[i];
+            }
+        }
+        m_changes.resize(merged);
+
+        return m_changes;
+    }
+
+private:
+    // The directory and block map before an edit. store() writes no blocks until it has room for
+    // the whole file, so putting these back undoes an edit that failed.
+    struct Snapshot
+    {
+        uint8_t directory[MAX_DIR_ENTRIES * sizeof(DirEntry)];
+        std::bitset<256> used;
+        size_t changes;
+    };
+
+    void save(Snapshot& snapshot) const
+    {
+        memcpy(snapshot.directory, m_image, m_dirEntries * sizeof(DirEntry));
+        snapshot.used = m_used;
+        snapshot.changes = m_changes.size();
+    }
+
+    void restore(const Snapshot& snapshot)
+    {
+        memcpy(m_image, snapshot.directory, m_dirEntries * sizeof(DirEntry));
+        m_used = snapshot.used;
+        m_changes.resize(snapshot.changes);
+    }
+
+    DirEntry* entry(const uint8_t dirNo)
+    {
+        return (DirEntry*)(m_image + dirNo * sizeof(DirEntry));
+    }
+
+    // Copy into the image, recording only the bytes that differ.
+    void write_bytes(uint8_t* dest, const void* source, const uint32_t length)
+    {
+        const uint8_t* src = (const uint8_t*)source;
+        uint32_t i = 0;
+
+        while(i < length)
+        {
+            if(dest[i] == src[i])
+            {
+                ++i;
+                continue;
+            }
+
+            const uint32_t start = i;
+            while(i < length && dest[i] != src[i])
+            {
+                ++i;
+            }
+
+            memcpy(dest + start, src + start, i - start);
+
+            EditRange range;
+            range.offset = (uint32_t)(dest + start - m_image);
+            range.length = i - start;
+            m_changes.push_back(range);
+        }
+    }
+
+    // A file is its extent 0 entry and the continuation entries that follow it, as walk_files() reads them.
+    bool find_file(const uint8_t name[8], const uint8_t type[3], uint8_t& first, uint8_t& count)
+    {
+        for(uint8_t dirNo=1; dirNo<m_dirEntries; ++dirNo)
+        {
+            const DirEntry* dir = entry(dirNo);
+            if(dir->validity != DIR_ENTRY_VALID || dir->logical_extent != 0 || memcmp(dir->file_name, name, 8) != 0)
+            {
+                continue;
+            }
+
+            bool sameType = true;
+            for(int i=0; i<3; ++i)
+            {
+                sameType &= (dir->file_type[i] & 0x7f) == type[i];
+            }
+
+            if(!sameType)
+            {
+                continue;
+            }
+
+            first = dirNo;
+            count = 1;
+            for(uint8_t next=dirNo+1; next<m_dirEntries; ++next)
+            {
+                const DirEntry* continuation = entry(next);
+                if(continuation->validity == DIR_ENTRY_VALID)
+                {
+                    if(continuation->logical_extent == 0)
+                    {
+                        break;
+                    }
+                    count = next - first + 1;
+                }
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    uint32_t file_blocks(const uint8_t first, const uint8_t count, uint8_t* blocks)
+    {
+        uint32_t blockCount = 0;
+
+        for(uint8_t dirNo=first; dirNo<first+count; ++dirNo)
+        {
+            const DirEntry* dir = entry(dirNo);
+            for(uint8_t i=0; dir->validity == DIR_ENTRY_VALID && i<16; ++i)
+            {
+                if(dir->allocation_map[i])
+                {
+                    blocks[blockCount++] = dir->allocation_map[i];
+                }
+            }
+        }
+
+        return blockCount;
+    }
+
+    void erase(const uint8_t first, const uint8_t count)
+    {
+        for(uint8_t dirNo=first; dirNo<first+count; ++dirNo)
+        {
+            DirEntry* dir = entry(dirNo);
+            if(dir->validity != DIR_ENTRY_VALID)
+            {
+                continue;
+            }
+
+            for(uint8_t i=0; i<16; ++i)
+            {
+                m_used.reset(dir->allocation_map[i]);
+            }
+
+            write_bytes(&dir->validity, &DIR_ENTRY_INVALID, 1);
+        }
+    }
+
+    // True if the entries [first, first + count) are free and the file would not take over
+    // continuation entries that follow them.
+    bool slots_free(const uint8_t first, const uint8_t count)
+    {
+        if(first < 1 || first + count > m_dirEntries)
+        {
+            return false;
+        }
+
+        for(uint8_t dirNo=first; dirNo<first+count; ++dirNo)
+        {
+            if(entry(dirNo)->validity == DIR_ENTRY_VALID)
+            {
+                return false;
+            }
+        }
+
+        for(uint8_t next=first+count; next<m_dirEntries; ++next)
+        {
+            const DirEntry* dir = entry(next);
+            if(dir->validity == DIR_ENTRY_VALID)
+            {
+                return dir->logical_extent == 0;
+            }
+        }
+
+        return true;
+    }
+
+    // Move the valid entries to the front of the directory, in order, leaving the free entries at the end.
+    void pack_directory()
+    {
+        uint8_t to = 1;
+
+        for(uint8_t from=1; from<m_dirEntries; ++from)
+        {
+            if(entry(from)->validity == DIR_ENTRY_VALID)
+            {
+                if(from != to)
+                {
+                    const DirEntry moved = *entry(from);
+                    write_bytes((uint8_t*)entry(to), &moved, sizeof(DirEntry));
+                }
+                ++to;
+            }
+        }
+
+        for(; to<m_dirEntries; ++to)
+        {
+            write_bytes(&entry(to)->validity, &DIR_ENTRY_INVALID, 1);
+        }
+    }
+
+    uint8_t find_slots(const uint8_t count, const uint8_t preferred)
+    {
+        if(slots_free(preferred, count))
+        {
+            return preferred;
+        }
+
+        for(int pass=0; pass<2; ++pass)
+        {
+            for(uint8_t first=1; first+count<=m_dirEntries; ++first)
+            {
+                if(slots_free(first, count))
+                {
+                    return first;
+                }
+            }
+
+            if(pass == 0)
+            {
+                // The free entries are scattered - gather them at the end
+                pack_directory();
+            }
+        }
+
+        return 0;
+    }
+
+    const char* store(const RomInput& input, const uint8_t name[8], const uint8_t type[3],
+                      const uint8_t* preferred, const uint32_t preferredCount, const uint8_t preferredSlot)
+    {
+        const uint32_t chunks = (uint32_t)((input.size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        const uint32_t extents = file_extents(input.size);
+
+        const uint8_t first = (extents < m_dirEntries) ? find_slots((uint8_t)extents, preferredSlot) : 0;
+        if(first == 0)
+        {
+            return "Out of directory space.";
+        }
+
+        // Choose every block before writing any, so a failed edit leaves the data area alone (the
+        // caller puts back any directory entries it erased or pack_directory() moved)
+        uint8_t blocks[MAX_DIR_ENTRIES * 16];
+        const RomHeader* header = (const RomHeader*)m_image;
+
+        if(header->id[1] == MAGIC_P && is_executable(type) && chunks)
+        {
+            const uint32_t start = free_run(m_used, m_blockCount, preferredCount ? preferred[0] : 1, chunks);
+            if(start == 0)
+            {
+                return "Out of contiguous ROM space.";
+            }
+
+            for(uint32_t i=0; i<chunks; ++i)
+            {
+                blocks[i] = (uint8_t)(start + i);
+            }
+        }
+        else
+        {
+            std::bitset<256> taken = m_used;
+            uint32_t reuse = 0;
+            uint32_t nextFree = 1;
+
+            for(uint32_t i=0; i<chunks; ++i)
+            {
+                uint32_t blockNo = 0;
+
+                while(blockNo == 0 && reuse < preferredCount)
+                {
+                    const uint8_t candidate = preferred[reuse++];
+                    blockNo = (!taken[candidate] && candidate <= m_blockCount) ? candidate : 0;
+                }
+
+                while(blockNo == 0 && nextFree <= m_blockCount)
+                {
+                    blockNo = taken[nextFree] ? 0 : nextFree;
+                    ++nextFree;
+                }
+
+                if(blockNo == 0)
+                {
+                    return "Out of ROM space.";
+                }
+
+                taken.set(blockNo);
+                blocks[i] = (uint8_t)blockNo;
+            }
+        }
+
+        // The rest of the last block is zero padded
+        uint8_t block[BLOCK_SIZE];
+        for(uint32_t i=0; i<chunks; ++i)
+        {
+            const size_t offset = (size_t)i * BLOCK_SIZE;
+            const size_t dataSize = (input.size - offset < BLOCK_SIZE) ? input.size - offset : BLOCK_SIZE;
+            memcpy(block, input.data + offset, dataSize);
+            memset(block + dataSize, 0, BLOCK_SIZE - dataSize);
+
+            write_bytes(block_address(m_fileArea, blocks[i]), block, BLOCK_SIZE);
+            m_used.set(blocks[i]);
+        }
+
+        uint32_t recordsRemaining = (uint32_t)((input.size + RECORD_SIZE - 1) / RECORD_SIZE);
+        for(uint32_t extent=0; extent<extents; ++extent)
+        {
+            DirEntry dir;
+            memset(&dir, 0, sizeof(dir));
+            dir.validity = DIR_ENTRY_VALID;
+            memcpy(dir.file_name, name, 8);
+            memcpy(dir.file_type, type, 3);
+            dir.logical_extent = (uint8_t)extent;
+
+            for(uint32_t i=0; i<16 && extent * 16 + i < chunks; ++i)
+            {
+                const uint32_t records = (recordsRemaining < BLOCK_SIZE / RECORD_SIZE) ? recordsRemaining : BLOCK_SIZE / RECORD_SIZE;
+                dir.allocation_map[i] = blocks[extent * 16 + i];
+                dir.record_count += (uint8_t)records;
+                recordsRemaining -= records;
+            }
+
+            write_bytes((uint8_t*)entry((uint8_t)(first + extent)), &dir, sizeof(dir));
+        }
+
+        update_checksum();
+
+        return NULL;
+    }
+
+    // As build_rom(), the end of the used blocks
+    void update_checksum()
+    {
+        uint32_t highest = 0;
+        for(uint32_t blockNo=1; blockNo<=m_blockCount; ++blockNo)
+        {
+            highest = m_used[blockNo] ? blockNo : highest;
+        }
+
+        const uint16_t checksum = (uint16_t)(highest * BLOCK_SIZE);
+        const uint8_t bytes[2] = { (uint8_t)(checksum & 0xff), (uint8_t)(checksum >> 8) };
+        write_bytes(((RomHeader*)m_image)->checksum, bytes, 2);
+    }
+
+    uint8_t* m_image;
+    uint32_t m_size;
+    uint8_t m_dirEntries;
+    uint8_t* m_fileArea;
+    uint32_t m_blockCount;
+    std::bitset<256> m_used;
+    std::vector<EditRange> m_changes;
+};
+
+#endif // ROMEDIT_H
@@ -0,0 +1,409 @@
+/*
+romfp - Andy Anderson 2020
+
+Identify ROM capsule dumps against a database of known images and files.
+
+Each image is hashed (SHA-1) as a whole, as a plain binary dump of the part would hold it: after
+load_image() has decoded HEX or S-records and removed any base offset or over-dump, and in
+physical address order. A HEX file, an offset dump or a 64K over-dump so hashes the same as the
+binary dump of the same image. Each file in it is hashed as the directory walk reconstructs it
+(i.e. as dumprom would extract it, padded to whole records).
+The database is a single file that is mapped into memory as is: the records are sorted by hash
+and indexed by the first 16 bits of the hash, so a lookup only scans the few records sharing
+that prefix however large the database grows.
+
+To compile on linux;
+
+    g++ -O2 romfp.cpp -o romfp
+
+Usage;
+
+    romfp build <database> <romfile> [romfile...]
+    romfp lookup <database> <romfile> [romfile...]
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "epsonrom.h"
+#include "romhash.h"
+#include "rommap.h"
+
+const char FP_MAGIC[8] = { 'R', 'O', 'M', 'F', 'P', '0', '1', 0 };
+const uint32_t FP_BUCKETS = 0x10000; // indexed by the first two bytes of the hash
+
+const uint8_t FP_KIND_IMAGE = 0;
+const uint8_t FP_KIND_FILE = 1;
+
+PACK_PRE
+struct FpHeader
+{
+    char magic[8];
+    uint32_t recordCount;
+    uint32_t stringsSize;
+    uint32_t buckets[FP_BUCKETS + 1]; // first record of each bucket, plus the end
+} PACK_ATTRIBUTE;
+PACK_POST
+
+PACK_PRE
+struct FpRecord
+{
+    uint8_t hash[SHA1_SIZE];
+    uint32_t name;  // offset in the string table; the file name, or the image name for FP_KIND_IMAGE
+    uint32_t image; // offset in the string table of the image the hash came from
+    uint8_t kind;
+    uint8_t reserved[3];
+} PACK_ATTRIBUTE;
+PACK_POST
+
+static inline uint32_t hash_bucket(const uint8_t* hash)
+{
+    return ((uint32_t)hash[0] << 8) | hash[1];
+}
+
+struct FileHash
+{
+    char name[13];
+    uint8_t hash[SHA1_SIZE];
+};
+
+// Hashes each file reconstructed by walk_files().
+struct HashSink
+{
+    std::vector<FileHash> files;
+    Sha1 sha;
+
+    void open(const char* fileName)
+    {
+        FileHash file;
+        snprintf(file.name, sizeof(file.name), "%s", fileName);
+        files.push_back(file);
+        sha.reset();
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        sha.update(data, size);
+    }
+
+    void close()
+    {
+        sha.final(files.back().hash);
+    }
+};
+
+// Hash an image and its files. Returns false, having reported why, if the image cannot be read.
+// Files are only hashed for images that pass verify_rom(); invalid is set to the reason otherwise.
+static bool hash_image(const char* romFile, uint8_t imageHash[SHA1_SIZE], HashSink& sink, const char*& invalid)
+{
+    std::vector<uint8_t> image;
+    const char* error = read_image(romFile, image);
+    if(error)
+    {
+        report_error(error, romFile);
+        return false;
+    }
+
+    // Hash the image as its binary dump holds it, i.e. back in physical address order (not the
+    // bytes of the file, which may be HEX, offset or over-dumped)
+    Sha1 sha;
+    if(image.size() == 0x8000)
+    {
+        sha.update(image.data() + 0x4000, 0x4000);
+        sha.update(image.data(), 0x4000);
+    }
+    else
+    {
+        sha.update(image.data(), image.size());
+    }
+    sha.final(imageHash);
+
+    sink.files.clear();
+    invalid = verify_rom(image.data(), (uint32_t)image.size());
+    if(invalid == NULL)
+    {
+        walk_files(image.data(), (uint32_t)image.size(), sink);
+    }
+
+    return true;
+}
+
+static bool record_less(const FpRecord& a, const FpRecord& b)
+{
+    return memcmp(a.hash, b.hash, SHA1_SIZE) < 0;
+}
+
+// Images that cannot be read are reported, left out and counted in failed.
+static void build_database(const char* dbName, char** romFiles, const int romCount, uint32_t& failed)
+{
+    fail_if_exists(dbName);
+
+    std::vector<FpRecord> records;
+    std::string strings;
+    HashSink sink;
+
+    for(int i=0; i<romCount; ++i)
+    {
+        uint8_t imageHash[SHA1_SIZE];
+        const char* invalid = NULL;
+
+        if(!hash_image(romFiles[i], imageHash, sink, invalid))
+        {
+            ++failed;
+            continue;
+        }
+
+        if(invalid)
+        {
+            std::cerr << romFiles[i] << ": " << invalid << " Only the image hash is recorded." << std::endl;
+        }
+
+        const uint32_t imageName = (uint32_t)strings.size();
+        strings.append(romFiles[i]);
+        strings.push_back(0);
+
+        FpRecord record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.hash, imageHash, SHA1_SIZE);
+        record.name = imageName;
+        record.image = imageName;
+        record.kind = FP_KIND_IMAGE;
+        records.push_back(record);
+
+        for(size_t f=0; f<sink.files.size(); ++f)
+        {
+            memcpy(record.hash, sink.files[f].hash, SHA1_SIZE);
+            record.name = (uint32_t)strings.size();
+            record.kind = FP_KIND_FILE;
+            strings.append(sink.files[f].name);
+            strings.push_back(0);
+            records.push_back(record);
+        }
+    }
+
+    std::stable_sort(records.begin(), records.end(), record_less);
+
+    std::vector<FpHeader> header(1);
+    memset(&header[0], 0, sizeof(FpHeader));
+    memcpy(header[0].magic, FP_MAGIC, sizeof(FP_MAGIC));
+    header[0].recordCount = (uint32_t)records.size();
+    header[0].stringsSize = (uint32_t)strings.size();
+
+    uint32_t next = 0;
+    for(uint32_t bucket=0; bucket<=FP_BUCKETS; ++bucket)
+    {
+        while(next < records.size() && hash_bucket(records[next].hash) < bucket)
+        {
+            ++next;
+        }
+        header[0].buckets[bucket] = next;
+    }
+
+    std::ofstream outFile(dbName, std::ios::out | std::ios::binary);
+    outFile.write((const char*)&header[0], sizeof(FpHeader));
+    if(!records.empty())
+    {
+        outFile.write((const char*)records.data(), records.size() * sizeof(FpRecord));
+    }
+    outFile.write(strings.data(), strings.size());
+
+    if(!outFile.good())
+    {
+        fatal("Failed to write to ouput file.", dbName);
+    }
+
+    std::cout << records.size() << " hashes from " << romCount - failed << " images." << std::endl;
+}
+
+// Read-only view of the database file, mapped where the OS allows.
+class Database
+{
+public:
+    explicit Database(const char* dbName) : m_file(dbName), m_data(m_file.data()), m_size(m_file.size())
+    {
+        if(m_size < sizeof(FpHeader) || memcmp(header()->magic, FP_MAGIC, sizeof(FP_MAGIC)) != 0)
+        {
+            fatal("Not a fingerprint database.", dbName);
+        }
+
+        if(sizeof(FpHeader) + (uint64_t)header()->recordCount * sizeof(FpRecord) + header()->stringsSize != m_size)
+        {
+            fatal("Fingerprint database is corrupt.", dbName);
+        }
+
+        // find() uses the bucket table without checking it, so check all of it once here: it must
+        // rise from 0 to the record count, so every bucket's records are inside the database
+        const FpHeader* fpHeader = header();
+        if(fpHeader->buckets[0] != 0 || fpHeader->buckets[FP_BUCKETS] != fpHeader->recordCount)
+        {
+            fatal("Fingerprint database is corrupt.", dbName);
+        }
+
+        for(uint32_t bucket=0; bucket<FP_BUCKETS; ++bucket)
+        {
+            if(fpHeader->buckets[bucket] > fpHeader->buckets[bucket + 1])
+            {
+                fatal("Fingerprint database is corrupt.", dbName);
+            }
+        }
+
+        // string() hands out pointers into the table, so its last string must be terminated
+        const char* strings = string_table();
+        if(fpHeader->stringsSize && strings[fpHeader->stringsSize - 1] != 0)
+        {
+            fatal("Fingerprint database is corrupt.", dbName);
+        }
+    }
+
+    const FpHeader* header() const
+    {
+        return (const FpHeader*)m_data;
+    }
+
+    const FpRecord* records() const
+    {
+        return (const FpRecord*)(m_data + sizeof(FpHeader));
+    }
+
+    const char* string_table() const
+    {
+        return (const char*)(records() + header()->recordCount);
+    }
+
+    const char* string(const uint32_t offset) const
+    {
+        return (offset < header()->stringsSize) ? string_table() + offset : "?";
+    }
+
+    // Records with the given hash are [first, last).
+    void find(const uint8_t* hash, const FpRecord*& first, const FpRecord*& last) const
+    {
+        const uint32_t bucket = hash_bucket(hash);
+        const FpRecord* begin = records() + header()->buckets[bucket];
+        const FpRecord* end = records() + header()->buckets[bucket + 1];
+
+        first = begin;
+        while(first < end && memcmp(first->hash, hash, SHA1_SIZE) < 0)
+        {
+            ++first;
+        }
+
+        last = first;
+        while(last < end && memcmp(last->hash, hash, SHA1_SIZE) == 0)
+        {
+            ++last;
+        }
+    }
+
+private:
+    MappedFile m_file;
+    const uint8_t* m_data;
+    size_t m_size;
+};
+
+static void report_matches(const Database& db, const char* romFile, const char* what, const uint8_t* hash)
+{
+    const FpRecord* first;
+    const FpRecord* last;
+    db.find(hash, first, last);
+
+    char text[SHA1_SIZE * 2 + 1];
+    hex_digest(hash, SHA1_SIZE, text);
+
+    std::cout << romFile << ": " << what << " " << text;
+
+    if(first == last)
+    {
+        std::cout << " unknown" << std::endl;
+        return;
+    }
+
+    for(const FpRecord* record=first; record<last; ++record)
+    {
+        std::cout << (record == first ? " matches " : ", ");
+        if(record->kind == FP_KIND_FILE)
+        {
+            std::cout << db.string(record->name) << " in ";
+        }
+        std::cout << db.string(record->image);
+    }
+    std::cout << std::endl;
+}
+
+// Images that cannot be read are reported and counted in failed.
+static void lookup(const char* dbName, char** romFiles, const int romCount, uint32_t& failed)
+{
+    Database db(dbName);
+    HashSink sink;
+
+    for(int i=0; i<romCount; ++i)
+    {
+        uint8_t imageHash[SHA1_SIZE];
+        const char* invalid = NULL;
+
+        if(!hash_image(romFiles[i], imageHash, sink, invalid))
+        {
+            ++failed;
+            continue;
+        }
+
+        report_matches(db, romFiles[i], "image", imageHash);
+
+        if(invalid)
+        {
+            std::cout << romFiles[i] << ": " << invalid << std::endl;
+        }
+
+        for(size_t f=0; f<sink.files.size(); ++f)
+        {
+            report_matches(db, romFiles[i], sink.files[f].name, sink.files[f].hash);
+        }
+    }
+}
+
+static void usage()
+{
+    std::cout << "Usage: romfp build <database> <romfile> [romfile...]\n"
+                 "       romfp lookup <database> <romfile> [romfile...]\n" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 4)
+    {
+        usage();
+        exit(-1);
+    }
+
+    uint32_t failed = 0;
+
+    if(strcmp(argv[1], "build") == 0)
+    {
+        build_database(argv[2], argv + 3, argc - 3, failed);
+    }
+    else if(strcmp(argv[1], "lookup") == 0)
+    {
+        lookup(argv[2], argv + 3, argc - 3, failed);
+    }
+    else
+    {
+        usage();
+        exit(-1);
+    }
+
+    if(failed)
+    {
+        std::cerr << failed << " images could not be read." << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
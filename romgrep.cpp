@@ -0,0 +1,601 @@
+/*
+romgrep - Andy Anderson 2020
+
+Find which capsules contain a string or byte pattern, searching inside the files of each image.
+
+Files are reconstructed with the directory walk (as dumprom extracts them, padded to whole
+records) and searched in memory, so a pattern that crosses a block boundary is found and
+nothing is written out. All the patterns are searched for in one pass over each file: candidate
+positions are found 16 at a time with SSE2, by comparing the first and last byte of each pattern
+against the same 16 bytes of the file, and only those are checked in full. Images are searched
+on several threads; the results are printed in the order the images were given.
+
+An index (--make-index) keeps a 64K bit set of the trigrams in each image's files. With --index
+an image is only searched if every trigram of some pattern is in its set, so repeated searches
+of a large collection skip most images without reading them. Images that have changed since
+the index was made (size or modification time, to the nanosecond) are searched as usual.
+
+To compile on linux;
+
+    g++ -O2 -pthread romgrep.cpp -o romgrep
+
+Usage;
+
+    romgrep [--threads=<n>] [--index=<indexfile>] [-e <pattern>]... [<pattern>] <romfile> [romfile...]
+    romgrep --make-index=<indexfile> <romfile> [romfile...]
+
+A pattern is text, or bytes in hex after "hex:" (e.g. hex:0E09CD0500 for a BDOS print string).
+Each match is printed as <romfile>:<file>:<offset>: <pattern>. The exit status is 0 if anything
+matched and 1 otherwise.
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "epsonrom.h"
+#include "romhash.h"
+#include "rommap.h"
+
+const char INDEX_MAGIC[8] = { 'R', 'O', 'M', 'G', 'R', 'X', '0', '2' };
+const uint32_t TRIGRAM_BITS = 0x10000;
+
+// Naturally aligned, so written as it is in memory
+struct IndexEntry
+{
+    uint32_t name;  // offset in the string table
+    uint32_t reserved;
+    uint64_t size;  // of the rom file when indexed
+    int64_t mtime;  // in nanoseconds, so a file rewritten within the same second is seen to change
+    uint8_t trigrams[TRIGRAM_BITS / 8];
+};
+
+struct Pattern
+{
+    std::string text; // as given, for output
+    std::vector<uint8_t> bytes;
+};
+
+static inline uint32_t trigram_bit(const uint8_t* p)
+{
+    return (uint32_t)mix64(((uint64_t)p[0] << 16) | ((uint64_t)p[1] << 8) | p[2]) & (TRIGRAM_BITS - 1);
+}
+
+static inline int lowest_bit(const uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Calls found(offset, p) for every occurrence of any pattern p in data, in offset order (then
+// pattern order), in a single pass over the data. masks is scratch space, reused between calls
+// so searching does not allocate. Empty patterns never match.
+template<class Found>
+static void find_all(const uint8_t* data, const size_t size, const std::vector<Pattern>& patterns, std::vector<uint32_t>& masks,
+                     Found& found)
+{
+    size_t longest = 0;
+    for(size_t p=0; p<patterns.size(); ++p)
+    {
+        longest = std::max(longest, patterns[p].bytes.size());
+    }
+
+    size_t i = 0;
+
+#ifdef ROM_HAVE_SSE2
+    // Each 16 bytes of data is loaded once and compared with every pattern's first byte, and the
+    // bytes at each pattern's length with its last byte. Positions from which the longest pattern
+    // would run off the end are left to the loop below.
+    masks.resize(patterns.size());
+
+    for(; longest <= size && i + 16 <= size - longest + 1; i += 16)
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        uint32_t any = 0;
+
+        for(size_t p=0; p<patterns.size(); ++p)
+        {
+            const std::vector<uint8_t>& bytes = patterns[p].bytes;
+            masks[p] = 0;
+            if(bytes.empty())
+            {
+                continue;
+            }
+
+            const __m128i b = _mm_loadu_si128((const __m128i*)(data + i + bytes.size() - 1));
+            masks[p] = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8((char)bytes[0])),
+                                                                 _mm_cmpeq_epi8(b, _mm_set1_epi8((char)bytes.back()))));
+            any |= masks[p];
+        }
+
+        while(any)
+        {
+            const int bit = lowest_bit(any);
+            for(size_t p=0; p<patterns.size(); ++p)
+            {
+                const std::vector<uint8_t>& bytes = patterns[p].bytes;
+                if(((masks[p] >> bit) & 1) && memcmp(data + i + bit + 1, bytes.data() + 1, bytes.size() - 1) == 0)
+                {
+                    found(i + bit, p);
+                }
+            }
+            any &= any - 1;
+        }
+    }
+#else
+    (void)masks;
+#endif
+
+    for(; i < size; ++i)
+    {
+        for(size_t p=0; p<patterns.size(); ++p)
+        {
+            const std::vector<uint8_t>& bytes = patterns[p].bytes;
+            if(!bytes.empty() && bytes.size() <= size - i && data[i] == bytes[0] && memcmp(data + i, bytes.data(), bytes.size()) == 0)
+            {
+                found(i, p);
+            }
+        }
+    }
+}
+
+// Reconstructs each file in a buffer and searches it when it is closed.
+struct SearchSink
+{
+    const std::vector<Pattern>* patterns;
+    const char* romFile;
+    std::string* output;
+    std::vector<uint8_t> file;
+    std::vector<uint32_t> masks;
+    char fileName[13];
+
+    void open(const char* name)
+    {
+        snprintf(fileName, sizeof(fileName), "%s", name);
+        file.clear();
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        file.insert(file.end(), data, data + size);
+    }
+
+    void close()
+    {
+        find_all(file.data(), file.size(), *patterns, masks, *this);
+    }
+
+    void operator()(const size_t offset, const size_t patternIndex)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), ":%s:0x%04zx: ", fileName, offset);
+        *output += romFile;
+        *output += line;
+        *output += (*patterns)[patternIndex].text;
+        *output += '\n';
+    }
+};
+
+// Sets a bit for every trigram in each file.
+struct TrigramSink
+{
+    uint8_t* bits;
+    std::vector<uint8_t> file;
+
+    void open(const char*)
+    {
+        file.clear();
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        file.insert(file.end(), data, data + size);
+    }
+
+    void close()
+    {
+        for(size_t i=0; i+3<=file.size(); ++i)
+        {
+            const uint32_t bit = trigram_bit(file.data() + i);
+            bits[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        }
+    }
+};
+
+static bool file_stamp(const char* fileName, uint64_t& size, int64_t& mtime)
+{
+    struct stat st;
+    if(stat(fileName, &st) != 0)
+    {
+        return false;
+    }
+
+    size = (uint64_t)st.st_size;
+#if defined(_WIN32)
+    mtime = (int64_t)st.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+    mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// Loads a valid image, or returns false with a note in output.
+static bool load_valid(const char* romFile, std::vector<uint8_t>& image, std::string& output)
+{
+    const char* error = read_image(romFile, image);
+    if(error == NULL)
+    {
+        error = verify_rom(image.data(), (uint32_t)image.size());
+    }
+
+    if(error)
+    {
+        output = std::string(romFile) + ": " + error + "\n";
+        return false;
+    }
+
+    return true;
+}
+
+// Run work(i) for each of count items on the given number of threads.
+template<class Work>
+static void parallel_for(const size_t count, const unsigned threads, Work& work)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+
+    for(unsigned t=0; t<threads; ++t)
+    {
+        pool.push_back(std::thread([&]()
+        {
+            for(size_t i=next++; i<count; i=next++)
+            {
+                work(i);
+            }
+        }));
+    }
+
+    for(size_t t=0; t<pool.size(); ++t)
+    {
+        pool[t].join();
+    }
+}
+
+struct IndexWork
+{
+    char** romFiles;
+    std::vector<IndexEntry>* entries;
+    std::vector<std::string>* errors;
+
+    void operator()(const size_t i)
+    {
+        IndexEntry& entry = (*entries)[i];
+        memset(&entry, 0, sizeof(entry));
+        file_stamp(romFiles[i], entry.size, entry.mtime);
+
+        std::vector<uint8_t> image;
+        if(load_valid(romFiles[i], image, (*errors)[i]))
+        {
+            TrigramSink sink;
+            sink.bits = entry.trigrams;
+            walk_files(image.data(), (uint32_t)image.size(), sink);
+        }
+    }
+};
+
+static void make_index(const char* indexName, char** romFiles, const int romCount, const unsigned threads)
+{
+    fail_if_exists(indexName);
+
+    std::vector<IndexEntry> entries(romCount);
+    std::vector<std::string> errors(romCount);
+    IndexWork work = { romFiles, &entries, &errors };
+    parallel_for(romCount, threads, work);
+
+    std::string strings;
+    for(int i=0; i<romCount; ++i)
+    {
+        std::cerr << errors[i];
+        entries[i].name = (uint32_t)strings.size();
+        strings.append(romFiles[i]);
+        strings.push_back(0);
+    }
+
+    const uint32_t count = (uint32_t)romCount;
+    const uint32_t stringsSize = (uint32_t)strings.size();
+
+    std::ofstream outFile(indexName, std::ios::out | std::ios::binary);
+    outFile.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    outFile.write((const char*)&count, sizeof(count));
+    outFile.write((const char*)&stringsSize, sizeof(stringsSize));
+    outFile.write((const char*)entries.data(), entries.size() * sizeof(IndexEntry));
+    outFile.write(strings.data(), strings.size());
+
+    if(!outFile.good())
+    {
+        fatal("Failed to write to ouput file.", indexName);
+    }
+
+    std::cout << romCount << " images indexed." << std::endl;
+}
+
+class TrigramIndex
+{
+public:
+    explicit TrigramIndex(const char* indexName) : m_data(indexName)
+    {
+        const size_t headerSize = sizeof(INDEX_MAGIC) + 2 * sizeof(uint32_t);
+        if(m_data.size() < headerSize || memcmp(m_data.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+        {
+            fatal("Not a search index.", indexName);
+        }
+
+        memcpy(&m_count, m_data.data() + sizeof(INDEX_MAGIC), sizeof(m_count));
+        memcpy(&m_stringsSize, m_data.data() + sizeof(INDEX_MAGIC) + sizeof(uint32_t), sizeof(m_stringsSize));
+
+        if(headerSize + (uint64_t)m_count * sizeof(IndexEntry) + m_stringsSize != m_data.size())
+        {
+            fatal("Search index is corrupt.", indexName);
+        }
+
+        m_entries = (const IndexEntry*)(m_data.data() + headerSize);
+        m_strings = (const char*)(m_entries + m_count);
+
+        // Every image of a search is looked up, so by name rather than by a scan of the entries
+        m_byName.reserve(m_count);
+        for(uint32_t i=0; i<m_count; ++i)
+        {
+            const uint32_t name = m_entries[i].name;
+            if(name < m_stringsSize && memchr(m_strings + name, 0, m_stringsSize - name))
+            {
+                m_byName.insert(std::make_pair(std::string(m_strings + name), i));
+            }
+        }
+    }
+
+    // The entry for a rom file, if the index has one and the file has not changed since.
+    const IndexEntry* find(const char* romFile) const
+    {
+        uint64_t size;
+        int64_t mtime;
+        if(!file_stamp(romFile, size, mtime))
+        {
+            return NULL;
+        }
+
+        const std::unordered_map<std::string, uint32_t>::const_iterator found = m_byName.find(romFile);
+        if(found == m_byName.end())
+        {
+            return NULL;
+        }
+
+        const IndexEntry& entry = m_entries[found->second];
+        return (entry.size == size && entry.mtime == mtime) ? &entry : NULL;
+    }
+
+private:
+    MappedFile m_data;
+    uint32_t m_count;
+    uint32_t m_stringsSize;
+    const IndexEntry* m_entries;
+    const char* m_strings;
+    std::unordered_map<std::string, uint32_t> m_byName; // the first entry, if a name is indexed twice
+};
+
+// False if no pattern can be in an image with these trigrams.
+static bool may_contain(const IndexEntry& entry, const std::vector<Pattern>& patterns)
+{
+    for(size_t p=0; p<patterns.size(); ++p)
+    {
+        const std::vector<uint8_t>& bytes = patterns[p].bytes;
+        bool all = true;
+
+        for(size_t i=0; all && i+3<=bytes.size(); ++i)
+        {
+            const uint32_t bit = trigram_bit(bytes.data() + i);
+            all = (entry.trigrams[bit / 8] >> (bit % 8)) & 1;
+        }
+
+        if(all)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+struct SearchWork
+{
+    char** romFiles;
+    const std::vector<Pattern>* patterns;
+    const TrigramIndex* index;
+    std::vector<std::string>* results;
+    std::atomic<uint32_t> skipped;
+
+    void operator()(const size_t i)
+    {
+        if(index)
+        {
+            const IndexEntry* entry = index->find(romFiles[i]);
+            if(entry && !may_contain(*entry, *patterns))
+            {
+                ++skipped;
+                return;
+            }
+        }
+
+        std::vector<uint8_t> image;
+        if(!load_valid(romFiles[i], image, (*results)[i]))
+        {
+            std::cerr << (*results)[i];
+            (*results)[i].clear();
+            return;
+        }
+
+        SearchSink sink;
+        sink.patterns = patterns;
+        sink.romFile = romFiles[i];
+        sink.output = &(*results)[i];
+        walk_files(image.data(), (uint32_t)image.size(), sink);
+    }
+};
+
+static bool parse_pattern(const char* text, Pattern& pattern)
+{
+    pattern.text = text;
+    pattern.bytes.clear();
+
+    if(strncmp(text, "hex:", 4) != 0)
+    {
+        pattern.bytes.assign(text, text + strlen(text));
+        return !pattern.bytes.empty();
+    }
+
+    const char* hex = text + 4;
+    const size_t digits = strlen(hex);
+    if(digits == 0 || digits % 2)
+    {
+        return false;
+    }
+
+    for(size_t i=0; i<digits; i+=2)
+    {
+        const int high = hex_digit_value((uint8_t)hex[i]);
+        const int low = hex_digit_value((uint8_t)hex[i + 1]);
+        if(high < 0 || low < 0)
+        {
+            return false;
+        }
+        pattern.bytes.push_back((uint8_t)((high << 4) | low));
+    }
+
+    return true;
+}
+
+static void usage()
+{
+    std::cout << "Usage: romgrep [--threads=<n>] [--index=<indexfile>] [-e <pattern>]... [<pattern>] <romfile> [romfile...]\n"
+                 "       romgrep --make-index=<indexfile> <romfile> [romfile...]\n" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    const char* indexName = NULL;
+    const char* makeIndexName = NULL;
+    std::vector<Pattern> patterns;
+    std::vector<char*> args;
+
+    for(int i=1; i<argc; ++i)
+    {
+        if(strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            threads = (unsigned)atoi(argv[i] + 10);
+        }
+        else if(strncmp(argv[i], "--index=", 8) == 0)
+        {
+            indexName = argv[i] + 8;
+        }
+        else if(strncmp(argv[i], "--make-index=", 13) == 0)
+        {
+            makeIndexName = argv[i] + 13;
+        }
+        else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            Pattern pattern;
+            if(!parse_pattern(argv[++i], pattern))
+            {
+                fatal("Invalid pattern.", argv[i]);
+            }
+            patterns.push_back(pattern);
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    threads = threads ? threads : 1;
+
+    if(makeIndexName)
+    {
+        if(args.empty() || !patterns.empty() || indexName)
+        {
+            usage();
+            exit(-1);
+        }
+
+        make_index(makeIndexName, args.data(), (int)args.size(), threads);
+        return 0;
+    }
+
+    if(patterns.empty() && !args.empty())
+    {
+        Pattern pattern;
+        if(!parse_pattern(args[0], pattern))
+        {
+            fatal("Invalid pattern.", args[0]);
+        }
+        patterns.push_back(pattern);
+        args.erase(args.begin());
+    }
+
+    if(patterns.empty() || args.empty())
+    {
+        usage();
+        exit(-1);
+    }
+
+    TrigramIndex* index = indexName ? new TrigramIndex(indexName) : NULL;
+
+    std::vector<std::string> results(args.size());
+    SearchWork work;
+    work.romFiles = args.data();
+    work.patterns = &patterns;
+    work.index = index;
+    work.results = &results;
+    work.skipped = 0;
+
+    parallel_for(args.size(), threads, work);
+
+    bool matched = false;
+    for(size_t i=0; i<results.size(); ++i)
+    {
+        std::cout << results[i];
+        matched |= !results[i].empty();
+    }
+    std::cout << std::flush;
+
+    if(index)
+    {
+        std::cerr << work.skipped << " of " << args.size() << " images skipped by the index." << std::endl;
+        delete index;
+    }
+
+    return matched ? 0 : 1;
+}
@@ -0,0 +1,535 @@
+/*
+romhash.h - Andy Anderson 2020
+
+Hashes used to identify ROM images and the files in them.
+
+SHA-1, MD5 and CRC-32 are incremental (update() may be called per block), so files can be
+hashed as the directory walk reconstructs them, without first copying them to a buffer.
+hash64() is a fast non-cryptographic hash for bucketing and similarity features.
+
+CRC-32 is the zlib/PKZIP CRC used by ROM DAT files. Runs of 64 bytes or more are folded 16
+bytes at a time with carry-less multiplication (PCLMULQDQ) when the CPU has it, as described
+in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"; the
+rest goes through a lookup table. (The SSE4.2 crc32 instruction computes CRC-32C, a different
+polynomial, so it cannot be used here.)
+
+*/
+
+#ifndef ROMHASH_H
+#define ROMHASH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ROM_HAVE_PCLMUL 1
+#define ROM_TARGET_PCLMUL __attribute__((target("pclmul,sse2")))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#include <wmmintrin.h>
+#define ROM_HAVE_PCLMUL 1
+#define ROM_TARGET_PCLMUL
+#endif
+
+const size_t SHA1_SIZE = 20;
+const size_t MD5_SIZE = 16;
+
+class Sha1
+{
+public:
+    Sha1()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        m_state[0] = 0x67452301;
+        m_state[1] = 0xefcdab89;
+        m_state[2] = 0x98badcfe;
+        m_state[3] = 0x10325476;
+        m_state[4] = 0xc3d2e1f0;
+        m_length = 0;
+        m_used = 0;
+    }
+
+    void update(const uint8_t* data, size_t size)
+    {
+        m_length += size;
+
+        if(m_used)
+        {
+            const size_t take = (size < 64 - m_used) ? size : 64 - m_used;
+            memcpy(m_block + m_used, data, take);
+            m_used += take;
+            data += take;
+            size -= take;
+
+            if(m_used < 64)
+            {
+                return;
+            }
+
+            transform(m_block);
+            m_used = 0;
+        }
+
+        while(size >= 64)
+        {
+            transform(data);
+            data += 64;
+            size -= 64;
+        }
+
+        memcpy(m_block, data, size);
+        m_used = size;
+    }
+
+    void final(uint8_t digest[SHA1_SIZE])
+    {
+        const uint64_t bits = m_length * 8;
+
+        m_block[m_used++] = 0x80;
+        if(m_used > 56)
+        {
+            memset(m_block + m_used, 0, 64 - m_used);
+            transform(m_block);
+            m_used = 0;
+        }
+
+        memset(m_block + m_used, 0, 56 - m_used);
+        for(int i=0; i<8; ++i)
+        {
+            m_block[56 + i] = (uint8_t)(bits >> (56 - i * 8));
+        }
+        transform(m_block);
+
+        for(int i=0; i<5; ++i)
+        {
+            digest[i * 4 + 0] = (uint8_t)(m_state[i] >> 24);
+            digest[i * 4 + 1] = (uint8_t)(m_state[i] >> 16);
+            digest[i * 4 + 2] = (uint8_t)(m_state[i] >> 8);
+            digest[i * 4 + 3] = (uint8_t)(m_state[i]);
+        }
+    }
+
+private:
+    static uint32_t rotl(const uint32_t x, const int n)
+    {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    void transform(const uint8_t* block)
+    {
+        uint32_t w[80];
+
+        for(int i=0; i<16; ++i)
+        {
+            w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+                   ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+        }
+
+        for(int i=16; i<80; ++i)
+        {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3], e = m_state[4];
+
+        for(int i=0; i<80; ++i)
+        {
+            uint32_t f, k;
+
+            if(i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            }
+            else if(i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            }
+            else if(i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+
+            const uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        m_state[0] += a;
+        m_state[1] += b;
+        m_state[2] += c;
+        m_state[3] += d;
+        m_state[4] += e;
+    }
+
+    uint32_t m_state[5];
+    uint64_t m_length;
+    uint8_t m_block[64];
+    size_t m_used;
+};
+
+class Md5
+{
+public:
+    Md5()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        m_state[0] = 0x67452301;
+        m_state[1] = 0xefcdab89;
+        m_state[2] = 0x98badcfe;
+        m_state[3] = 0x10325476;
+        m_length = 0;
+        m_used = 0;
+    }
+
+    void update(const uint8_t* data, size_t size)
+    {
+        m_length += size;
+
+        if(m_used)
+        {
+            const size_t take = (size < 64 - m_used) ? size : 64 - m_used;
+            memcpy(m_block + m_used, data, take);
+            m_used += take;
+            data += take;
+            size -= take;
+
+            if(m_used < 64)
+            {
+                return;
+            }
+
+            transform(m_block);
+            m_used = 0;
+        }
+
+        while(size >= 64)
+        {
+            transform(data);
+            data += 64;
+            size -= 64;
+        }
+
+        memcpy(m_block, data, size);
+        m_used = size;
+    }
+
+    void final(uint8_t digest[MD5_SIZE])
+    {
+        const uint64_t bits = m_length * 8;
+
+        m_block[m_used++] = 0x80;
+        if(m_used > 56)
+        {
+            memset(m_block + m_used, 0, 64 - m_used);
+            transform(m_block);
+            m_used = 0;
+        }
+
+        memset(m_block + m_used, 0, 56 - m_used);
+        for(int i=0; i<8; ++i)
+        {
+            m_block[56 + i] = (uint8_t)(bits >> (i * 8));
+        }
+        transform(m_block);
+
+        for(int i=0; i<4; ++i)
+        {
+            digest[i * 4 + 0] = (uint8_t)(m_state[i]);
+            digest[i * 4 + 1] = (uint8_t)(m_state[i] >> 8);
+            digest[i * 4 + 2] = (uint8_t)(m_state[i] >> 16);
+            digest[i * 4 + 3] = (uint8_t)(m_state[i] >> 24);
+        }
+    }
+
+private:
+    static uint32_t rotl(const uint32_t x, const int n)
+    {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    void transform(const uint8_t* block)
+    {
+        static const uint32_t k[64] =
+        {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+        };
+        static const int shifts[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+        uint32_t w[16];
+        for(int i=0; i<16; ++i)
+        {
+            w[i] = block[i * 4] | ((uint32_t)block[i * 4 + 1] << 8) |
+                   ((uint32_t)block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+        }
+
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+
+        for(int i=0; i<64; ++i)
+        {
+            uint32_t f;
+            int g;
+
+            if(i < 16)
+            {
+                f = (b & c) | (~b & d);
+                g = i;
+            }
+            else if(i < 32)
+            {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            }
+            else if(i < 48)
+            {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            }
+            else
+            {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+
+            const uint32_t temp = d;
+            d = c;
+            c = b;
+            b = b + rotl(a + f + k[i] + w[g], shifts[(i / 16) * 4 + i % 4]);
+            a = temp;
+        }
+
+        m_state[0] += a;
+        m_state[1] += b;
+        m_state[2] += c;
+        m_state[3] += d;
+    }
+
+    uint32_t m_state[4];
+    uint64_t m_length;
+    uint8_t m_block[64];
+    size_t m_used;
+};
+
+struct Crc32Table
+{
+    uint32_t entries[256];
+
+    Crc32Table()
+    {
+        for(uint32_t i=0; i<256; ++i)
+        {
+            uint32_t crc = i;
+            for(int bit=0; bit<8; ++bit)
+            {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+#ifdef ROM_HAVE_PCLMUL
+
+static inline bool cpu_has_pclmul()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 1)) != 0;
+#else
+    return __builtin_cpu_supports("pclmul");
+#endif
+}
+
+// Fold size bytes (a multiple of 16, at least 64) into the CRC register.
+ROM_TARGET_PCLMUL static inline uint32_t crc32_fold(uint32_t crc, const uint8_t* data, size_t size)
+{
+    // Constants for the reflected CRC-32 polynomial, from the paper
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    data += 64;
+    size -= 64;
+
+    // Four 16 byte lanes at a time
+    while(size >= 64)
+    {
+        const __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        const __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        const __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        const __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+
+        data += 64;
+        size -= 64;
+    }
+
+    // Fold the four lanes into one, then any remaining 16 byte blocks into it
+    const __m128i lanes[3] = { x2, x3, x4 };
+    for(int i=0; i<3; ++i)
+    {
+        const __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+    }
+
+    while(size >= 16)
+    {
+        const __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, low32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+#endif // ROM_HAVE_PCLMUL
+
+class Crc32
+{
+public:
+    Crc32() : m_crc(0xffffffff)
+    {
+    }
+
+    void reset()
+    {
+        m_crc = 0xffffffff;
+    }
+
+    void update(const uint8_t* data, size_t size)
+    {
+#ifdef ROM_HAVE_PCLMUL
+        static const bool pclmul = cpu_has_pclmul();
+
+        if(pclmul && size >= 64)
+        {
+            const size_t folded = size & ~(size_t)15;
+            m_crc = crc32_fold(m_crc, data, folded);
+            data += folded;
+            size -= folded;
+        }
+#endif
+
+        static const Crc32Table table;
+
+        uint32_t crc = m_crc;
+        for(size_t i=0; i<size; ++i)
+        {
+            crc = (crc >> 8) ^ table.entries[(crc ^ data[i]) & 0xff];
+        }
+        m_crc = crc;
+    }
+
+    uint32_t final() const
+    {
+        return ~m_crc;
+    }
+
+private:
+    uint32_t m_crc;
+};
+
+static inline uint64_t mix64(uint64_t x)
+{
+    // splitmix64 finaliser
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t hash64(const uint8_t* data, const size_t size)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+    size_t i = 0;
+
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = mix64(h ^ word);
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    return mix64(h ^ tail);
+}
+
+// Format a digest as lower case hex. text must hold size * 2 + 1 characters.
+static inline void hex_digest(const uint8_t* digest, const size_t size, char* text)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for(size_t i=0; i<size; ++i)
+    {
+        text[i * 2] = digits[digest[i] >> 4];
+        text[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    text[size * 2] = 0;
+}
+
+#endif // ROMHASH_H
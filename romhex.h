@@ -0,0 +1,630 @@
+/*
+romhex.h - Andy Anderson 2020
+
+Intel HEX and Motorola S-record encoding and decoding of ROM images, for EPROM programmers.
+
+Images are encoded as they are programmed, i.e. in physical address order (swap_halves() a
+27C256 image first). The whole image is encoded into one buffer with a byte to hex pair
+lookup table, so it can be written with a single write.
+
+Dumps read by the tools may be Intel HEX, S-records or binary, optionally with a base offset
+(decode_rom_input()). Hex digits are decoded 16 at a time with SSE2 where available, and
+every record checksum is checked. Addresses not covered by any record read as 0xff, as an
+erased EPROM does.
+
+*/
+
+#ifndef ROMHEX_H
+#define ROMHEX_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <iostream>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ROM_HAVE_SSE2 1
+#endif
+
+enum RomFormat
+{
+    FORMAT_BINARY,
+    FORMAT_IHEX,
+    FORMAT_SREC
+};
+
+const uint32_t HEX_RECORD_BYTES = 16;
+
+struct HexTable
+{
+    char pairs[256][2];
+
+    HexTable()
+    {
+        static const char digits[] = "0123456789ABCDEF";
+
+        for(int i=0; i<256; ++i)
+        {
+            pairs[i][0] = digits[i >> 4];
+            pairs[i][1] = digits[i & 0x0f];
+        }
+    }
+};
+
+static inline const HexTable& hex_table()
+{
+    static const HexTable table;
+    return table;
+}
+
+// Largest encoding (either format) of an image of the given size.
+static inline size_t hex_encoded_size(const uint32_t size)
+{
+    return (size / HEX_RECORD_BYTES + 4) * 48 + (size >> 16) * 20 + 256;
+}
+
+// Append a byte as two hex digits to out, adding it to the record checksum.
+static inline char* put_hex(char* out, const uint8_t value, uint32_t& sum)
+{
+    memcpy(out, hex_table().pairs[value], 2);
+    sum += value;
+    return out + 2;
+}
+
+// Encode an image as Intel HEX (data records, extended linear address records above 64K, end record).
+// out must hold hex_encoded_size(size) characters. Returns the number of characters written.
+static inline size_t encode_ihex(const uint8_t* data, const uint32_t size, char* out)
+{
+    char* p = out;
+    uint32_t sum;
+
+    for(uint32_t address=0; address<size; address+=HEX_RECORD_BYTES)
+    {
+        if(address && (address & 0xffff) == 0)
+        {
+            // Extended linear address - the upper 16 bits of the following addresses
+            sum = 0;
+            *p++ = ':';
+            p = put_hex(p, 2, sum);
+            p = put_hex(p, 0, sum);
+            p = put_hex(p, 0, sum);
+            p = put_hex(p, 4, sum);
+            p = put_hex(p, (uint8_t)(address >> 24), sum);
+            p = put_hex(p, (uint8_t)(address >> 16), sum);
+            p = put_hex(p, (uint8_t)(0x100 - (sum & 0xff)), sum);
+            *p++ = '\n';
+        }
+
+        const uint32_t length = (size - address < HEX_RECORD_BYTES) ? size - address : HEX_RECORD_BYTES;
+
+        sum = 0;
+        *p++ = ':';
+        p = put_hex(p, (uint8_t)length, sum);
+        p = put_hex(p, (uint8_t)(address >> 8), sum);
+        p = put_hex(p, (uint8_t)address, sum);
+        p = put_hex(p, 0, sum);
+
+        for(uint32_t i=0; i<length; ++i)
+        {
+            p = put_hex(p, data[address + i], sum);
+        }
+
+        p = put_hex(p, (uint8_t)(0x100 - (sum & 0xff)), sum);
+        *p++ = '\n';
+    }
+
+    memcpy(p, ":00000001FF\n", 12);
+    p += 12;
+
+    return p - out;
+}
+
+// Encode an image as Motorola S-records: an S0 header holding the given text, S1 data records
+// (S2 above 64K), an S5 record count and an S9 (S8) terminator.
+// out must hold hex_encoded_size(size) characters. Returns the number of characters written.
+static inline size_t encode_srec(const uint8_t* data, const uint32_t size, const char* headerText, char* out)
+{
+    char* p = out;
+    uint32_t sum;
+    const bool wide = size > 0x10000;
+    const uint32_t addressBytes = wide ? 3 : 2;
+
+    size_t headerLength = strlen(headerText);
+    if(headerLength > 64)
+    {
+        headerLength = 64;
+    }
+
+    sum = 0;
+    *p++ = 'S';
+    *p++ = '0';
+    p = put_hex(p, (uint8_t)(headerLength + 3), sum);
+    p = put_hex(p, 0, sum);
+    p = put_hex(p, 0, sum);
+    for(size_t i=0; i<headerLength; ++i)
+    {
+        p = put_hex(p, (uint8_t)headerText[i], sum);
+    }
+    p = put_hex(p, (uint8_t)~sum, sum);
+    *p++ = '\n';
+
+    uint32_t records = 0;
+
+    for(uint32_t address=0; address<size; address+=HEX_RECORD_BYTES)
+    {
+        const uint32_t length = (size - address < HEX_RECORD_BYTES) ? size - address : HEX_RECORD_BYTES;
+
+        sum = 0;
+        *p++ = 'S';
+        *p++ = wide ? '2' : '1';
+        p = put_hex(p, (uint8_t)(length + addressBytes + 1), sum);
+        if(wide)
+        {
+            p = put_hex(p, (uint8_t)(address >> 16), sum);
+        }
+        p = put_hex(p, (uint8_t)(address >> 8), sum);
+        p = put_hex(p, (uint8_t)address, sum);
+
+        for(uint32_t i=0; i<length; ++i)
+        {
+            p = put_hex(p, data[address + i], sum);
+        }
+
+        p = put_hex(p, (uint8_t)~sum, sum);
+        *p++ = '\n';
+        ++records;
+    }
+
+    if(records <= 0xffff)
+    {
+        sum = 0;
+        *p++ = 'S';
+        *p++ = '5';
+        p = put_hex(p, 3, sum);
+        p = put_hex(p, (uint8_t)(records >> 8), sum);
+        p = put_hex(p, (uint8_t)records, sum);
+        p = put_hex(p, (uint8_t)~sum, sum);
+        *p++ = '\n';
+    }
+
+    const char* terminator = wide ? "S804000000FB\n" : "S9030000FC\n";
+    const size_t terminatorLength = strlen(terminator);
+    memcpy(p, terminator, terminatorLength);
+    p += terminatorLength;
+
+    return p - out;
+}
+
+// Offset meaning "binary images from the start, hex images from their lowest address".
+const uint32_t ROM_OFFSET_AUTO = 0xffffffff;
+
+// Largest image decode_rom_input() accepts.
+const uint32_t MAX_DECODED_SIZE = 0x100000;
+
+static inline int hex_digit_value(const uint8_t c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+
+    const uint8_t lower = c | 0x20;
+    if(lower >= 'a' && lower <= 'f')
+    {
+        return lower - 'a' + 10;
+    }
+
+    return -1;
+}
+
+// Decode count bytes from 2 * count hex digits. Returns false if any character is not a hex digit.
+static inline bool hex_decode(const uint8_t* text, const size_t count, uint8_t* out)
+{
+    size_t i = 0;
+
+#ifdef ROM_HAVE_SSE2
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m128i c = _mm_loadu_si128((const __m128i*)(text + i * 2));
+        const __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+
+        const __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        const __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+        if(_mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) != 0xffff)
+        {
+            return false;
+        }
+
+        const __m128i value = _mm_or_si128(_mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                                           _mm_andnot_si128(isDigit, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+        // Each 16 bit lane holds the high digit in its low byte and the low digit in its high byte
+        const __m128i high = _mm_and_si128(value, _mm_set1_epi16(0x00ff));
+        const __m128i low = _mm_srli_epi16(value, 8);
+        const __m128i bytes = _mm_or_si128(_mm_slli_epi16(high, 4), low);
+
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(bytes, bytes));
+    }
+#endif
+
+    for(; i < count; ++i)
+    {
+        const int high = hex_digit_value(text[i * 2]);
+        const int low = hex_digit_value(text[i * 2 + 1]);
+
+        if(high < 0 || low < 0)
+        {
+            return false;
+        }
+
+        out[i] = (uint8_t)((high << 4) | low);
+    }
+
+    return true;
+}
+
+// Guess the format of a dump from its first character.
+static inline RomFormat detect_format(const uint8_t* data, const size_t size)
+{
+    size_t i = 0;
+    while(i < size && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n'))
+    {
+        ++i;
+    }
+
+    if(i < size && data[i] == ':')
+    {
+        return FORMAT_IHEX;
+    }
+
+    if(i + 1 < size && data[i] == 'S' && data[i + 1] >= '0' && data[i + 1] <= '9')
+    {
+        return FORMAT_SREC;
+    }
+
+    return FORMAT_BINARY;
+}
+
+// Decode every data record of a hex dump, calling handler(address, data, length) for each.
+// A record reaching past the 4G address space is an error, so address + length never wraps.
+// Returns NULL, or a description of the first bad record.
+template<class Handler>
+static inline const char* parse_hex_records(const uint8_t* text, const size_t size, const RomFormat format, Handler& handler)
+{
+    uint8_t record[4 + 255 + 1]; // S-record: count, address (up to 4), data and checksum
+    uint32_t base = 0;
+    size_t pos = 0;
+
+    while(pos < size)
+    {
+        // One record per line
+        size_t end = pos;
+        while(end < size && text[end] != '\n')
+        {
+            ++end;
+        }
+
+        size_t lineEnd = end;
+        while(lineEnd > pos && (text[lineEnd - 1] == '\r' || text[lineEnd - 1] == ' ' || text[lineEnd - 1] == '\t'))
+        {
+            --lineEnd;
+        }
+
+        const uint8_t* line = text + pos;
+        const size_t length = lineEnd - pos;
+        pos = end + 1;
+
+        if(length == 0)
+        {
+            continue;
+        }
+
+        if(format == FORMAT_IHEX)
+        {
+            if(line[0] != ':' || length < 11 || (length - 1) % 2 != 0)
+            {
+                return "Invalid Intel HEX record.";
+            }
+
+            const size_t count = (length - 1) / 2;
+            if(count > sizeof(record) || !hex_decode(line + 1, count, record) || count != (size_t)record[0] + 5)
+            {
+                return "Invalid Intel HEX record.";
+            }
+
+            uint8_t sum = 0;
+            for(size_t i=0; i<count; ++i)
+            {
+                sum += record[i];
+            }
+
+            if(sum != 0)
+            {
+                return "Bad checksum in Intel HEX record.";
+            }
+
+            const uint32_t address = ((uint32_t)record[1] << 8) | record[2];
+            const uint8_t type = record[3];
+
+            if(type == 0x00)
+            {
+                const uint64_t start = (uint64_t)base + address;
+                if(start + record[0] > 0x100000000ull)
+                {
+                    return "Hex record out of range.";
+                }
+
+                handler((uint32_t)start, record + 4, record[0]);
+            }
+            else if(type == 0x01)
+            {
+                break;
+            }
+            else if(type == 0x02 && record[0] == 2)
+            {
+                base = (((uint32_t)record[4] << 8) | record[5]) << 4;
+            }
+            else if(type == 0x04 && record[0] == 2)
+            {
+                base = (((uint32_t)record[4] << 8) | record[5]) << 16;
+            }
+            else if(type != 0x03 && type != 0x05)
+            {
+                return "Invalid Intel HEX record.";
+            }
+        }
+        else
+        {
+            if(line[0] != 'S' || length < 4 || (length - 2) % 2 != 0)
+            {
+                return "Invalid S-record.";
+            }
+
+            const size_t count = (length - 2) / 2;
+            if(count > sizeof(record) || !hex_decode(line + 2, count, record) || count != (size_t)record[0] + 1)
+            {
+                return "Invalid S-record.";
+            }
+
+            uint8_t sum = 0;
+            for(size_t i=0; i<count - 1; ++i)
+            {
+                sum += record[i];
+            }
+
+            if((uint8_t)~sum != record[count - 1])
+            {
+                return "Bad checksum in S-record.";
+            }
+
+            const char type = (char)line[1];
+            if(type >= '1' && type <= '3')
+            {
+                const size_t addressBytes = type - '0' + 1;
+                if(record[0] < addressBytes + 1)
+                {
+                    return "Invalid S-record.";
+                }
+
+                uint32_t address = 0;
+                for(size_t i=0; i<addressBytes; ++i)
+                {
+                    address = (address << 8) | record[1 + i];
+                }
+
+                const uint32_t dataLength = (uint32_t)(record[0] - addressBytes - 1);
+                if((uint64_t)address + dataLength > 0x100000000ull)
+                {
+                    return "Hex record out of range.";
+                }
+
+                handler(address, record + 1 + addressBytes, dataLength);
+            }
+            else if(type >= '7' && type <= '9')
+            {
+                break;
+            }
+            else if(type != '0' && type != '5' && type != '6')
+            {
+                return "Invalid S-record.";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+struct HexExtent
+{
+    uint32_t lowest;
+    uint64_t end;
+
+    HexExtent() : lowest(0xffffffff), end(0) {}
+
+    void operator()(const uint32_t address, const uint8_t*, const uint32_t length)
+    {
+        if(length)
+        {
+            const uint64_t recordEnd = (uint64_t)address + length;
+            lowest = (address < lowest) ? address : lowest;
+            end = (recordEnd > end) ? recordEnd : end;
+        }
+    }
+};
+
+struct HexPlacer
+{
+    uint8_t* image;
+    uint32_t base;
+    size_t size;
+
+    void operator()(const uint32_t address, const uint8_t* data, const uint32_t length)
+    {
+        if(address >= base && (uint64_t)(address - base) + length <= size)
+        {
+            memcpy(image + (address - base), data, length);
+        }
+    }
+};
+
+// Size of the part a decoded hex image is for, from the capacity in its ROM header - at the start,
+// or at 0x4000 for a 27256 in physical order. 0 if neither place holds a header. The header is
+// read as bytes (id E5 37 or E5 50, then the capacity), as this file stands alone from epsonrom.h.
+static inline uint32_t hex_part_size(const std::vector<uint8_t>& image)
+{
+    const uint32_t starts[2] = { 0, 0x4000 };
+
+    for(int i=0; i<2; ++i)
+    {
+        const uint32_t start = starts[i];
+        if(image.size() < start + 3)
+        {
+            break;
+        }
+
+        const uint8_t* header = image.data() + start;
+        const uint8_t capacity = header[2];
+        if(header[0] != 0xe5 || (header[1] != 0x37 && header[1] != 0x50))
+        {
+            continue;
+        }
+
+        if(capacity == 0x20 || (start == 0 && (capacity == 0x08 || capacity == 0x10)))
+        {
+            return (uint32_t)capacity * 1024;
+        }
+    }
+
+    return 0;
+}
+
+// Convert a dump as read from disk (binary, Intel HEX or S-records) to a binary image, replacing
+// data. offset is skipped from the start of a binary dump, or is the address of the first byte of
+// the image in a hex dump; ROM_OFFSET_AUTO for the start of a binary dump or the lowest address
+// in a hex dump. A hex dump may leave out records that are all 0xff, so a decoded image shorter
+// than the part its header gives is padded with 0xff to the size of the part. scratch is working
+// space, kept by the caller so repeated calls do not allocate.
+// Returns NULL on success, otherwise a description of the problem.
+static inline const char* decode_rom_input(std::vector<uint8_t>& data, std::vector<uint8_t>& scratch, const uint32_t offset)
+{
+    const RomFormat format = detect_format(data.data(), data.size());
+
+    if(format == FORMAT_BINARY)
+    {
+        if(offset != ROM_OFFSET_AUTO && offset != 0)
+        {
+            if(offset > data.size())
+            {
+                return "Offset beyond the end of the image.";
+            }
+
+            data.erase(data.begin(), data.begin() + offset);
+        }
+
+        return NULL;
+    }
+
+    // First pass checks every record and finds the address range
+    HexExtent extent;
+    const char* error = parse_hex_records(data.data(), data.size(), format, extent);
+    if(error)
+    {
+        return error;
+    }
+
+    const uint32_t base = (offset == ROM_OFFSET_AUTO) ? ((extent.end ? extent.lowest : 0)) : offset;
+
+    if(extent.end && extent.lowest < base)
+    {
+        return "Hex record below the offset.";
+    }
+
+    const uint64_t size = (extent.end > base) ? extent.end - base : 0;
+    if(size > MAX_DECODED_SIZE)
+    {
+        return "Hex image too large.";
+    }
+
+    scratch.assign((size_t)size, 0xff);
+
+    HexPlacer placer;
+    placer.image = scratch.data();
+    placer.base = base;
+    placer.size = scratch.size();
+    parse_hex_records(data.data(), data.size(), format, placer);
+
+    // Trailing erased bytes left out of the dump
+    const uint32_t partSize = hex_part_size(scratch);
+    if(partSize > scratch.size())
+    {
+        scratch.resize(partSize, 0xff);
+    }
+
+    data.swap(scratch);
+    return NULL;
+}
+
+// Parse an --offset= option (decimal, or hex with 0x). Returns true if arg was an offset option.
+static inline bool parse_offset_option(const char* arg, uint32_t& offset)
+{
+    if(strncmp(arg, "--offset=", 9) != 0)
+    {
+        return false;
+    }
+
+    char* end = NULL;
+    const unsigned long value = strtoul(arg + 9, &end, 0);
+    if(end == arg + 9 || *end != 0 || value >= ROM_OFFSET_AUTO)
+    {
+        std::cerr << "Invalid offset : " << (arg + 9) << std::endl;
+        exit(-1);
+    }
+
+    offset = (uint32_t)value;
+    return true;
+}
+
+// Parse a --format= option. Returns true if arg was a format option.
+// The output format for "bin", "ihex" or "srec". Returns false for anything else.
+static inline bool format_from_name(const char* name, RomFormat& format)
+{
+    if(strcmp(name, "bin") == 0)
+    {
+        format = FORMAT_BINARY;
+    }
+    else if(strcmp(name, "ihex") == 0)
+    {
+        format = FORMAT_IHEX;
+    }
+    else if(strcmp(name, "srec") == 0)
+    {
+        format = FORMAT_SREC;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static inline bool parse_format_option(const char* arg, RomFormat& format)
+{
+    if(strncmp(arg, "--format=", 9) != 0)
+    {
+        return false;
+    }
+
+    if(!format_from_name(arg + 9, format))
+    {
+        std::cerr << "Unknown output format : " << (arg + 9) << std::endl;
+        exit(-1);
+    }
+
+    return true;
+}
+
+#endif // ROMHEX_H
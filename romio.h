@@ -0,0 +1,291 @@
+/*
+romio.h - Andy Anderson 2020
+
+Minimal io_uring wrapper for the batch modes of dumprom and makerom (--io=uring).
+
+Batch runs over many small files are dominated by I/O latency rather than CPU, so the batch
+modes keep many reads and writes in flight through one ring. The ring is driven with the raw
+syscalls, so there is no dependency on liburing. Where io_uring is not available (not linux,
+old kernel, or blocked by a sandbox) Uring::init() fails and the tools fall back to their
+synchronous fstream path. That includes kernels whose rings lack the read and write
+operations (before 5.6), which are found with IORING_REGISTER_PROBE.
+
+*/
+
+#ifndef ROMIO_H
+#define ROMIO_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ROM_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef ROM_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+
+class Uring
+{
+public:
+    Uring() : m_fd(-1), m_sqRing(NULL), m_cqRing(NULL), m_sqes(NULL), m_sqRingSize(0), m_cqRingSize(0),
+              m_sqesSize(0), m_toSubmit(0), m_inFlight(0), m_enterCalls(0)
+    {
+    }
+
+    ~Uring()
+    {
+        if(m_sqes)
+        {
+            munmap(m_sqes, m_sqesSize);
+        }
+
+        if(m_cqRing && m_cqRing != m_sqRing)
+        {
+            munmap(m_cqRing, m_cqRingSize);
+        }
+
+        if(m_sqRing)
+        {
+            munmap(m_sqRing, m_sqRingSize);
+        }
+
+        if(m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    // Returns false if io_uring is not available.
+    bool init(const unsigned entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        m_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if(m_fd < 0)
+        {
+            return false;
+        }
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if(singleMmap)
+        {
+            m_sqRingSize = m_cqRingSize = (m_sqRingSize > m_cqRingSize) ? m_sqRingSize : m_cqRingSize;
+        }
+
+        m_sqRing = (uint8_t*)mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if(m_sqRing == MAP_FAILED)
+        {
+            m_sqRing = NULL;
+            return false;
+        }
+
+        if(singleMmap)
+        {
+            m_cqRing = m_sqRing;
+        }
+        else
+        {
+            m_cqRing = (uint8_t*)mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if(m_cqRing == MAP_FAILED)
+            {
+                m_cqRing = NULL;
+                return false;
+            }
+        }
+
+        m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_sqes = (struct io_uring_sqe*)mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if(m_sqes == MAP_FAILED)
+        {
+            m_sqes = NULL;
+            return false;
+        }
+
+        m_sqHead = (unsigned*)(m_sqRing + params.sq_off.head);
+        m_sqTail = (unsigned*)(m_sqRing + params.sq_off.tail);
+        m_sqMask = *(unsigned*)(m_sqRing + params.sq_off.ring_mask);
+        m_sqArray = (unsigned*)(m_sqRing + params.sq_off.array);
+        m_sqEntries = params.sq_entries;
+
+        m_cqHead = (unsigned*)(m_cqRing + params.cq_off.head);
+        m_cqTail = (unsigned*)(m_cqRing + params.cq_off.tail);
+        m_cqMask = *(unsigned*)(m_cqRing + params.cq_off.ring_mask);
+        m_cqes = (struct io_uring_cqe*)(m_cqRing + params.cq_off.cqes);
+
+        return supports(IORING_OP_READ) && supports(IORING_OP_WRITE);
+    }
+
+    // True if another operation can be queued. In flight operations are limited to the
+    // submission queue size, so the completion queue (at least as large) can never overflow.
+    bool can_queue() const
+    {
+        return m_inFlight < m_sqEntries;
+    }
+
+    unsigned in_flight() const
+    {
+        return m_inFlight;
+    }
+
+    uint64_t enter_calls() const
+    {
+        return m_enterCalls;
+    }
+
+    void queue_read(const int fd, void* buffer, const uint32_t length, const uint64_t offset, const uint64_t userData)
+    {
+        queue(IORING_OP_READ, fd, buffer, length, offset, userData);
+    }
+
+    void queue_write(const int fd, const void* buffer, const uint32_t length, const uint64_t offset, const uint64_t userData)
+    {
+        queue(IORING_OP_WRITE, fd, (void*)buffer, length, offset, userData);
+    }
+
+    // Submit everything queued and wait for at least one completion. Returns false on error.
+    bool submit_and_wait()
+    {
+        for(;;)
+        {
+            ++m_enterCalls;
+            const int result = (int)syscall(__NR_io_uring_enter, m_fd, m_toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+            if(result >= 0)
+            {
+                m_toSubmit -= result;
+                return true;
+            }
+
+            if(errno != EINTR)
+            {
+                return false;
+            }
+        }
+    }
+
+    // Pop one completion. Returns false when there are none waiting.
+    bool completion(uint64_t& userData, int32_t& result)
+    {
+        const unsigned head = *m_cqHead;
+
+        if(head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+
+        const struct io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+        userData = cqe.user_data;
+        result = cqe.res;
+
+        __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+        --m_inFlight;
+
+        return true;
+    }
+
+private:
+    // True if the kernel implements the operation. Rings can be set up from 5.1, but IORING_OP_READ
+    // and IORING_OP_WRITE only complete from 5.6 (before that they fail with -EINVAL), and kernels
+    // older than that have no IORING_REGISTER_PROBE either, so a failed probe means not supported.
+    bool supports(const uint8_t opcode)
+    {
+        const unsigned maxOps = 256;
+        uint8_t buffer[sizeof(struct io_uring_probe) + maxOps * sizeof(struct io_uring_probe_op)];
+        memset(buffer, 0, sizeof(buffer));
+
+        struct io_uring_probe* probe = (struct io_uring_probe*)buffer;
+        if(syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, maxOps) < 0)
+        {
+            return false;
+        }
+
+        return opcode < probe->ops_len && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    void queue(const uint8_t opcode, const int fd, void* buffer, const uint32_t length, const uint64_t offset, const uint64_t userData)
+    {
+        const unsigned tail = *m_sqTail;
+        const unsigned index = tail & m_sqMask;
+
+        struct io_uring_sqe& sqe = m_sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.addr = (uint64_t)(uintptr_t)buffer;
+        sqe.len = length;
+        sqe.off = offset;
+        sqe.user_data = userData;
+
+        m_sqArray[index] = index;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        ++m_toSubmit;
+        ++m_inFlight;
+    }
+
+    int m_fd;
+    uint8_t* m_sqRing;
+    uint8_t* m_cqRing;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqRingSize;
+    size_t m_cqRingSize;
+    size_t m_sqesSize;
+
+    unsigned* m_sqHead;
+    unsigned* m_sqTail;
+    unsigned m_sqMask;
+    unsigned* m_sqArray;
+    unsigned m_sqEntries;
+
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned m_cqMask;
+    struct io_uring_cqe* m_cqes;
+
+    unsigned m_toSubmit;
+    unsigned m_inFlight;
+    uint64_t m_enterCalls;
+};
+
+#endif // ROM_HAVE_IO_URING
+
+// Parse an --io= option. Returns true if arg was an io option; uring is set for --io=uring.
+static inline bool parse_io_option(const char* arg, bool& uring)
+{
+    if(strncmp(arg, "--io=", 5) != 0)
+    {
+        return false;
+    }
+
+    if(strcmp(arg + 5, "uring") == 0)
+    {
+        uring = true;
+    }
+    else if(strcmp(arg + 5, "sync") == 0)
+    {
+        uring = false;
+    }
+    else
+    {
+        std::cerr << "Unknown io backend : " << (arg + 5) << std::endl;
+        exit(-1);
+    }
+
+    return true;
+}
+
+#endif // ROMIO_H
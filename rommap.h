@@ -0,0 +1,105 @@
+/*
+rommap.h - Andy Anderson 2020
+
+Read-only view of a whole file, for the index and database files of romfp, romsim and romgrep.
+
+The file is mapped into memory where the OS allows, so opening even a large index costs the
+same as opening a small one and a query only touches the pages it looks at. Elsewhere it is
+read with a single sized read().
+
+*/
+
+#ifndef ROMMAP_H
+#define ROMMAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "epsonrom.h"
+
+class MappedFile
+{
+public:
+    explicit MappedFile(const char* fileName) : m_data(NULL), m_size(0)
+    {
+#ifdef _WIN32
+        std::ifstream inFile(fileName, std::ios::in | std::ios::binary);
+        if(!inFile)
+        {
+            fatal("failed to open input file.", fileName);
+        }
+
+        inFile.seekg(0, std::ios::end);
+        m_buffer.resize((size_t)inFile.tellg());
+        inFile.seekg(0, std::ios::beg);
+        inFile.read((char*)m_buffer.data(), m_buffer.size());
+        if(!inFile)
+        {
+            fatal("failed to read input file.", fileName);
+        }
+
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+#else
+        const int fd = open(fileName, O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0)
+        {
+            fatal("failed to open input file.", fileName);
+        }
+
+        m_size = (size_t)st.st_size;
+        if(m_size)
+        {
+            void* mapped = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(mapped == MAP_FAILED)
+            {
+                fatal("failed to map input file.", fileName);
+            }
+            m_data = (const uint8_t*)mapped;
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if(m_data)
+        {
+            munmap((void*)m_data, m_size);
+        }
+#endif
+    }
+
+    const uint8_t* data() const
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const uint8_t* m_data;
+    size_t m_size;
+#ifdef _WIN32
+    std::vector<uint8_t> m_buffer;
+#endif
+};
+
+#endif // ROMMAP_H
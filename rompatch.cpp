@@ -0,0 +1,67 @@
+/*
+rompatch - Andy Anderson 2020
+
+Apply a patch made by romdiff to a ROM capsule image.
+
+The patch records checksums of the image it was made from and of the result, so it is only
+applied to the right image and the result is checked before it is written.
+
+To compile on linux;
+
+    g++ -O2 rompatch.cpp -o rompatch
+
+Usage;
+
+    rompatch <old romfile> <patchfile> <new romfile>
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include "epsonrom.h"
+#include "romdelta.h"
+
+static void usage()
+{
+    std::cout << "Usage: rompatch <old romfile> <patchfile> <new romfile>\n" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 4)
+    {
+        usage();
+        exit(-1);
+    }
+
+    std::vector<uint8_t> oldImage;
+    if(!load_image(argv[1], oldImage))
+    {
+        fatal("failed to open input file.", argv[1]);
+    }
+
+    std::ifstream patchFile(argv[2], std::ios::in | std::ios::binary);
+    if(!patchFile)
+    {
+        fatal("failed to open input file.", argv[2]);
+    }
+
+    const std::vector<uint8_t> patch((std::istreambuf_iterator<char>(patchFile)), std::istreambuf_iterator<char>());
+
+    std::vector<uint8_t> newImage;
+    const char* error = apply_patch(oldImage.data(), (uint32_t)oldImage.size(), patch.data(), patch.size(), newImage);
+    if(error)
+    {
+        fatal(error, argv[2]);
+    }
+
+    save_image(argv[3], newImage);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+/*
+romplan - Andy Anderson 2020
+
+Show the layout makerom would produce for a set of files, or check whether many candidate sets
+fit, without reading the files. Only their sizes are used (see romplan.h).
+
+To compile on linux;
+
+    g++ -O2 romplan.cpp -o romplan
+
+Usage;
+
+    romplan [--capacity=auto|64|128|256] <file1> [file2...]
+    romplan [--capacity=auto|64|128|256] -b <listfile>
+
+The first form prints the capacity, directory and the blocks each file would occupy. A listfile
+is in the makerom format, one "<romfile> <file1> [file2...]" per line, and each line is reported
+as the part it fits and the space left, or why it does not fit. Each file is looked up once
+however many sets it appears in. The exit status is 1 if any set does not fit.
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <unordered_map>
+
+#include "epsonrom.h"
+#include "romplan.h"
+
+static void usage()
+{
+    std::cout << "Usage: romplan [--capacity=auto|64|128|256] <file1> [file2...]\n"
+                 "       romplan [--capacity=auto|64|128|256] -b <listfile>\n" << std::endl;
+}
+
+static void print_layout(const RomInput* inputs, const size_t inputCount, const RomPlan& plan)
+{
+    std::cout << "Capacity  " << (unsigned)plan.capacity * 8 << "kbit (" << rom_size(plan.capacity) << " bytes)\n";
+    std::cout << "Directory " << (unsigned)plan.dirEntries << " entries (" << plan.dirEntries * sizeof(DirEntry) << " bytes), "
+              << plan.entries << " used\n";
+
+    // As build_rom() allocates them
+    uint32_t nextBlock = 1;
+    char line[80];
+
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        const uint32_t chunks = (uint32_t)((inputs[iFile].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        const uint32_t extents = file_extents(inputs[iFile].size);
+
+        int length = snprintf(line, sizeof(line), "%-12s %6zu bytes, %u extent%s, ", inputs[iFile].name, inputs[iFile].size,
+                              extents, extents == 1 ? "" : "s");
+        if(chunks)
+        {
+            snprintf(line + length, sizeof(line) - length, "blocks %u-%u", nextBlock, nextBlock + chunks - 1);
+        }
+        else
+        {
+            snprintf(line + length, sizeof(line) - length, "no blocks");
+        }
+
+        std::cout << line << "\n";
+        nextBlock += chunks;
+    }
+
+    std::cout << plan.blocks << " of " << plan.blockCount << " blocks used, " << plan.freeBytes << " bytes free" << std::endl;
+}
+
+static bool plan_files(const uint8_t capacity, char** files, const int fileCount)
+{
+    std::vector<RomInput> inputs(fileCount);
+
+    for(int i=0; i<fileCount; ++i)
+    {
+        uint8_t name[8];
+        uint8_t type[3];
+        if(!split_file_name(files[i], name, type))
+        {
+            fatal(ERROR_NOT_8_3, files[i]);
+        }
+
+        inputs[i].name = files[i];
+        inputs[i].data = NULL;
+        if(!stat_file_size(files[i], inputs[i].size))
+        {
+            fatal(ERROR_OPEN_INPUT, files[i]);
+        }
+    }
+
+    RomPlan plan;
+    if(!plan_rom(inputs.data(), inputs.size(), capacity, plan))
+    {
+        std::cout << plan_error(plan) << " The files need " << plan.entries << " directory entries and " << plan.size << " bytes." << std::endl;
+        return false;
+    }
+
+    print_layout(inputs.data(), inputs.size(), plan);
+    return true;
+}
+
+static bool plan_batch(const uint8_t capacity, const char* listName)
+{
+    std::ifstream listFile(listName);
+    if(!listFile)
+    {
+        fatal("failed to open input file.", listName);
+    }
+
+    std::unordered_map<std::string, size_t> sizes;
+    std::vector<RomInput> inputs;
+    std::vector<std::string> names;
+    std::string line;
+    bool allFit = true;
+
+    while(std::getline(listFile, line))
+    {
+        std::istringstream fields(line);
+        std::string romName;
+
+        if(!(fields >> romName) || romName[0] == '#')
+        {
+            continue;
+        }
+
+        names.clear();
+        std::string fileName;
+        while(fields >> fileName)
+        {
+            names.push_back(fileName);
+        }
+
+        inputs.resize(names.size());
+        for(size_t i=0; i<names.size(); ++i)
+        {
+            std::unordered_map<std::string, size_t>::iterator known = sizes.find(names[i]);
+            if(known == sizes.end())
+            {
+                uint8_t name[8];
+                uint8_t type[3];
+                size_t size;
+                if(!split_file_name(names[i].c_str(), name, type))
+                {
+                    fatal(ERROR_NOT_8_3, names[i].c_str());
+                }
+
+                if(!stat_file_size(names[i].c_str(), size))
+                {
+                    fatal(ERROR_OPEN_INPUT, names[i].c_str());
+                }
+
+                known = sizes.insert(std::make_pair(names[i], size)).first;
+            }
+
+            inputs[i].name = names[i].c_str();
+            inputs[i].data = NULL;
+            inputs[i].size = known->second;
+        }
+
+        RomPlan plan;
+        if(plan_rom(inputs.data(), inputs.size(), capacity, plan))
+        {
+            std::cout << romName << ": " << (unsigned)plan.capacity * 8 << "kbit, " << plan.blocks << " of " << plan.blockCount
+                      << " blocks, " << plan.freeBytes << " bytes free\n";
+        }
+        else
+        {
+            std::cout << romName << ": " << plan_error(plan) << " needs " << plan.entries << " entries, " << plan.size << " bytes\n";
+            allFit = false;
+        }
+    }
+
+    std::cout << std::flush;
+    return allFit;
+}
+
+int main(int argc, char* argv[])
+{
+    uint8_t capacity = 0;
+    int first = 1;
+
+    while(first < argc && parse_capacity_option(argv[first], capacity))
+    {
+        ++first;
+    }
+
+    if(first >= argc)
+    {
+        usage();
+        exit(-1);
+    }
+
+    if(strcmp(argv[first], "-b") == 0)
+    {
+        if(argc - first != 2)
+        {
+            usage();
+            exit(-1);
+        }
+
+        return plan_batch(capacity, argv[first + 1]) ? 0 : 1;
+    }
+
+    return plan_files(capacity, argv + first, argc - first) ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+/*
+romplan.h - Andy Anderson 2020
+
+Work out the layout build_rom() would produce from the sizes of the files alone (makerom, romplan).
+
+build_rom() gives each file file_extents() directory entries and whole 1K blocks, allocated in
+order, so the directory size, the blocks each file gets and the space left over all follow from
+the file sizes. Planning a set of files is a pass over their sizes - no file is opened or read -
+so many candidate sets can be tried in the time it takes to build one image.
+
+select_files() goes further and chooses, from more files than fit, the subset with the greatest
+total priority. It is a 0/1 knapsack with two budgets - directory entries and blocks - solved
+exactly by dynamic programming over (extents, blocks), which is at most 31 x 255 states.
+
+*/
+
+#ifndef ROMPLAN_H
+#define ROMPLAN_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "epsonrom.h"
+
+struct RomPlan
+{
+    uint8_t capacity;    // CAPACITY_*, or 0 if the files fit no supported part
+    uint32_t entries;    // directory entries used, including the header entry
+    uint8_t dirEntries;  // entries in the directory (rounded up to a multiple of 4)
+    uint32_t blocks;     // blocks used by the files
+    uint32_t blockCount; // blocks in the image
+    uint32_t size;       // bytes the files need
+    uint32_t freeBytes;  // bytes of the image left over
+};
+
+// Plan the image build_rom() would make from the inputs (only their sizes are used). A capacity
+// of 0 plans for the smallest supported part that holds the files. Returns false if the files
+// do not fit, i.e. build_rom() would run out of directory or ROM space.
+static inline bool plan_rom(const RomInput* inputs, const size_t inputCount, const uint8_t capacity, RomPlan& plan)
+{
+    plan.entries = 1; // DirEntry 0 is used as the ROM header
+    plan.blocks = 0;
+
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        plan.entries += file_extents(inputs[iFile].size);
+        plan.blocks += (uint32_t)((inputs[iFile].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+
+    plan.dirEntries = (uint8_t)((plan.entries <= MAX_DIR_ENTRIES) ? ((plan.entries + 3) / 4) * 4 : MAX_DIR_ENTRIES);
+    plan.size = required_size(plan.entries, plan.blocks);
+    plan.capacity = capacity ? capacity : smallest_capacity(plan.size);
+    plan.blockCount = 0;
+    plan.freeBytes = 0;
+
+    if(plan.capacity == 0)
+    {
+        return false;
+    }
+
+    const uint32_t romSize = rom_size(plan.capacity);
+    plan.blockCount = (romSize - plan.dirEntries * (uint32_t)sizeof(DirEntry)) / BLOCK_SIZE;
+
+    if(plan.entries > MAX_DIR_ENTRIES || plan.size > romSize)
+    {
+        return false;
+    }
+
+    plan.freeBytes = romSize - plan.size;
+
+    return true;
+}
+
+// The fatal() message for a plan that does not fit.
+static inline const char* plan_error(const RomPlan& plan)
+{
+    return (plan.entries > MAX_DIR_ENTRIES) ? "Out of directory space." : "Out of ROM space.";
+}
+
+// The capacity asked for (0 for auto), or the smallest that holds the inputs, as makerom and romd build
+// them. Returns 0, with error set, if the inputs do not fit.
+static inline uint8_t choose_capacity(const uint8_t capacity, const RomInput* inputs, const size_t inputCount, const char* outName,
+                                      RomError& error)
+{
+    RomPlan plan;
+    if(!plan_rom(inputs, inputCount, capacity, plan))
+    {
+        error = rom_error(plan_error(plan), outName);
+        return 0;
+    }
+
+    return plan.capacity;
+}
+
+// Choose the inputs with the greatest total priority that build_rom() can fit in the capacity
+// (which must be given). Ties go to the smaller image. Sets selected[i] for each chosen input
+// and returns the total priority; inputs with priority 0 are never chosen.
+static inline uint64_t select_files(const RomInput* inputs, const uint32_t* priorities, const size_t inputCount,
+                                    const uint8_t capacity, bool* selected)
+{
+    const uint32_t romSize = rom_size(capacity);
+    const uint32_t maxExtents = MAX_DIR_ENTRIES - 1; // DirEntry 0 is used as the ROM header
+    const uint32_t maxBlocks = std::min<uint32_t>(romSize / BLOCK_SIZE, 255);
+    const uint32_t states = (maxExtents + 1) * (maxBlocks + 1);
+
+    // best[extents * (maxBlocks + 1) + blocks] is the greatest priority using exactly that many, or -1
+    std::vector<int64_t> best(states, -1);
+    std::vector<uint8_t> keep(inputCount * states, 0);
+    best[0] = 0;
+
+    for(size_t iFile=0; iFile<inputCount; ++iFile)
+    {
+        selected[iFile] = false;
+
+        const uint32_t extents = file_extents(inputs[iFile].size);
+        const uint64_t chunks = (inputs[iFile].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if(priorities[iFile] == 0 || extents > maxExtents || chunks > maxBlocks)
+        {
+            continue;
+        }
+
+        const uint32_t blocks = (uint32_t)chunks;
+
+        // Downwards, so each file is counted once
+        for(uint32_t e=maxExtents; e>=extents && e<=maxExtents; --e)
+        {
+            for(uint32_t b=maxBlocks; b>=blocks && b<=maxBlocks; --b)
+            {
+                const int64_t from = best[(e - extents) * (maxBlocks + 1) + (b - blocks)];
+                int64_t& to = best[e * (maxBlocks + 1) + b];
+
+                if(from >= 0 && from + priorities[iFile] > to)
+                {
+                    to = from + priorities[iFile];
+                    keep[iFile * states + e * (maxBlocks + 1) + b] = 1;
+                }
+            }
+        }
+    }
+
+    // The best state whose directory and blocks fit the image
+    uint32_t bestExtents = 0;
+    uint32_t bestBlocks = 0;
+    for(uint32_t e=0; e<=maxExtents; ++e)
+    {
+        for(uint32_t b=0; b<=maxBlocks; ++b)
+        {
+            const int64_t value = best[e * (maxBlocks + 1) + b];
+            const int64_t bestValue = best[bestExtents * (maxBlocks + 1) + bestBlocks];
+
+            if(value < 0 || required_size(e + 1, b) > romSize)
+            {
+                continue;
+            }
+
+            if(value > bestValue || (value == bestValue && required_size(e + 1, b) < required_size(bestExtents + 1, bestBlocks)))
+            {
+                bestExtents = e;
+                bestBlocks = b;
+            }
+        }
+    }
+
+    const uint64_t total = (uint64_t)best[bestExtents * (maxBlocks + 1) + bestBlocks];
+
+    // Walk back through the files that improved each state
+    uint32_t e = bestExtents;
+    uint32_t b = bestBlocks;
+    for(size_t iFile=inputCount; iFile-- > 0;)
+    {
+        if(keep[iFile * states + e * (maxBlocks + 1) + b])
+        {
+            selected[iFile] = true;
+            e -= file_extents(inputs[iFile].size);
+            b -= (uint32_t)((inputs[iFile].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        }
+    }
+
+    return total;
+}
+
+// Size of a file from the file system, without opening or reading it. Returns false if there is no such file.
+static inline bool stat_file_size(const char* fileName, size_t& size)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if(_stat64(fileName, &st) != 0)
+#else
+    struct stat st;
+    if(stat(fileName, &st) != 0)
+#endif
+    {
+        return false;
+    }
+
+    size = (size_t)st.st_size;
+    return true;
+}
+
+// The capacity for "auto", "64", "128" or "256" (kbit). Returns false for anything else.
+static inline bool capacity_from_name(const char* name, uint8_t& capacity)
+{
+    if(strcmp(name, "auto") == 0)
+    {
+        capacity = 0;
+    }
+    else if(strcmp(name, "64") == 0)
+    {
+        capacity = CAPACITY_64kbit;
+    }
+    else if(strcmp(name, "128") == 0)
+    {
+        capacity = CAPACITY_128kbit;
+    }
+    else if(strcmp(name, "256") == 0)
+    {
+        capacity = CAPACITY_256kbit;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static inline bool parse_capacity_option(const char* arg, uint8_t& capacity)
+{
+    if(strncmp(arg, "--capacity=", 11) != 0)
+    {
+        return false;
+    }
+
+    if(!capacity_from_name(arg + 11, capacity))
+    {
+        std::cerr << "Unknown capacity : " << (arg + 11) << std::endl;
+        exit(-1);
+    }
+
+    return true;
+}
+
+#endif // ROMPLAN_H
@@ -0,0 +1,358 @@
+/*
+romsim - Andy Anderson 2020
+
+Find near-identical ROM capsules (patched revisions, renamed images) in a large collection.
+
+Each image is reduced to a set of features: a hash of every 1K allocation block, as the
+directory walk reads it (i.e. addressed by block_address()), and a hash of every file. The
+header is not a feature, so a changed rom_name or date does not make images look different.
+
+A MinHash signature (64 values) estimates the Jaccard similarity of two feature sets. The
+index stores the signatures and an LSH table - 16 bands of 4 values, sorted by band hash - so
+a query only compares against images that share at least one band, not the whole collection.
+The index is mapped rather than read, and each band is found by binary search, so a query
+reads a few pages of the index whatever the size of the collection.
+
+To compile on linux;
+
+    g++ -O2 romsim.cpp -o romsim
+
+Usage;
+
+    romsim index <index> <romfile> [romfile...]
+    romsim query <index> <romfile> [min similarity]
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "epsonrom.h"
+#include "romhash.h"
+#include "rommap.h"
+
+const char SIM_MAGIC[8] = { 'R', 'O', 'M', 'S', 'I', 'M', '0', '1' };
+
+const int MINHASH_SIZE = 64;
+const int LSH_BANDS = 16;
+const int LSH_ROWS = MINHASH_SIZE / LSH_BANDS;
+
+// Features of different kinds are kept apart, so a one block file does not match its block
+const uint64_t FEATURE_BLOCK = 0x626c6f636b000000ull;
+const uint64_t FEATURE_FILE = 0x66696c6500000000ull;
+
+PACK_PRE
+struct SimHeader
+{
+    char magic[8];
+    uint32_t imageCount;
+    uint32_t stringsSize;
+} PACK_ATTRIBUTE;
+PACK_POST
+
+PACK_PRE
+struct BandEntry
+{
+    uint64_t key;
+    uint32_t image;
+    uint32_t reserved;
+} PACK_ATTRIBUTE;
+PACK_POST
+
+struct Signature
+{
+    uint32_t values[MINHASH_SIZE];
+};
+
+// Collects the block and file features of an image from the directory walk.
+struct FeatureSink
+{
+    std::vector<uint64_t> features;
+    uint64_t fileHash;
+
+    void open(const char* fileName)
+    {
+        fileHash = hash64((const uint8_t*)fileName, strlen(fileName));
+    }
+
+    void write(const uint8_t* data, const uint32_t size)
+    {
+        const uint64_t blockHash = hash64(data, size);
+        features.push_back(mix64(blockHash ^ FEATURE_BLOCK));
+        fileHash = mix64(fileHash ^ blockHash);
+    }
+
+    void close()
+    {
+        features.push_back(mix64(fileHash ^ FEATURE_FILE));
+    }
+};
+
+static void minhash(const std::vector<uint64_t>& features, Signature& signature)
+{
+    for(int i=0; i<MINHASH_SIZE; ++i)
+    {
+        signature.values[i] = 0xffffffff;
+    }
+
+    for(size_t f=0; f<features.size(); ++f)
+    {
+        for(int i=0; i<MINHASH_SIZE; ++i)
+        {
+            // One hash function per signature value, from a per-value seed
+            const uint32_t value = (uint32_t)mix64(features[f] ^ (0x9e3779b97f4a7c15ull * (i + 1)));
+            if(value < signature.values[i])
+            {
+                signature.values[i] = value;
+            }
+        }
+    }
+}
+
+static uint64_t band_key(const Signature& signature, const int band)
+{
+    uint64_t key = mix64(band + 1);
+
+    for(int r=0; r<LSH_ROWS; ++r)
+    {
+        key = mix64(key ^ signature.values[band * LSH_ROWS + r]);
+    }
+
+    return key;
+}
+
+static double similarity(const Signature& a, const Signature& b)
+{
+    int same = 0;
+
+    for(int i=0; i<MINHASH_SIZE; ++i)
+    {
+        same += a.values[i] == b.values[i];
+    }
+
+    return (double)same / MINHASH_SIZE;
+}
+
+// Returns false, having reported why, if the image cannot be read or is not valid.
+static bool image_signature(const char* romFile, Signature& signature)
+{
+    std::vector<uint8_t> image;
+    const char* error = read_image(romFile, image);
+    if(error)
+    {
+        report_error(error, romFile);
+        return false;
+    }
+
+    const char* invalid = verify_rom(image.data(), (uint32_t)image.size());
+    if(invalid)
+    {
+        std::cerr << romFile << ": " << invalid << std::endl;
+        return false;
+    }
+
+    FeatureSink sink;
+    walk_files(image.data(), (uint32_t)image.size(), sink);
+    minhash(sink.features, signature);
+
+    return true;
+}
+
+static bool band_less(const BandEntry& a, const BandEntry& b)
+{
+    return a.key < b.key;
+}
+
+// Images that cannot be read or are not valid are reported and left out. Returns how many.
+static uint32_t build_index(const char* indexName, char** romFiles, const int romCount)
+{
+    fail_if_exists(indexName);
+
+    std::vector<Signature> signatures;
+    std::vector<uint32_t> names;
+    std::vector<BandEntry> bands;
+    std::string strings;
+
+    for(int i=0; i<romCount; ++i)
+    {
+        Signature signature;
+        if(!image_signature(romFiles[i], signature))
+        {
+            continue;
+        }
+
+        const uint32_t image = (uint32_t)signatures.size();
+        signatures.push_back(signature);
+        names.push_back((uint32_t)strings.size());
+        strings.append(romFiles[i]);
+        strings.push_back(0);
+
+        for(int band=0; band<LSH_BANDS; ++band)
+        {
+            BandEntry entry;
+            entry.key = band_key(signature, band);
+            entry.image = image;
+            entry.reserved = 0;
+            bands.push_back(entry);
+        }
+    }
+
+    std::stable_sort(bands.begin(), bands.end(), band_less);
+
+    SimHeader header;
+    memcpy(header.magic, SIM_MAGIC, sizeof(SIM_MAGIC));
+    header.imageCount = (uint32_t)signatures.size();
+    header.stringsSize = (uint32_t)strings.size();
+
+    std::ofstream outFile(indexName, std::ios::out | std::ios::binary);
+    outFile.write((const char*)&header, sizeof(header));
+    if(!signatures.empty())
+    {
+        outFile.write((const char*)signatures.data(), signatures.size() * sizeof(Signature));
+        outFile.write((const char*)names.data(), names.size() * sizeof(uint32_t));
+        outFile.write((const char*)bands.data(), bands.size() * sizeof(BandEntry));
+    }
+    outFile.write(strings.data(), strings.size());
+
+    if(!outFile.good())
+    {
+        fatal("Failed to write to ouput file.", indexName);
+    }
+
+    std::cout << signatures.size() << " images indexed." << std::endl;
+
+    return (uint32_t)(romCount - signatures.size());
+}
+
+struct Match
+{
+    double similarity;
+    uint32_t image;
+
+    bool operator<(const Match& other) const
+    {
+        return similarity > other.similarity || (similarity == other.similarity && image < other.image);
+    }
+};
+
+static void query(const char* indexName, const char* romFile, const double minSimilarity)
+{
+    // Mapped, so a query only reads the signatures and band entries it looks up
+    const MappedFile index(indexName);
+
+    const SimHeader* header = (const SimHeader*)index.data();
+    if(index.size() < sizeof(SimHeader) || memcmp(header->magic, SIM_MAGIC, sizeof(SIM_MAGIC)) != 0)
+    {
+        fatal("Not a similarity index.", indexName);
+    }
+
+    const uint64_t imageCount = header->imageCount;
+    if(sizeof(SimHeader) + imageCount * (sizeof(Signature) + sizeof(uint32_t) + LSH_BANDS * sizeof(BandEntry)) + header->stringsSize != index.size())
+    {
+        fatal("Similarity index is corrupt.", indexName);
+    }
+
+    const Signature* signatures = (const Signature*)(index.data() + sizeof(SimHeader));
+    const uint32_t* names = (const uint32_t*)(signatures + imageCount);
+    const BandEntry* bands = (const BandEntry*)(names + imageCount);
+    const BandEntry* bandsEnd = bands + imageCount * LSH_BANDS;
+    const char* strings = (const char*)bandsEnd;
+
+    // Names are printed straight from the table, so it must end with a terminator
+    if(header->stringsSize && strings[header->stringsSize - 1] != 0)
+    {
+        fatal("Similarity index is corrupt.", indexName);
+    }
+
+    Signature signature;
+    if(!image_signature(romFile, signature))
+    {
+        exit(-1);
+    }
+
+    // Candidates share at least one band with the query
+    std::vector<uint32_t> candidates;
+    for(int band=0; band<LSH_BANDS; ++band)
+    {
+        BandEntry key;
+        key.key = band_key(signature, band);
+
+        const BandEntry* first = std::lower_bound(bands, bandsEnd, key, band_less);
+        for(const BandEntry* entry=first; entry<bandsEnd && entry->key == key.key; ++entry)
+        {
+            if(entry->image >= imageCount)
+            {
+                fatal("Similarity index is corrupt.", indexName);
+            }
+
+            candidates.push_back(entry->image);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    std::vector<Match> matches;
+    for(size_t i=0; i<candidates.size(); ++i)
+    {
+        Match match;
+        match.image = candidates[i];
+        match.similarity = similarity(signature, signatures[match.image]);
+        if(match.similarity >= minSimilarity)
+        {
+            matches.push_back(match);
+        }
+    }
+
+    std::sort(matches.begin(), matches.end());
+
+    for(size_t i=0; i<matches.size(); ++i)
+    {
+        const uint32_t nameOffset = names[matches[i].image];
+        printf("%.3f %s\n", matches[i].similarity, nameOffset < header->stringsSize ? strings + nameOffset : "?");
+    }
+}
+
+static void usage()
+{
+    std::cout << "Usage: romsim index <index> <romfile> [romfile...]\n"
+                 "       romsim query <index> <romfile> [min similarity]\n" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 4)
+    {
+        usage();
+        exit(-1);
+    }
+
+    if(strcmp(argv[1], "index") == 0)
+    {
+        const uint32_t failed = build_index(argv[2], argv + 3, argc - 3);
+        if(failed)
+        {
+            std::cerr << failed << " images could not be indexed." << std::endl;
+            return -1;
+        }
+    }
+    else if(strcmp(argv[1], "query") == 0 && argc <= 5)
+    {
+        const double minSimilarity = (argc == 5) ? atof(argv[4]) : 0.0;
+        query(argv[2], argv[3], minSimilarity);
+    }
+    else
+    {
+        usage();
+        exit(-1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,275 @@
+/*
+romstats.h - Andy Anderson 2020
+
+Per-phase timing and I/O counters for dumprom and makerom (--stats=json).
+
+Time is charged to one phase at a time; a PhaseTimer nested inside another (e.g. the output
+writes made during the directory walk) pauses the outer phase, so the phases add up to the
+total run time. Counters accumulate over every image processed in a batch run.
+
+*/
+
+#ifndef ROMSTATS_H
+#define ROMSTATS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+enum Phase
+{
+    PHASE_OTHER,
+    PHASE_READ,
+    PHASE_SWAP,
+    PHASE_WALK,
+    PHASE_BUILD,
+    PHASE_WRITE,
+    PHASE_COUNT
+};
+
+static const char* const phase_names[PHASE_COUNT] = { "other", "read", "swap", "walk", "build", "write" };
+
+// Process CPU time (user + system) in seconds.
+static inline double cpu_seconds()
+{
+#ifdef _WIN32
+    FILETIME creation, exitTime, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user);
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) / 1e7;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+static inline uint64_t peak_rss_bytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return (uint64_t)usage.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+}
+
+// Read and write syscall counts from /proc/self/io. Returns false where that is not available.
+static inline bool proc_syscalls(uint64_t& reads, uint64_t& writes)
+{
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/io", "r");
+    if(!f)
+    {
+        return false;
+    }
+
+    unsigned long long syscr = 0, syscw = 0;
+    char line[64];
+    int found = 0;
+
+    while(fgets(line, sizeof(line), f))
+    {
+        found += sscanf(line, "syscr: %llu", &syscr);
+        found += sscanf(line, "syscw: %llu", &syscw);
+    }
+
+    fclose(f);
+
+    reads = syscr;
+    writes = syscw;
+    return found == 2;
+#else
+    (void)reads;
+    (void)writes;
+    return false;
+#endif
+}
+
+struct RomStats
+{
+    typedef std::chrono::steady_clock Clock;
+
+    double wall[PHASE_COUNT];
+    double cpu[PHASE_COUNT];
+
+    uint64_t images;
+    uint64_t files;
+    uint64_t extents;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t filesLinked; // dumprom --dedup: files linked to an identical one instead of written
+    uint64_t bytesLinked;
+
+    // I/O calls made by the tool. Where the OS reports actual read/write syscalls
+    // (linux /proc/self/io) those replace the tool's own read/write counts.
+    uint64_t opens;
+    uint64_t closes;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t uringEnters;
+
+    Phase current;
+    Clock::time_point markWall;
+    double markCpu;
+    Clock::time_point startWall;
+    double startCpu;
+    uint64_t startSyscr;
+    uint64_t startSyscw;
+    bool haveProcIo;
+
+    RomStats()
+        : images(0), files(0), extents(0), bytesRead(0), bytesWritten(0), filesLinked(0), bytesLinked(0),
+          opens(0), closes(0), reads(0), writes(0), uringEnters(0), current(PHASE_OTHER),
+          startSyscr(0), startSyscw(0)
+    {
+        for(int i=0; i<PHASE_COUNT; ++i)
+        {
+            wall[i] = 0;
+            cpu[i] = 0;
+        }
+
+        haveProcIo = proc_syscalls(startSyscr, startSyscw);
+        startWall = markWall = Clock::now();
+        startCpu = markCpu = cpu_seconds();
+    }
+
+    // Charge the time since the last switch to the current phase and start timing the next.
+    void switch_to(const Phase next)
+    {
+        const Clock::time_point nowWall = Clock::now();
+        const double nowCpu = cpu_seconds();
+
+        wall[current] += std::chrono::duration<double>(nowWall - markWall).count();
+        cpu[current] += nowCpu - markCpu;
+
+        markWall = nowWall;
+        markCpu = nowCpu;
+        current = next;
+    }
+
+    void print_json(std::ostream& out, const char* tool)
+    {
+        switch_to(current);
+
+        uint64_t syscallReads = reads;
+        uint64_t syscallWrites = writes;
+        uint64_t syscr, syscw;
+
+        if(haveProcIo && proc_syscalls(syscr, syscw))
+        {
+            syscallReads = syscr - startSyscr;
+            syscallWrites = syscw - startSyscw;
+        }
+
+        const double totalWall = std::chrono::duration<double>(markWall - startWall).count();
+        const double totalCpu = markCpu - startCpu;
+
+        char number[32];
+
+        out << "{\"tool\":\"" << tool << "\"";
+
+        snprintf(number, sizeof(number), "%.6f", totalWall);
+        out << ",\"wall_s\":" << number;
+        snprintf(number, sizeof(number), "%.6f", totalCpu);
+        out << ",\"cpu_s\":" << number;
+
+        out << ",\"phases\":{";
+        for(int i=0; i<PHASE_COUNT; ++i)
+        {
+            out << (i ? "," : "") << "\"" << phase_names[i] << "\":{";
+            snprintf(number, sizeof(number), "%.6f", wall[i]);
+            out << "\"wall_s\":" << number;
+            snprintf(number, sizeof(number), "%.6f", cpu[i]);
+            out << ",\"cpu_s\":" << number << "}";
+        }
+        out << "}";
+
+        out << ",\"images\":" << images;
+        out << ",\"files\":" << files;
+        out << ",\"extents\":" << extents;
+        out << ",\"bytes_read\":" << bytesRead;
+        out << ",\"bytes_written\":" << bytesWritten;
+        out << ",\"files_linked\":" << filesLinked;
+        out << ",\"bytes_linked\":" << bytesLinked;
+        out << ",\"syscalls\":{\"open\":" << opens << ",\"close\":" << closes
+            << ",\"read\":" << syscallReads << ",\"write\":" << syscallWrites
+            << ",\"io_uring_enter\":" << uringEnters
+            << ",\"source\":\"" << (haveProcIo ? "proc" : "tool") << "\"}";
+        out << ",\"peak_rss_bytes\":" << peak_rss_bytes();
+        out << "}" << std::endl;
+    }
+};
+
+// Times a scope as the given phase. Does nothing when stats are not being collected.
+class PhaseTimer
+{
+public:
+    PhaseTimer(RomStats* stats, const Phase phase) : m_stats(stats), m_previous(PHASE_OTHER)
+    {
+        if(m_stats)
+        {
+            m_previous = m_stats->current;
+            m_stats->switch_to(phase);
+        }
+    }
+
+    ~PhaseTimer()
+    {
+        if(m_stats)
+        {
+            m_stats->switch_to(m_previous);
+        }
+    }
+
+private:
+    RomStats* m_stats;
+    Phase m_previous;
+};
+
+// Parse a --stats= option. Returns true if arg was a stats option (json is the only format).
+static inline bool parse_stats_option(const char* arg, bool& enabled)
+{
+    if(strncmp(arg, "--stats=", 8) != 0)
+    {
+        return false;
+    }
+
+    if(strcmp(arg + 8, "json") != 0)
+    {
+        std::cerr << "Unknown stats format : " << (arg + 8) << std::endl;
+        exit(-1);
+    }
+
+    enabled = true;
+    return true;
+}
+
+#endif // ROMSTATS_H